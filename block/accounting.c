@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -278,6 +279,51 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/**
+ * block_acct_submit_batch:
+ * @stats: the submit stats of each request in the batch, or NULL entries for
+ *         requests that are not accounted
+ * @n: number of requests in the batch
+ *
+ * Account a batch of @n requests that were submitted with one system call.
+ * Each node is accounted once, however many of its requests the batch
+ * contains.  May be called from any thread.
+ */
+void block_acct_submit_batch(BlockAcctSubmitStats **stats, unsigned int n)
+{
+    int bin = MIN(63 - clz64(n), BLOCK_ACCT_SUBMIT_BATCH_BINS - 1);
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        unsigned int nr_requests = 1;
+
+        if (!stats[i]) {
+            continue;
+        }
+
+        /* Requests of the same node are usually next to each other */
+        for (j = 0; j < i && stats[j] != stats[i]; j++) {
+            /* nothing */
+        }
+        if (j < i) {
+            continue;
+        }
+        for (j = i + 1; j < n; j++) {
+            nr_requests += stats[j] == stats[i];
+        }
+
+        stat64_inc(&stats[i]->submissions);
+        stat64_add(&stats[i]->requests, nr_requests);
+        stat64_inc(&stats[i]->batch_bins[bin]);
+    }
+}
+
+/* Lower boundary of @bin of BlockAcctSubmitStats::batch_bins, for @bin > 0 */
+uint64_t block_acct_submit_batch_boundary(int bin)
+{
+    return 1ULL << bin;
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
@@ -2600,6 +2600,62 @@ int coroutine_fn blk_co_pwrite_compressed(BlockBackend *blk, int64_t offset,
                                BDRV_REQ_WRITE_COMPRESSED);
 }
 
+ssize_t coroutine_fn blk_co_compress(BlockBackend *blk, int64_t offset,
+                                     int64_t bytes, const void *buf,
+                                     void *out_buf, size_t out_size)
+{
+    ssize_t ret = -ENOMEDIUM;
+    IO_OR_GS_CODE();
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        ret = blk_check_byte_request(blk, offset, bytes);
+        if (ret == 0) {
+            ret = bdrv_co_compress(blk->root, offset, bytes, buf,
+                                   out_buf, out_size);
+        }
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
+/* The write counts against the throttle limits with its uncompressed size */
+int coroutine_fn blk_co_pwrite_compressed_data(BlockBackend *blk,
+                                               int64_t offset, int64_t bytes,
+                                               const void *out_buf,
+                                               size_t out_len)
+{
+    BlockDriverState *bs;
+    int ret = -ENOMEDIUM;
+    IO_OR_GS_CODE();
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        /* Call blk_bs() only after waiting, the graph may have changed */
+        bs = blk_bs(blk);
+
+        ret = blk_check_byte_request(blk, offset, bytes);
+        if (ret == 0) {
+            bdrv_inc_in_flight(bs);
+            if (blk->public.throttle_group_member.throttle_state) {
+                throttle_group_co_io_limits_intercept(
+                    &blk->public.throttle_group_member, bytes, THROTTLE_WRITE);
+            }
+            ret = bdrv_co_pwrite_compressed_data(blk->root, offset, bytes,
+                                                 out_buf, out_len);
+            bdrv_dec_in_flight(bs);
+        }
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 int coroutine_fn blk_co_truncate(BlockBackend *blk, int64_t offset, bool exact,
                                  PreallocMode prealloc, BdrvRequestFlags flags,
                                  Error **errp)
@@ -2879,6 +2935,33 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * See bdrv_co_sendfile().  Throttled BlockBackends and invalid requests
+ * return -ENOTSUP, so that they keep going through blk_co_preadv().
+ */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, QIOChannel *ioc,
+                                 const struct iovec *hdr, int hdr_niov)
+{
+    int ret = -ENOTSUP;
+    IO_CODE();
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        if (!blk->public.throttle_group_member.throttle_state) {
+            if (blk_check_byte_request(blk, offset, bytes) == 0) {
+                ret = bdrv_co_sendfile(blk->root, offset, bytes, ioc,
+                                       hdr, hdr_niov);
+            }
+        }
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     GLOBAL_STATE_CODE();
@@ -80,6 +80,9 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
     AioContext *ctx;
+    g_autofree AioContext **iothread_ctxs = NULL;
+    size_t num_iothread_ctxs = 0;
+    const char *iothread_id = export->iothread;
     uint64_t perm;
     int ret;
 
@@ -113,16 +116,50 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         return NULL;
     }
 
+    if (export->iothreads) {
+        strList *e;
+
+        if (export->iothread) {
+            error_setg(errp, "iothread and iothreads cannot be used together");
+            return NULL;
+        }
+        if (!drv->supports_multithread) {
+            error_setg(errp, "Export type '%s' does not support iothreads",
+                       BlockExportType_str(export->type));
+            return NULL;
+        }
+
+        iothread_ctxs = g_new(AioContext *,
+                              QAPI_LIST_LENGTH(export->iothreads));
+        for (e = export->iothreads; e; e = e->next) {
+            IOThread *iothread = iothread_by_id(e->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", e->value);
+                return NULL;
+            }
+            iothread_ctxs[num_iothread_ctxs++] =
+                iothread_get_aio_context(iothread);
+        }
+
+        /*
+         * The node lives in the first iothread.  Requests come from all of
+         * them, so it must stay there.
+         */
+        iothread_id = export->iothreads->value;
+        fixed_iothread = true;
+    }
+
     ctx = bdrv_get_aio_context(bs);
 
-    if (export->iothread) {
+    if (iothread_id) {
         IOThread *iothread;
         AioContext *new_ctx;
         Error **set_context_errp;
 
-        iothread = iothread_by_id(export->iothread);
+        iothread = iothread_by_id(iothread_id);
         if (!iothread) {
-            error_setg(errp, "iothread \"%s\" not found", export->iothread);
+            error_setg(errp, "iothread \"%s\" not found", iothread_id);
             goto fail;
         }
 
@@ -178,6 +215,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .id         = g_strdup(export->id),
         .ctx        = ctx,
         .blk        = blk,
+        .iothread_ctxs      = g_steal_pointer(&iothread_ctxs),
+        .num_iothread_ctxs  = num_iothread_ctxs,
     };
 
     ret = drv->create(exp, export, errp);
@@ -196,6 +235,7 @@ fail:
         blk_unref(blk);
     }
     if (exp) {
+        g_free(exp->iothread_ctxs);
         g_free(exp->id);
         g_free(exp);
     }
@@ -219,6 +259,7 @@ static void blk_exp_delete_bh(void *opaque)
     blk_set_dev_ops(exp->blk, NULL, NULL);
     blk_unref(exp->blk);
     qapi_event_send_block_export_deleted(exp->id);
+    g_free(exp->iothread_ctxs);
     g_free(exp->id);
     g_free(exp);
 }
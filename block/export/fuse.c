@@ -19,7 +19,10 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu/coroutine.h"
+#include "qemu/lockable.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 #include "block/aio.h"
 #include "block/block_int-common.h"
 #include "block/export.h"
@@ -29,6 +32,8 @@
 #include "qapi/qapi-commands-block.h"
 #include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
+#include "standard-headers/linux/fuse.h"
+#include "trace.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -39,20 +44,69 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/ioctl.h>
 #endif
 
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Largest write request we accept.  The kernel additionally limits requests
+ * to its max_pages_limit (1 MiB by default).
+ */
+#define FUSE_MAX_WRITE_BYTES (4 * MiB)
+
+/* A request buffer must hold the largest write, headers included */
+#define FUSE_REQUEST_BUF_SIZE \
+    MAX(FUSE_MIN_READ_BUFFER, \
+        sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in) + \
+        FUSE_MAX_WRITE_BYTES)
+
+/*
+ * Number of asynchronous requests (readahead, async direct I/O) the kernel
+ * may have in flight.  Its default of 12 is too low to keep several queues
+ * busy.
+ */
+#define FUSE_MAX_BACKGROUND 64
+
+typedef struct FuseExport FuseExport;
 
-typedef struct FuseExport {
+/*
+ * A queue reads requests from its own FUSE fd, and processes them in its
+ * AioContext.  Replies must be written to the fd the request came from.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+
+    AioContext *ctx;
+    int fuse_fd;
+
+    /*
+     * Buffer into which requests are read.  A request copies what it needs
+     * before it yields for the first time, so the next one can be read into
+     * the same buffer.
+     */
+    char *request_buf;
+    size_t request_len;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    /*
+     * One queue per iothread, or a single one in the export's AioContext.
+     * The first queue uses the session fd, the others clones of it.
+     */
+    FuseQueue *queues;
+    size_t num_queues;
+
+    /* Serializes growing the image for writes beyond EOF */
+    CoMutex resize_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -62,9 +116,24 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
+
+/* Arguments of the requests we handle, as copied from the request buffer */
+typedef union FuseRequestArgs {
+    struct fuse_init_in init;
+    struct fuse_setattr_in setattr;
+    struct fuse_read_in read;
+    struct fuse_write_in write;
+    struct fuse_fallocate_in fallocate;
+    struct fuse_lseek_in lseek;
+} FuseRequestArgs;
 
 static GHashTable *exports;
+
+/*
+ * libfuse is only used to mount and unmount the export, requests are read
+ * and processed by the queues.
+ */
 static const struct fuse_lowlevel_ops fuse_ops;
 
 static void fuse_export_shutdown(BlockExport *exp);
@@ -74,19 +143,35 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
-static void read_from_fuse_export(void *opaque);
+static int setup_fuse_queues(FuseExport *exp, Error **errp);
+static void read_from_fuse_fd(void *opaque);
+static void coroutine_fn co_fuse_process_request(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+/**
+ * Install or remove the fd handlers of all queues.
+ */
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        aio_set_fd_handler(q->ctx, q->fuse_fd,
+                           enable ? read_from_fuse_fd : NULL,
+                           NULL, NULL, NULL, enable ? q : NULL);
+    }
+    exp->fd_handler_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -96,10 +181,12 @@ static void fuse_export_drained_end(void *opaque)
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /* Without iothreads, the only queue follows the export */
+    if (!exp->common.num_iothread_ctxs && exp->num_queues) {
+        exp->queues[0].ctx = exp->common.ctx;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -142,11 +229,13 @@ static int fuse_export_create(BlockExport *blk_exp,
 
     /*
      * We handle draining ourselves using an in-flight counter and by disabling
-     * the FUSE fd handler. Do not queue BlockBackend requests, they need to
+     * the FUSE fd handlers. Do not queue BlockBackend requests, they need to
      * complete so the in-flight counter reaches zero.
      */
     blk_set_disable_request_queuing(exp->common.blk, true);
 
+    qemu_co_mutex_init(&exp->resize_lock);
+
     init_exports_table();
 
     /*
@@ -206,6 +295,12 @@ static int fuse_export_create(BlockExport *blk_exp,
         goto fail;
     }
 
+    ret = setup_fuse_queues(exp, errp);
+    if (ret < 0) {
+        fuse_export_shutdown(blk_exp);
+        goto fail;
+    }
+
     return 0;
 
 fail:
@@ -237,8 +332,8 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     int ret;
 
     /*
-     * max_read needs to match what fuse_init() sets.
-     * max_write need not be supplied.
+     * max_read can only be passed as a mount option.  max_write is
+     * negotiated in fuse_init().
      */
     mount_opts = g_strdup_printf("max_read=%zu,default_permissions%s",
                                  FUSE_MAX_BOUNCE_BYTES,
@@ -269,11 +364,6 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
-
     return 0;
 
 fail:
@@ -282,28 +372,84 @@ fail:
 }
 
 /**
- * Callback to be invoked when the FUSE session FD can be read from.
- * (This is basically the FUSE event loop.)
+ * Open a new FUSE fd that is attached to the same connection as the
+ * session fd.  The kernel hands each request to only one of the fds.
  */
-static void read_from_fuse_export(void *opaque)
+static int clone_fuse_fd(FuseExport *exp, Error **errp)
 {
-    FuseExport *exp = opaque;
-    int ret;
+#ifdef __linux__
+    uint32_t session_fd = fuse_session_fd(exp->fuse_session);
+    int fd;
 
-    blk_exp_ref(&exp->common);
+    fd = qemu_open("/dev/fuse", O_RDWR, errp);
+    if (fd < 0) {
+        return -errno;
+    }
 
-    qatomic_inc(&exp->in_flight);
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &session_fd) < 0) {
+        int ret = -errno;
 
-    do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
-    } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+        error_setg_errno(errp, errno, "Failed to clone FUSE session fd");
+        qemu_close(fd);
+        return ret;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
+    return fd;
+#else
+    error_setg(errp, "FUSE exports only support iothreads on Linux");
+    return -ENOTSUP;
+#endif
+}
 
-out:
+/**
+ * Create one queue per iothread (or a single one if there are none), and
+ * start reading requests.
+ */
+static int setup_fuse_queues(FuseExport *exp, Error **errp)
+{
+    size_t i;
+
+    exp->num_queues = MAX(exp->common.num_iothread_ctxs, 1);
+    exp->queues = g_new0(FuseQueue, exp->num_queues);
+    for (i = 0; i < exp->num_queues; i++) {
+        exp->queues[i].fuse_fd = -1;
+    }
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        q->exp = exp;
+        q->ctx = exp->common.num_iothread_ctxs ?
+                 exp->common.iothread_ctxs[i] : exp->common.ctx;
+
+        if (i == 0) {
+            q->fuse_fd = fuse_session_fd(exp->fuse_session);
+        } else {
+            q->fuse_fd = clone_fuse_fd(exp, errp);
+            if (q->fuse_fd < 0) {
+                return q->fuse_fd;
+            }
+        }
+
+        /* Another queue may take a request we have been woken up for */
+        if (!g_unix_set_fd_nonblocking(q->fuse_fd, true, NULL)) {
+            int ret = -errno;
+
+            error_setg_errno(errp, errno,
+                             "Failed to make FUSE fd non-blocking");
+            return ret;
+        }
+
+        q->request_buf = g_malloc(FUSE_REQUEST_BUF_SIZE);
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
+
+    return 0;
+}
+
+static void fuse_export_dec_in_flight(FuseExport *exp)
+{
     if (qatomic_fetch_dec(&exp->in_flight) == 1) {
         aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
     }
@@ -311,6 +457,71 @@ out:
     blk_exp_unref(&exp->common);
 }
 
+/**
+ * Send the reply to request @unique.  @ret is 0 or a negative errno; only
+ * on success, the @len bytes at @buf are sent as its payload.
+ */
+static void fuse_reply(FuseQueue *q, uint64_t unique, int ret,
+                       const void *buf, size_t len)
+{
+    struct fuse_out_header out_hdr = {
+        .len    = sizeof(out_hdr) + (ret < 0 ? 0 : len),
+        .error  = ret < 0 ? ret : 0,
+        .unique = unique,
+    };
+    struct iovec iov[] = {
+        { .iov_base = &out_hdr,     .iov_len = sizeof(out_hdr) },
+        { .iov_base = (void *)buf,  .iov_len = len },
+    };
+
+    /*
+     * Errors are ignored: ENOENT means the request was interrupted and the
+     * kernel has stopped waiting for it, anything else that the connection
+     * is gone.  Either way, there is no one to report them to.
+     */
+    RETRY_ON_EINTR(writev(q->fuse_fd, iov, ret < 0 || !len ? 1 : 2));
+}
+
+/**
+ * Callback to be invoked when a queue's FUSE fd can be read from.  Reads
+ * one request and processes it in a coroutine, so that more requests can be
+ * read while it waits for the block layer.
+ */
+static void read_from_fuse_fd(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    Coroutine *co;
+    ssize_t ret;
+
+    blk_exp_ref(&exp->common);
+
+    qatomic_inc(&exp->in_flight);
+
+    ret = RETRY_ON_EINTR(read(q->fuse_fd, q->request_buf,
+                              FUSE_REQUEST_BUF_SIZE));
+    if (ret < 0) {
+        if (errno == ENODEV) {
+            /* Unmounted, no more requests will come */
+            aio_set_fd_handler(q->ctx, q->fuse_fd,
+                               NULL, NULL, NULL, NULL, NULL);
+        }
+        /* EAGAIN if another queue was faster */
+        goto fail;
+    }
+    if (ret < sizeof(struct fuse_in_header)) {
+        goto fail;
+    }
+
+    q->request_len = ret;
+    co = qemu_coroutine_create(co_fuse_process_request, q);
+    qemu_coroutine_enter(co);
+    return;
+
+fail:
+    fuse_export_dec_in_flight(exp);
+}
+
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -319,10 +530,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+            fuse_export_set_fd_handlers(exp, false);
         }
     }
 
@@ -338,6 +546,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -347,7 +556,15 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    for (i = 0; i < exp->num_queues; i++) {
+        /* The first queue's fd is the session fd, closed above */
+        if (i > 0 && exp->queues[i].fuse_fd >= 0) {
+            qemu_close(exp->queues[i].fuse_fd);
+        }
+        g_free(exp->queues[i].request_buf);
+    }
+    g_free(exp->queues);
+
     g_free(exp->mountpoint);
 }
 
@@ -375,114 +592,131 @@ static bool is_regular_file(const char *path, Error **errp)
 }
 
 /**
- * A chance to set change some parameters supplied to FUSE_INIT.
+ * Negotiate the connection parameters in reply to FUSE_INIT.  Returns the
+ * length of the reply in @out.
  */
-static void fuse_init(void *userdata, struct fuse_conn_info *conn)
+static int fuse_init(FuseExport *exp, struct fuse_init_out *out,
+                     const struct fuse_init_in *in)
 {
+    const uint32_t supported_flags = FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC |
+                                     FUSE_BIG_WRITES | FUSE_AUTO_INVAL_DATA |
+                                     FUSE_ASYNC_DIO | FUSE_MAX_PAGES;
+
     /*
-     * MIN_NON_ZERO() would not be wrong here, but what we set here
-     * must equal what has been passed to fuse_session_new().
-     * Therefore, as long as max_read must be passed as a mount option
-     * (which libfuse claims will be changed at some point), we have
-     * to set max_read to a fixed value here.
+     * Like libfuse, tell the kernel which major version we speak, so that
+     * it can send another FUSE_INIT for that version if it supports it.
      */
-    conn->max_read = FUSE_MAX_BOUNCE_BYTES;
+    if (in->major != FUSE_KERNEL_VERSION) {
+        *out = (struct fuse_init_out) {
+            .major = FUSE_KERNEL_VERSION,
+        };
+        return sizeof(*out);
+    }
 
-    conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
-}
+    /*
+     * Let the kernel send large requests, and have many of them in flight:
+     * with async reads, readahead and direct I/O are not serialized, and
+     * the queues can process all of them concurrently.
+     */
+    *out = (struct fuse_init_out) {
+        .major                  = FUSE_KERNEL_VERSION,
+        .minor                  = MIN(in->minor, FUSE_KERNEL_MINOR_VERSION),
+        .max_readahead          = in->max_readahead,
+        .flags                  = in->flags & supported_flags,
+        .max_background         = FUSE_MAX_BACKGROUND,
+        .congestion_threshold   = FUSE_MAX_BACKGROUND * 3 / 4,
+        .max_write              = FUSE_MAX_WRITE_BYTES,
+        .time_gran              = 1,
+        .max_pages              = FUSE_MAX_WRITE_BYTES /
+                                  qemu_real_host_page_size(),
+    };
 
-/**
- * Let clients look up files.  Always return ENOENT because we only
- * care about the mountpoint itself.
- */
-static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
-{
-    fuse_reply_err(req, ENOENT);
+    return out->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(*out);
 }
 
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_getattr(FuseExport *exp, uint64_t inode,
+                                        struct fuse_attr_out *out)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
 
-    length = blk_getlength(exp->common.blk);
+    GRAPH_RDLOCK_GUARD();
+
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    allocated_blocks = bdrv_co_get_allocated_file_size(blk_bs(exp->common.blk));
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
         allocated_blocks = DIV_ROUND_UP(allocated_blocks, 512);
     }
 
-    statbuf = (struct stat) {
-        .st_ino     = inode,
-        .st_mode    = exp->st_mode,
-        .st_nlink   = 1,
-        .st_uid     = exp->st_uid,
-        .st_gid     = exp->st_gid,
-        .st_size    = length,
-        .st_blksize = blk_bs(exp->common.blk)->bl.request_alignment,
-        .st_blocks  = allocated_blocks,
-        .st_atime   = now,
-        .st_mtime   = now,
-        .st_ctime   = now,
+    *out = (struct fuse_attr_out) {
+        .attr_valid = 1,
+        .attr = {
+            .ino     = inode,
+            .mode    = exp->st_mode,
+            .nlink   = 1,
+            .uid     = exp->st_uid,
+            .gid     = exp->st_gid,
+            .size    = length,
+            .blksize = blk_bs(exp->common.blk)->bl.request_alignment,
+            .blocks  = allocated_blocks,
+            .atime   = now,
+            .mtime   = now,
+            .ctime   = now,
+        },
     };
 
-    fuse_reply_attr(req, &statbuf, 1.);
+    return 0;
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/**
+ * Resize the image.  Only writable exports do that, and they hold the
+ * RESIZE permission for as long as they exist.
+ */
+static int coroutine_fn fuse_co_do_truncate(const FuseExport *exp,
+                                            int64_t size, bool req_zero_write,
+                                            PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    assert(exp->writable);
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
+}
 
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
+/**
+ * Grow the image to at least @size for a write beyond EOF.  Such writes may
+ * run concurrently, so check the length again under resize_lock, lest a
+ * write shrinks the image that another one has just grown.
+ */
+static int coroutine_fn fuse_co_grow(FuseExport *exp, int64_t size)
+{
+    int64_t length;
 
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
+    QEMU_LOCK_GUARD(&exp->resize_lock);
 
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
-        }
+    length = blk_co_getlength(exp->common.blk);
+    if (length < 0) {
+        return length;
     }
-
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
+    if (size <= length) {
+        return 0;
     }
 
-    return ret;
+    return fuse_co_do_truncate(exp, size, true, PREALLOC_MODE_OFF);
 }
 
 /**
@@ -493,201 +727,179 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_setattr(FuseExport *exp, uint64_t inode,
+                                        const struct fuse_setattr_in *in,
+                                        struct fuse_attr_out *out)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int supported_attrs;
+    /* The file handle and lock owner only tell who is asking */
+    uint32_t to_set = in->valid & ~(FATTR_FH | FATTR_LOCKOWNER);
+    uint32_t supported_attrs;
     int ret;
 
-    supported_attrs = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE;
+    supported_attrs = FATTR_SIZE | FATTR_MODE;
     if (exp->allow_other) {
-        supported_attrs |= FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID;
+        supported_attrs |= FATTR_UID | FATTR_GID;
     }
 
     if (to_set & ~supported_attrs) {
-        fuse_reply_err(req, ENOTSUP);
-        return;
+        return -ENOTSUP;
     }
 
     /* Do some argument checks first before committing to anything */
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /*
          * Without allow_other, non-owners can never access the export, so do
          * not allow setting permissions for them
          */
-        if (!exp->allow_other &&
-            (statbuf->st_mode & (S_IRWXG | S_IRWXO)) != 0)
-        {
-            fuse_reply_err(req, EPERM);
-            return;
+        if (!exp->allow_other && (in->mode & (S_IRWXG | S_IRWXO)) != 0) {
+            return -EPERM;
         }
 
         /* +w for read-only exports makes no sense, disallow it */
-        if (!exp->writable &&
-            (statbuf->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0)
-        {
-            fuse_reply_err(req, EROFS);
-            return;
+        if (!exp->writable && (in->mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0) {
+            return -EROFS;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (to_set & FATTR_SIZE) {
         if (!exp->writable) {
-            fuse_reply_err(req, EACCES);
-            return;
+            return -EACCES;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        ret = fuse_co_do_truncate(exp, in->size, true, PREALLOC_MODE_OFF);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /* Ignore FUSE-supplied file type, only change the mode */
-        exp->st_mode = (statbuf->st_mode & 07777) | S_IFREG;
+        exp->st_mode = (in->mode & 07777) | S_IFREG;
     }
 
-    if (to_set & FUSE_SET_ATTR_UID) {
-        exp->st_uid = statbuf->st_uid;
+    if (to_set & FATTR_UID) {
+        exp->st_uid = in->uid;
     }
 
-    if (to_set & FUSE_SET_ATTR_GID) {
-        exp->st_gid = statbuf->st_gid;
+    if (to_set & FATTR_GID) {
+        exp->st_gid = in->gid;
     }
 
-    fuse_getattr(req, inode, fi);
-}
-
-/**
- * Let clients open a file (i.e., the exported image).
- */
-static void fuse_open(fuse_req_t req, fuse_ino_t inode,
-                      struct fuse_file_info *fi)
-{
-    fuse_reply_open(req, fi);
+    return fuse_co_getattr(exp, inode, out);
 }
 
 /**
- * Handle client reads from the exported image.
+ * Handle client reads from the exported image.  On success, returns the
+ * number of bytes read into *@bufptr, which the caller must free.
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_read(FuseExport *exp, void **bufptr,
+                                     uint64_t offset, uint32_t size)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     void *buf;
     int ret;
 
     /* Limited by max_read, should not happen */
     if (size > FUSE_MAX_BOUNCE_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     /**
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     if (offset + size > length) {
-        size = length - offset;
+        size = offset < length ? length - offset : 0;
+    }
+    if (!size) {
+        return 0;
     }
 
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
+        return -ENOMEM;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_buf(req, buf, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
     }
 
-    qemu_vfree(buf);
+    *bufptr = buf;
+    return size;
 }
 
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_write(FuseExport *exp,
+                                      struct fuse_write_out *out,
+                                      uint64_t offset, uint32_t size,
+                                      const void *buf)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     int ret;
 
     /* Limited by max_write, should not happen */
-    if (size > BDRV_REQUEST_MAX_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+    if (size > FUSE_MAX_WRITE_BYTES) {
+        return -EINVAL;
     }
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_grow(exp, offset + size);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         } else {
-            size = length - offset;
+            size = offset < length ? length - offset : 0;
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_write(req, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pwrite(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        return ret;
     }
+
+    out->size = size;
+    return 0;
 }
 
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_fallocate(FuseExport *exp, uint32_t mode,
+                                          int64_t offset, int64_t length)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -699,34 +911,32 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+        ret = fuse_co_do_truncate(exp, offset + length, true,
+                                  PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
-                                    BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
+                                       BDRV_REQ_MAY_UNMAP |
+                                       BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
                  * fallocate() specifies to return EOPNOTSUPP for unsupported
@@ -744,19 +954,18 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset + length, false,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
-                                    offset, size, 0);
+            ret = blk_co_pwrite_zeroes(exp->common.blk,
+                                       offset, size, 0);
             offset += size;
             length -= size;
         } while (ret == 0 && length > 0);
@@ -766,55 +975,39 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
+    return ret < 0 ? ret : 0;
 }
 
 /**
- * Let clients fsync the exported image.
+ * Let clients fsync the exported image.  Also used for FUSE_FLUSH, which
+ * is sent before an FD to the exported image is closed.  (libfuse notes
+ * this to be a way to return last-minute errors.)
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_fsync(FuseExport *exp)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int ret;
-
-    ret = blk_flush(exp->common.blk);
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
-}
-
-/**
- * Called before an FD to the exported image is closed.  (libfuse
- * notes this to be a way to return last-minute errors.)
- */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
-{
-    fuse_fsync(req, inode, 1, fi);
+    return blk_co_flush(exp->common.blk);
 }
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_lseek(FuseExport *exp,
+                                      struct fuse_lseek_out *out,
+                                      int64_t offset, uint32_t whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
     if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     while (true) {
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        ret = blk_co_block_status_above(exp->common.blk, NULL, offset,
+                                        INT64_MAX, &pnum, NULL, NULL);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -829,36 +1022,33 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
             if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+                return -ENXIO;
             }
-            return;
+            out->offset = offset;
+            return 0;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                out->offset = offset;
+                return 0;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                out->offset = offset;
+                return 0;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
         offset += pnum;
@@ -866,26 +1056,154 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
 }
 #endif
 
-static const struct fuse_lowlevel_ops fuse_ops = {
-    .init       = fuse_init,
-    .lookup     = fuse_lookup,
-    .getattr    = fuse_getattr,
-    .setattr    = fuse_setattr,
-    .open       = fuse_open,
-    .read       = fuse_read,
-    .write      = fuse_write,
-    .fallocate  = fuse_fallocate,
-    .flush      = fuse_flush,
-    .fsync      = fuse_fsync,
+/**
+ * Process the request that read_from_fuse_fd() has just read into
+ * q->request_buf, and send the reply.
+ */
+static void coroutine_fn co_fuse_process_request(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    struct fuse_in_header in_hdr;
+    FuseRequestArgs args = {};
+    size_t args_len = q->request_len - sizeof(in_hdr);
+    union {
+        struct fuse_init_out init;
+        struct fuse_attr_out attr;
+        struct fuse_open_out open;
+        struct fuse_write_out write;
+        struct fuse_lseek_out lseek;
+        struct fuse_statfs_out statfs;
+    } out = {};
+    size_t out_len = 0;
+    void *read_buf = NULL;
+    void *write_buf = NULL;
+    int ret;
+
+    /*
+     * Copy everything we need out of the request buffer before the first
+     * yield, so the next request can be read into it.  Write data is at
+     * the end of the request.
+     */
+    memcpy(&in_hdr, q->request_buf, sizeof(in_hdr));
+    memcpy(&args, q->request_buf + sizeof(in_hdr),
+           MIN(args_len, sizeof(args)));
+    trace_fuse_co_process_request(exp, q - exp->queues, in_hdr.opcode,
+                                  in_hdr.unique);
+
+    if (in_hdr.opcode == FUSE_WRITE) {
+        if (args_len < sizeof(args.write) ||
+            args.write.size > args_len - sizeof(args.write))
+        {
+            fuse_reply(q, in_hdr.unique, -EINVAL, NULL, 0);
+            goto out;
+        }
+
+        write_buf = qemu_try_blockalign(blk_bs(exp->common.blk),
+                                        args.write.size);
+        if (!write_buf) {
+            fuse_reply(q, in_hdr.unique, -ENOMEM, NULL, 0);
+            goto out;
+        }
+        memcpy(write_buf, q->request_buf + q->request_len - args.write.size,
+               args.write.size);
+    }
+
+    switch (in_hdr.opcode) {
+    case FUSE_INIT:
+        out_len = fuse_init(exp, &out.init, &args.init);
+        ret = 0;
+        break;
+
+    case FUSE_DESTROY:
+    case FUSE_RELEASE:
+        ret = 0;
+        break;
+
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+        /* No reply expected */
+        goto out;
+
+    case FUSE_LOOKUP:
+        /* We only care about the mountpoint itself */
+        ret = -ENOENT;
+        break;
+
+    case FUSE_GETATTR:
+        ret = fuse_co_getattr(exp, in_hdr.nodeid, &out.attr);
+        out_len = sizeof(out.attr);
+        break;
+
+    case FUSE_SETATTR:
+        ret = fuse_co_setattr(exp, in_hdr.nodeid, &args.setattr, &out.attr);
+        out_len = sizeof(out.attr);
+        break;
+
+    case FUSE_OPEN:
+        ret = 0;
+        out_len = sizeof(out.open);
+        break;
+
+    case FUSE_STATFS:
+        /* What libfuse reports for file systems without statfs */
+        out.statfs.st.bsize = 512;
+        out.statfs.st.namelen = 255;
+        ret = 0;
+        out_len = sizeof(out.statfs);
+        break;
+
+    case FUSE_READ:
+        ret = fuse_co_read(exp, &read_buf, args.read.offset, args.read.size);
+        if (ret >= 0) {
+            out_len = ret;
+            ret = 0;
+        }
+        break;
+
+    case FUSE_WRITE:
+        ret = fuse_co_write(exp, &out.write, args.write.offset,
+                            args.write.size, write_buf);
+        out_len = sizeof(out.write);
+        break;
+
+    case FUSE_FALLOCATE:
+        ret = fuse_co_fallocate(exp, args.fallocate.mode,
+                                args.fallocate.offset, args.fallocate.length);
+        break;
+
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        ret = fuse_co_fsync(exp);
+        break;
+
 #ifdef CONFIG_FUSE_LSEEK
-    .lseek      = fuse_lseek,
+    case FUSE_LSEEK:
+        ret = fuse_co_lseek(exp, &out.lseek, args.lseek.offset,
+                            args.lseek.whence);
+        out_len = sizeof(out.lseek);
+        break;
 #endif
-};
+
+    default:
+        ret = -ENOSYS;
+        break;
+    }
+
+    fuse_reply(q, in_hdr.unique, ret, read_buf ?: (void *)&out, out_len);
+
+out:
+    qemu_vfree(read_buf);
+    qemu_vfree(write_buf);
+    fuse_export_dec_in_flight(exp);
+}
 
 const BlockExportDriver blk_exp_fuse = {
-    .type               = BLOCK_EXPORT_TYPE_FUSE,
-    .instance_size      = sizeof(FuseExport),
-    .create             = fuse_export_create,
-    .delete             = fuse_export_delete,
-    .request_shutdown   = fuse_export_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_FUSE,
+    .instance_size          = sizeof(FuseExport),
+    .supports_multithread   = true,
+    .create                 = fuse_export_create,
+    .delete                 = fuse_export_delete,
+    .request_shutdown       = fuse_export_shutdown,
 };
@@ -0,0 +1 @@
+#include "trace/trace-block_export.h"
@@ -36,6 +36,8 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "io/channel-socket.h"
+#include "exec/memory.h" /* for ram_block_discard_disable() */
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 
@@ -66,6 +68,7 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #if defined(CONFIG_BLKZONED)
@@ -158,8 +161,14 @@ typedef struct BDRVRawState {
 
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_clone_range:1;
+    bool has_sendfile:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed:1;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringParams luring_params;
+#endif
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -170,6 +179,7 @@ typedef struct BDRVRawState {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
         uint64_t discard_bytes_ok;
+        BlockAcctSubmitStats submit;
     } stats;
 
     PRManager *pr_mgr;
@@ -219,6 +229,9 @@ typedef struct RawPosixAIOData {
             PreallocMode prealloc;
             Error **errp;
         } truncate;
+        struct {
+            int out_fd;
+        } sendfile;
         struct {
             unsigned int *nr_zones;
             BlockZoneDescriptor *zones;
@@ -560,6 +573,35 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "use io_uring fixed files and buffers (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit io_uring requests from a kernel thread "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll-idle",
+            .type = QEMU_OPT_NUMBER,
+            .help = "idle time before the io_uring submission thread sleeps "
+                    "in ms (0 = kernel default, default: 0)",
+        },
+        {
+            .name = "io-uring-sqpoll-cpu",
+            .type = QEMU_OPT_NUMBER,
+            .help = "host CPU to pin the io_uring submission thread to",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the device for io_uring completions (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -588,6 +630,48 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Parse the options that select how the io_uring ring is set up */
+static int raw_parse_luring_params(BDRVRawState *s, QemuOpts *opts,
+                                   Error **errp)
+{
+    LuringParams *params = &s->luring_params;
+    uint64_t idle, cpu;
+
+    params->sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    params->iopoll = qemu_opt_get_bool(opts, "io-uring-iopoll", false);
+    idle = qemu_opt_get_number(opts, "io-uring-sqpoll-idle", 0);
+    cpu = qemu_opt_get_number(opts, "io-uring-sqpoll-cpu", 0);
+
+    if ((params->sqpoll || params->iopoll) && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-sqpoll and io-uring-iopoll require "
+                         "aio=io_uring");
+        return -EINVAL;
+    }
+    if (!params->sqpoll && (qemu_opt_find(opts, "io-uring-sqpoll-idle") ||
+                            qemu_opt_find(opts, "io-uring-sqpoll-cpu"))) {
+        error_setg(errp, "io-uring-sqpoll-idle and io-uring-sqpoll-cpu "
+                         "require io-uring-sqpoll=on");
+        return -EINVAL;
+    }
+    if (idle > UINT32_MAX) {
+        error_setg(errp, "io-uring-sqpoll-idle must be at most %" PRIu32,
+                   UINT32_MAX);
+        return -EINVAL;
+    }
+    if (cpu >= INT_MAX) {
+        error_setg(errp, "io-uring-sqpoll-cpu %" PRIu64 " is invalid", cpu);
+        return -EINVAL;
+    }
+    params->sq_thread_idle = idle;
+    params->sq_thread_cpu = -1;
+    if (qemu_opt_find(opts, "io-uring-sqpoll-cpu")) {
+        params->sq_thread_cpu = cpu;
+    }
+    return 0;
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -637,6 +721,24 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    if (s->use_io_uring_fixed && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+    ret = raw_parse_luring_params(s, opts, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+#ifndef CONFIG_LINUX_IO_URING_FIXED
+    if (s->use_io_uring_fixed) {
+        error_setg(errp, "io-uring-fixed was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -727,7 +829,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
-#ifndef CONFIG_LINUX_IO_URING
+#ifdef CONFIG_LINUX_IO_URING
+    /* Polled completions only work with O_DIRECT */
+    if (s->luring_params.iopoll && !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll was specified, but it requires "
+                         "cache.direct=on, which was not specified.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
     if (s->use_linux_io_uring) {
         error_setg(errp, "aio=io_uring was specified, but is not supported "
                          "in this build.");
@@ -738,6 +848,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone_range = true;
+    s->has_sendfile = true;
 
     if (fstat(s->fd, &st) < 0) {
         ret = -errno;
@@ -805,6 +917,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    if (s->use_io_uring_fixed) {
+        /* Fixed buffers pin guest RAM, discarding it would break them */
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2154,6 +2277,52 @@ static int handle_aiocb_zone_mgmt(void *opaque)
 }
 #endif
 
+#ifdef FICLONERANGE
+/*
+ * Share the extents of the source with the destination instead of copying
+ * them, if the filesystem supports it (e.g. XFS and btrfs).  Returns
+ * -ENOTSUP if the range cannot be cloned, in which case the caller falls
+ * back to copy_file_range().
+ */
+static int handle_aiocb_clone_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd         = aiocb->aio_fildes,
+        .src_offset     = aiocb->aio_offset,
+        .src_length     = aiocb->aio_nbytes,
+        .dest_offset    = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!s->has_clone_range) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret < 0 && errno == EINTR);
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret < 0 ? -errno : 0);
+    if (ret == 0) {
+        return 0;
+    }
+
+    switch (errno) {
+    case EINVAL:
+        /* Range not aligned to the filesystem block size */
+        break;
+    default:
+        /* Not supported by the filesystem, or different filesystems */
+        s->has_clone_range = false;
+        break;
+    }
+    return -ENOTSUP;
+}
+#endif
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2161,6 +2330,12 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+#ifdef FICLONERANGE
+    if (handle_aiocb_clone_range(aiocb) == 0) {
+        return 0;
+    }
+#endif
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -2188,6 +2363,35 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef __linux__
+/*
+ * Send as much of the data as the socket takes right now.  The socket is
+ * non-blocking, so this never waits for the peer; the coroutine does that
+ * before submitting the next request.
+ *
+ * Returns the number of bytes sent, 0 at the end of the file, or -errno.
+ * -EAGAIN means that the socket was full.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    off_t offset = aiocb->aio_offset;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(aiocb->sendfile.out_fd, aiocb->aio_fildes, &offset,
+                       aiocb->aio_nbytes);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        ret = -errno;
+    }
+
+    trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                        aiocb->sendfile.out_fd, aiocb->aio_nbytes, ret);
+    return ret;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2442,7 +2646,11 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
     }
 
     ctx = qemu_get_current_aio_context();
-    if (unlikely(!aio_setup_linux_io_uring(ctx, &local_err))) {
+    /* Flushes go through the default ring if the ring is polled */
+    if (unlikely(!aio_setup_linux_io_uring_params(ctx, &s->luring_params,
+                                                  &local_err) ||
+                 (s->luring_params.iopoll &&
+                  !aio_setup_linux_io_uring(ctx, &local_err)))) {
         error_reportf_err(local_err, "Unable to use linux io_uring, "
                                      "falling back to thread pool: ");
         s->use_linux_io_uring = false;
@@ -2505,14 +2713,16 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
 #ifdef CONFIG_LINUX_IO_URING
     } else if (raw_check_linux_io_uring(s)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        ret = luring_co_submit(bs, s->fd, offset, qiov, type,
+                               &s->luring_params, s->use_io_uring_fixed,
+                               &s->stats.submit);
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
     } else if (raw_check_linux_aio(s)) {
         assert(qiov->size == bytes);
         ret = laio_co_submit(s->fd, offset, qiov, type,
-                              s->aio_max_batch);
+                              s->aio_max_batch, &s->stats.submit);
         goto out;
 #endif
     }
@@ -2597,7 +2807,9 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH,
+                                &s->luring_params, s->use_io_uring_fixed,
+                                &s->stats.submit);
     }
 #endif
     return raw_thread_pool_submit(handle_aiocb_flush, &acb);
@@ -2610,12 +2822,44 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+        if (s->use_io_uring_fixed) {
+            luring_unregister_fd(s->fd);
+        }
 #endif
         qemu_close(s->fd);
         s->fd = -1;
     }
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    if (s->use_io_uring_fixed) {
+        ram_block_discard_disable(false);
+    }
+#endif
+}
+
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_io_uring_fixed) {
+        luring_register_buf(host, size);
+    }
+    return true;
 }
 
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_io_uring_fixed) {
+        luring_unregister_buf(host, size);
+    }
+}
+#endif
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -3675,6 +3919,40 @@ static ImageInfoSpecific *raw_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockAioSubmitStats *get_blockstats_aio_submit(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    BlockAcctSubmitStats *submit = &s->stats.submit;
+    BlockAioSubmitStats *stats;
+    BlockLatencyHistogramInfo *hist;
+    uint64List **boundaries_tail;
+    uint64List **bins_tail;
+    int i;
+
+    if (!s->use_linux_aio && !s->use_linux_io_uring) {
+        return NULL;
+    }
+
+    hist = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries_tail = &hist->boundaries;
+    bins_tail = &hist->bins;
+    for (i = 0; i < BLOCK_ACCT_SUBMIT_BATCH_BINS; i++) {
+        if (i > 0) {
+            QAPI_LIST_APPEND(boundaries_tail,
+                             block_acct_submit_batch_boundary(i));
+        }
+        QAPI_LIST_APPEND(bins_tail, stat64_get(&submit->batch_bins[i]));
+    }
+
+    stats = g_new(BlockAioSubmitStats, 1);
+    *stats = (BlockAioSubmitStats) {
+        .submissions = stat64_get(&submit->submissions),
+        .requests = stat64_get(&submit->requests),
+        .batch_histogram = hist,
+    };
+    return stats;
+}
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -3682,6 +3960,7 @@ static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
         .discard_nb_ok = s->stats.discard_nb_ok,
         .discard_nb_failed = s->stats.discard_nb_failed,
         .discard_bytes_ok = s->stats.discard_bytes_ok,
+        .aio_submit = get_blockstats_aio_submit(bs),
     };
 }
 
@@ -3802,6 +4081,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+        if (s->use_io_uring_fixed) {
+            luring_unregister_fd(s->fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3872,6 +4156,104 @@ raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(handle_aiocb_copy_range, &acb);
 }
 
+#ifdef __linux__
+/*
+ * Send the data through a bounce buffer, for when sendfile() is not
+ * supported by the file or the range goes past its end.  Reads beyond the
+ * end of the file return zeroes, like for raw_co_preadv().
+ */
+static int coroutine_fn
+raw_co_sendfile_bounce(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       QIOChannel *ioc)
+{
+    size_t buf_size = MIN(bytes, 64 * KiB);
+    g_autofree uint8_t *buf = g_malloc(buf_size);
+    QEMUIOVector qiov;
+    int ret;
+
+    while (bytes) {
+        size_t len = MIN(bytes, buf_size);
+
+        qemu_iovec_init_buf(&qiov, buf, len);
+        ret = raw_co_prw(bs, &offset, len, &qiov, QEMU_AIO_READ);
+        if (ret < 0) {
+            return ret;
+        }
+        if (qio_channel_write_all(ioc, (char *)buf, len, NULL) < 0) {
+            return -EIO;
+        }
+        offset += len;
+        bytes -= len;
+    }
+    return 0;
+}
+
+static int coroutine_fn
+raw_co_sendfile(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                QIOChannel *ioc, const struct iovec *hdr, int hdr_niov)
+{
+    BDRVRawState *s = bs->opaque;
+    QIOChannelSocket *sioc;
+    RawPosixAIOData acb;
+    int ret;
+
+    sioc = (QIOChannelSocket *)object_dynamic_cast(OBJECT(ioc),
+                                                   TYPE_QIO_CHANNEL_SOCKET);
+
+    /* sendfile() reads through the page cache */
+    if (!sioc || (s->open_flags & O_DIRECT) || fd_open(bs) < 0) {
+        return -ENOTSUP;
+    }
+
+    /* Waiting for the socket yields, so slow peers don't tie up workers */
+    if (qio_channel_writev_all(ioc, hdr, hdr_niov, NULL) < 0) {
+        return -EIO;
+    }
+
+    /*
+     * Once the header is out, the data must follow, so errors that mean
+     * sendfile() cannot be used for this file fall back to a bounce buffer
+     * instead of returning -ENOTSUP.
+     */
+    while (bytes && s->has_sendfile) {
+        acb = (RawPosixAIOData) {
+            .bs             = bs,
+            .aio_type       = QEMU_AIO_SENDFILE,
+            .aio_fildes     = s->fd,
+            .aio_offset     = offset,
+            .aio_nbytes     = bytes,
+            .sendfile       = {
+                .out_fd         = sioc->fd,
+            },
+        };
+
+        ret = raw_thread_pool_submit(handle_aiocb_sendfile, &acb);
+        if (ret == 0) {
+            /* End of file, send zeroes for the rest */
+            break;
+        } else if (ret == -EINVAL || ret == -ENOSYS) {
+            s->has_sendfile = false;
+        } else if (ret < 0 && ret != -EAGAIN) {
+            return ret;
+        } else {
+            if (ret > 0) {
+                offset += ret;
+                bytes -= ret;
+            }
+            /* A short send means that the socket is full, too */
+            if (bytes) {
+                qio_channel_yield(ioc, G_IO_OUT);
+            }
+        }
+    }
+
+    if (bytes) {
+        return raw_co_sendfile_bounce(bs, offset, bytes, ioc);
+    }
+    return 0;
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3898,6 +4280,9 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef __linux__
+    .bdrv_co_sendfile       = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
 
     .bdrv_co_truncate                   = raw_co_truncate,
@@ -3909,6 +4294,10 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4278,6 +4667,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
 
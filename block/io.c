@@ -3514,6 +3514,114 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, QIOChannel *ioc,
+                                  const struct iovec *hdr, int hdr_niov)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+    IO_CODE();
+    assert_bdrv_graph_readable();
+    trace_bdrv_co_sendfile(child, offset, bytes, ioc);
+
+    /*
+     * Invalid requests fail with -ENOTSUP too, so that the caller's normal
+     * read path reports the error without leaving a partial reply.
+     */
+    if (!bs || !bdrv_co_is_inserted(bs) ||
+        bdrv_check_request32(offset, bytes, NULL, 0) < 0) {
+        return -ENOTSUP;
+    }
+
+    /* Copy-on-read and encryption need the data in a buffer */
+    if (!bs->drv->bdrv_co_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read) ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_sendfile(bs, offset, bytes, ioc, hdr, hdr_niov);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
+ssize_t coroutine_fn bdrv_co_compress(BdrvChild *child, int64_t offset,
+                                      int64_t bytes, const void *buf,
+                                      void *out_buf, size_t out_size)
+{
+    BlockDriverState *bs = child->bs;
+    ssize_t ret;
+    IO_CODE();
+    assert_bdrv_graph_readable();
+
+    if (!bdrv_co_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!bs->drv->bdrv_co_compress) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    ret = bs->drv->bdrv_co_compress(bs, offset, bytes, buf, out_buf, out_size);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_pwrite_compressed_data(BdrvChild *child,
+                                                int64_t offset, int64_t bytes,
+                                                const void *out_buf,
+                                                size_t out_len)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+    IO_CODE();
+    assert_bdrv_graph_readable();
+
+    if (!bdrv_co_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!bs->drv->bdrv_co_pwrite_compressed_data) {
+        return -ENOTSUP;
+    }
+    if (bdrv_has_readonly_bitmaps(bs)) {
+        return -EPERM;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+    ret = bdrv_co_write_req_prepare(child, offset, bytes, &req,
+                                    BDRV_REQ_WRITE_COMPRESSED);
+    if (!ret) {
+        ret = bs->drv->bdrv_co_pwrite_compressed_data(bs, offset, bytes,
+                                                      out_buf, out_len);
+    }
+    bdrv_co_write_req_finish(child, offset, bytes, &req, ret);
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void coroutine_fn GRAPH_RDLOCK
 bdrv_parent_cb_resize(BlockDriverState *bs)
 {
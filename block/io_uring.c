@@ -16,6 +16,9 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "trace.h"
@@ -32,6 +35,7 @@ typedef struct LuringAIOCB {
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
+    BlockAcctSubmitStats *submit_stats;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
     /*
@@ -49,6 +53,68 @@ typedef struct LuringQueue {
     QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
 } LuringQueue;
 
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+/*
+ * Fixed files and buffers let the kernel look up the file and pin the
+ * pages of the buffer once, when they are registered, instead of on every
+ * request.
+ *
+ * Files are registered by each ring the first time they are used, and
+ * removed from all rings by luring_unregister_fd() before they are closed.
+ *
+ * Buffers are registered for the whole process with luring_register_buf(),
+ * usually for guest RAM.  The slot of a buffer must not change between the
+ * lookup and the submission of a request, so each ring only updates its
+ * buffer table from its home thread, before preparing a request, once it
+ * notices that luring_fixed.gen changed.
+ */
+
+/* Number of slots in the fixed file and buffer tables of each ring */
+#define LURING_FIXED_FILES 64
+#define LURING_FIXED_BUFS 1024
+
+/* The kernel does not accept larger fixed buffers */
+#define LURING_FIXED_BUF_MAX_SIZE (1 * GiB)
+
+typedef struct {
+    void *host;
+    size_t size;
+} LuringFixedBuf;
+
+typedef struct LuringFixed {
+    /*
+     * fd registered in each file slot, or -1.  Slots are taken from the
+     * home thread and released by luring_unregister_fd().
+     */
+    int fds[LURING_FIXED_FILES];
+    /* Buffer registered in each buffer slot */
+    LuringFixedBuf bufs[LURING_FIXED_BUFS];
+    /* All buffer slots from nr_bufs on are empty */
+    unsigned int nr_bufs;
+    /* Slot of the last buffer that was used by a request */
+    unsigned int last_buf;
+    /* Value of luring_fixed.gen when bufs[] was updated */
+    unsigned int gen;
+} LuringFixed;
+
+static struct {
+    /* Protects the fields below and LuringState::fixed */
+    QemuMutex lock;
+    /* Buffers to register in each slot of the buffer tables */
+    LuringFixedBuf bufs[LURING_FIXED_BUFS];
+    unsigned int refcnt[LURING_FIXED_BUFS];
+    /* Incremented whenever bufs[] changes */
+    unsigned int gen;
+    QLIST_HEAD(, LuringState) states;
+} luring_fixed;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed.lock);
+    QLIST_INIT(&luring_fixed.states);
+}
+#endif /* CONFIG_LINUX_IO_URING_FIXED */
+
 struct LuringState {
     AioContext *aio_context;
 
@@ -58,6 +124,16 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /* How the ring was set up */
+    LuringParams params;
+
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    /* Allocated when the ring first uses fixed files and buffers */
+    LuringFixed *fixed;
+    bool fixed_failed;
+    QLIST_ENTRY(LuringState) next;
+#endif
 };
 
 /**
@@ -89,6 +165,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     /* Update read position */
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
+    luringcb->sqeq.off += nread;
+
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* The rest of the buffer is still within the fixed buffer */
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
 
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
@@ -101,7 +186,6 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off += nread;
     luringcb->sqeq.addr = (uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
 
@@ -221,7 +305,14 @@ end:
         }
     }
 
-    qemu_bh_cancel(s->completion_bh);
+    /*
+     * The completions of a polled ring are only posted when we ask for them,
+     * so keep the BH scheduled, and the event loop busy, until all requests
+     * have completed.
+     */
+    if (!s->params.iopoll || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 
     defer_call_end();
 }
@@ -230,6 +321,8 @@ static int ioq_submit(LuringState *s)
 {
     int ret = 0;
     LuringAIOCB *luringcb, *luringcb_next;
+    BlockAcctSubmitStats *submit_stats[MAX_ENTRIES];
+    unsigned int n = 0;
 
     while (s->io_q.in_queue > 0) {
         /*
@@ -244,6 +337,7 @@ static int ioq_submit(LuringState *s)
             }
             /* Prep sqe for submission */
             *sqes = luringcb->sqeq;
+            submit_stats[n++] = luringcb->submit_stats;
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
         ret = io_uring_submit(&s->ring);
@@ -255,6 +349,10 @@ static int ioq_submit(LuringState *s)
             }
             break;
         }
+        if (n) {
+            block_acct_submit_batch(submit_stats, n);
+            n = 0;
+        }
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
     }
@@ -295,6 +393,13 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    /*
+     * With IOPOLL, the CQ ring stays empty until io_uring_peek_cqe() enters
+     * the kernel to poll the device, which qemu_luring_poll_ready() does.
+     */
+    if (s->params.iopoll && s->io_q.in_flight) {
+        return true;
+    }
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -323,6 +428,148 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+/* Returns the fixed tables of @s, registering them on first use */
+static LuringFixed *luring_fixed_get(LuringState *s)
+{
+    LuringFixed *fixed;
+    int ret;
+
+    if (s->fixed || s->fixed_failed) {
+        return s->fixed;
+    }
+
+    ret = io_uring_register_files_sparse(&s->ring, LURING_FIXED_FILES);
+    if (ret == 0) {
+        ret = io_uring_register_buffers_sparse(&s->ring, LURING_FIXED_BUFS);
+        if (ret < 0) {
+            io_uring_unregister_files(&s->ring);
+        }
+    }
+    if (ret < 0) {
+        warn_report("io_uring: unable to register fixed files and buffers: "
+                    "%s", strerror(-ret));
+        s->fixed_failed = true;
+        return NULL;
+    }
+
+    fixed = g_new0(LuringFixed, 1);
+    memset(fixed->fds, -1, sizeof(fixed->fds));
+    WITH_QEMU_LOCK_GUARD(&luring_fixed.lock) {
+        s->fixed = fixed;
+    }
+    return fixed;
+}
+
+/* Returns the fixed file slot of @fd, or -1 if it cannot be registered */
+static int luring_fixed_file(LuringState *s, LuringFixed *fixed, int fd)
+{
+    int free_slot = -1;
+    int i, ret;
+
+    for (i = 0; i < LURING_FIXED_FILES; i++) {
+        int slot_fd = qatomic_read(&fixed->fds[i]);
+
+        if (slot_fd == fd) {
+            return i;
+        }
+        if (slot_fd == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == -1) {
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, free_slot, &fd, 1);
+    trace_luring_register_fixed_file(s, fd, free_slot, ret);
+    if (ret < 0) {
+        return -1;
+    }
+    qatomic_set(&fixed->fds[free_slot], fd);
+    return free_slot;
+}
+
+/* Bring the buffer table of @s in sync with luring_fixed.bufs[] */
+static void luring_fixed_bufs_update(LuringState *s, LuringFixed *fixed)
+{
+    unsigned int i;
+
+    if (qatomic_read(&luring_fixed.gen) == fixed->gen) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    fixed->nr_bufs = 0;
+    for (i = 0; i < LURING_FIXED_BUFS; i++) {
+        LuringFixedBuf *buf = &luring_fixed.bufs[i];
+        LuringFixedBuf *cur = &fixed->bufs[i];
+
+        if (buf->host != cur->host || buf->size != cur->size) {
+            struct iovec iov = { .iov_base = buf->host, .iov_len = buf->size };
+            __u64 tag = 0;
+            int ret;
+
+            ret = io_uring_register_buffers_update_tag(&s->ring, i, &iov,
+                                                       &tag, 1);
+            trace_luring_update_fixed_buf(s, i, buf->host, buf->size, ret);
+            if (ret < 0) {
+                /* Usually RLIMIT_MEMLOCK, requests use the normal path */
+                warn_report_once("io_uring: unable to register fixed "
+                                 "buffers: %s", strerror(-ret));
+                iov = (struct iovec) {};
+                io_uring_register_buffers_update_tag(&s->ring, i, &iov,
+                                                     &tag, 1);
+                *cur = (LuringFixedBuf) {};
+            } else {
+                *cur = *buf;
+            }
+        }
+        if (cur->host) {
+            fixed->nr_bufs = i + 1;
+        }
+    }
+    fixed->gen = luring_fixed.gen;
+}
+
+static bool luring_fixed_buf_contains(LuringFixedBuf *buf, struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t)buf->host;
+    uintptr_t base = (uintptr_t)iov->iov_base;
+
+    return buf->host && base >= start && base - start < buf->size &&
+           iov->iov_len <= buf->size - (base - start);
+}
+
+/*
+ * Returns the fixed buffer slot that contains @qiov, or -1.  Fixed reads
+ * and writes only take a single buffer.
+ */
+static int luring_fixed_buf(LuringState *s, LuringFixed *fixed,
+                            QEMUIOVector *qiov)
+{
+    unsigned int i;
+
+    if (!qiov || qiov->niov != 1) {
+        return -1;
+    }
+
+    luring_fixed_bufs_update(s, fixed);
+
+    if (fixed->last_buf < fixed->nr_bufs &&
+        luring_fixed_buf_contains(&fixed->bufs[fixed->last_buf], qiov->iov)) {
+        return fixed->last_buf;
+    }
+    for (i = 0; i < fixed->nr_bufs; i++) {
+        if (luring_fixed_buf_contains(&fixed->bufs[i], qiov->iov)) {
+            fixed->last_buf = i;
+            return i;
+        }
+    }
+    return -1;
+}
+#endif /* CONFIG_LINUX_IO_URING_FIXED */
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -330,28 +577,50 @@ static void luring_deferred_fn(void *opaque)
  * @s: AIO state
  * @offset: offset for request
  * @type: type of request
+ * @fixed: use fixed files and buffers when possible
  *
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+                            uint64_t offset, int type, bool fixed)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int file_slot = -1;
+    int buf_slot = -1;
+
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    if (fixed) {
+        LuringFixed *f = luring_fixed_get(s);
+
+        if (f) {
+            file_slot = luring_fixed_file(s, f, fd);
+            buf_slot = luring_fixed_buf(s, f, qiov);
+        }
+    }
+#endif
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_slot >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf_slot);
+            break;
+        }
+        io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
         break;
     case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_slot >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf_slot);
+            break;
+        }
+        io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -361,6 +630,10 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_slot >= 0) {
+        sqes->fd = file_slot;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -380,20 +653,30 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+                                  QEMUIOVector *qiov, int type,
+                                  const LuringParams *params, bool fixed,
+                                  BlockAcctSubmitStats *submit_stats)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringState *s;
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .submit_stats = submit_stats,
     };
+
+    /* Polled rings only support O_DIRECT reads and writes */
+    if (params && params->iopoll && type == QEMU_AIO_FLUSH) {
+        params = NULL;
+    }
+    s = aio_get_linux_io_uring_params(ctx, params);
+
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, &luringcb, s, offset, type, fixed);
 
     if (ret < 0) {
         return ret;
@@ -422,15 +705,50 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+static const LuringParams luring_default_params = {
+    .sq_thread_cpu = -1,
+};
+
+/* Compare two setups, NULL standing for the default setup */
+bool luring_params_equal(const LuringParams *a, const LuringParams *b)
+{
+    a = a ?: &luring_default_params;
+    b = b ?: &luring_default_params;
+
+    return a->sqpoll == b->sqpoll &&
+           a->sq_thread_idle == b->sq_thread_idle &&
+           a->sq_thread_cpu == b->sq_thread_cpu &&
+           a->iopoll == b->iopoll;
+}
+
+const LuringParams *luring_get_params(LuringState *s)
+{
+    return &s->params;
+}
+
+LuringState *luring_init(const LuringParams *params, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params p = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    s->params = params ? *params : luring_default_params;
+    if (s->params.sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = s->params.sq_thread_idle;
+        if (s->params.sq_thread_cpu >= 0) {
+            p.flags |= IORING_SETUP_SQ_AFF;
+            p.sq_thread_cpu = s->params.sq_thread_cpu;
+        }
+    }
+    if (s->params.iopoll) {
+        p.flags |= IORING_SETUP_IOPOLL;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &p);
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -438,13 +756,130 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    WITH_QEMU_LOCK_GUARD(&luring_fixed.lock) {
+        QLIST_INSERT_HEAD(&luring_fixed.states, s, next);
+    }
+#endif
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+    WITH_QEMU_LOCK_GUARD(&luring_fixed.lock) {
+        QLIST_REMOVE(s, next);
+    }
+    g_free(s->fixed);
+#endif
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
+
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+/**
+ * luring_unregister_fd:
+ * @fd: file descriptor
+ *
+ * Removes @fd from the fixed file table of every ring.  Must be called
+ * before closing a file used with fixed files, once no more requests are in
+ * flight for it, so that the rings drop their reference to the file.
+ */
+void luring_unregister_fd(int fd)
+{
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    QLIST_FOREACH(s, &luring_fixed.states, next) {
+        if (!s->fixed) {
+            continue;
+        }
+        for (i = 0; i < LURING_FIXED_FILES; i++) {
+            if (qatomic_read(&s->fixed->fds[i]) == fd) {
+                int unused = -1;
+
+                io_uring_register_files_update(&s->ring, i, &unused, 1);
+                qatomic_set(&s->fixed->fds[i], -1);
+            }
+        }
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Adds a buffer to the fixed buffer table of every ring, so that requests
+ * within it avoid pinning its pages each time.  This is an optimization,
+ * the parts of the buffer that do not fit in the tables are just skipped.
+ */
+void luring_register_buf(void *host, size_t size)
+{
+    size_t offset;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    for (offset = 0; offset < size; offset += LURING_FIXED_BUF_MAX_SIZE) {
+        LuringFixedBuf buf = {
+            .host = (uint8_t *)host + offset,
+            .size = MIN(size - offset, LURING_FIXED_BUF_MAX_SIZE),
+        };
+        int free_slot = -1;
+        int i;
+
+        for (i = 0; i < LURING_FIXED_BUFS; i++) {
+            if (luring_fixed.bufs[i].host == buf.host &&
+                luring_fixed.bufs[i].size == buf.size) {
+                break;
+            }
+            if (!luring_fixed.bufs[i].host && free_slot == -1) {
+                free_slot = i;
+            }
+        }
+        if (i == LURING_FIXED_BUFS) {
+            if (free_slot == -1) {
+                warn_report_once("io_uring: too many fixed buffers");
+                continue;
+            }
+            i = free_slot;
+            luring_fixed.bufs[i] = buf;
+            qatomic_inc(&luring_fixed.gen);
+        }
+        luring_fixed.refcnt[i]++;
+    }
+}
+
+/**
+ * luring_unregister_buf:
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Undoes luring_register_buf().  The rings drop the buffer the next time
+ * they submit a request.
+ */
+void luring_unregister_buf(void *host, size_t size)
+{
+    size_t offset;
+
+    QEMU_LOCK_GUARD(&luring_fixed.lock);
+    for (offset = 0; offset < size; offset += LURING_FIXED_BUF_MAX_SIZE) {
+        void *chunk = (uint8_t *)host + offset;
+        size_t chunk_size = MIN(size - offset, LURING_FIXED_BUF_MAX_SIZE);
+        int i;
+
+        for (i = 0; i < LURING_FIXED_BUFS; i++) {
+            if (luring_fixed.bufs[i].host == chunk &&
+                luring_fixed.bufs[i].size == chunk_size) {
+                if (--luring_fixed.refcnt[i] == 0) {
+                    luring_fixed.bufs[i] = (LuringFixedBuf) {};
+                    qatomic_inc(&luring_fixed.gen);
+                }
+                break;
+            }
+        }
+    }
+}
+#endif /* CONFIG_LINUX_IO_URING_FIXED */
@@ -44,6 +44,7 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
+    BlockAcctSubmitStats *submit_stats;
     QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
@@ -292,6 +293,7 @@ static void ioq_submit(LinuxAioState *s)
     int ret, len;
     struct qemu_laiocb *aiocb;
     struct iocb *iocbs[MAX_EVENTS];
+    BlockAcctSubmitStats *submit_stats[MAX_EVENTS];
     QSIMPLEQ_HEAD(, qemu_laiocb) completed;
 
     do {
@@ -300,6 +302,7 @@ static void ioq_submit(LinuxAioState *s)
         }
         len = 0;
         QSIMPLEQ_FOREACH(aiocb, &s->io_q.pending, next) {
+            submit_stats[len] = aiocb->submit_stats;
             iocbs[len++] = &aiocb->iocb;
             if (s->io_q.in_flight + len >= MAX_EVENTS) {
                 break;
@@ -320,6 +323,7 @@ static void ioq_submit(LinuxAioState *s)
             continue;
         }
 
+        block_acct_submit_batch(submit_stats, ret);
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
         aiocb = container_of(iocbs[ret - 1], struct qemu_laiocb, iocb);
@@ -406,7 +410,8 @@ static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
 }
 
 int coroutine_fn laio_co_submit(int fd, uint64_t offset, QEMUIOVector *qiov,
-                                int type, uint64_t dev_max_batch)
+                                int type, uint64_t dev_max_batch,
+                                BlockAcctSubmitStats *submit_stats)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
@@ -417,6 +422,7 @@ int coroutine_fn laio_co_submit(int fd, uint64_t offset, QEMUIOVector *qiov,
         .ret        = -EINPROGRESS,
         .is_read    = (type == QEMU_AIO_READ),
         .qiov       = qiov,
+        .submit_stats = submit_stats,
     };
 
     ret = laio_do_submit(fd, &laiocb, offset, type, dev_max_batch);
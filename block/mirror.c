@@ -24,11 +24,20 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "qemu/units.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Limits and parameters of the request size and parallelism tuning */
+#define MIRROR_TUNE_MAX_IN_FLIGHT 64
+#define MIRROR_TUNE_MIN_IO_BYTES (64 * KiB)
+#define MIRROR_TUNE_WINDOW_NS (100 * SCALE_MS)
+#define MIRROR_TUNE_MIN_OPS 4
+/* Requests are sized to take about this long */
+#define MIRROR_TUNE_OP_NS (20 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -93,6 +102,25 @@ typedef struct MirrorBlockJob {
     int64_t active_write_bytes_in_flight;
     bool prepared;
     bool in_drain;
+
+    /*
+     * Request size and parallelism, tuned by mirror_tune() from the
+     * throughput and latency of the copies.  To be accessed with atomics
+     * outside of the job coroutine.
+     */
+    int max_io_bytes;
+    int max_in_flight;
+    /* Measurements for the current tuning window */
+    int64_t tune_start_ns;
+    uint64_t tune_bytes;
+    int64_t tune_lat_ns;
+    int tune_ops;
+    /* Set when the job had to wait for a free slot or buffer */
+    bool tune_saturated;
+    /* Throughput of the last saturated window, in bytes per second */
+    uint64_t tune_tput;
+    /* Lowest average latency seen with the current request size */
+    int64_t tune_min_lat_ns;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -114,6 +142,7 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -230,6 +259,80 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
     g_free(op);
 }
 
+/*
+ * Pick the request size and the number of requests in flight from the copies
+ * that completed in the last MIRROR_TUNE_WINDOW_NS.  This is only done if
+ * the job was limited by them, i.e. not by the rate limit or by the amount
+ * of dirty data.
+ *
+ * The number of requests in flight grows by one as long as this does not
+ * reduce the throughput, and shrinks when latency rises without any gain in
+ * throughput, which means that the target only queues the requests.  The
+ * request size follows the throughput of each request so that it completes
+ * in about MIRROR_TUNE_OP_NS: fast targets get large requests, while slow
+ * ones get small requests that do not hold the buffer for too long.
+ */
+static void mirror_tune(MirrorBlockJob *s, uint64_t bytes, int64_t lat_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->tune_start_ns;
+    int max_in_flight = s->max_in_flight;
+    int64_t io_bytes = s->max_io_bytes;
+    int64_t min_io_bytes, max_io_bytes;
+    uint64_t tput;
+    int64_t lat;
+
+    s->tune_bytes += bytes;
+    s->tune_lat_ns += lat_ns;
+    s->tune_ops++;
+    if (elapsed < MIRROR_TUNE_WINDOW_NS || s->tune_ops < MIRROR_TUNE_MIN_OPS) {
+        return;
+    }
+
+    if (s->tune_saturated) {
+        tput = muldiv64(s->tune_bytes, NANOSECONDS_PER_SECOND, elapsed);
+        lat = s->tune_lat_ns / s->tune_ops;
+        if (!s->tune_min_lat_ns || lat < s->tune_min_lat_ns) {
+            s->tune_min_lat_ns = lat;
+        }
+
+        if (lat > 2 * s->tune_min_lat_ns &&
+            tput <= s->tune_tput + s->tune_tput / 8) {
+            max_in_flight = MAX(1, max_in_flight * 3 / 4);
+        } else if (tput >= s->tune_tput - s->tune_tput / 8) {
+            max_in_flight = MIN(max_in_flight + 1, MIRROR_TUNE_MAX_IN_FLIGHT);
+        }
+
+        /* Do not grow requests beyond what the buffer can hold in flight */
+        min_io_bytes = MAX(s->granularity, MIRROR_TUNE_MIN_IO_BYTES);
+        max_io_bytes = MAX(s->buf_size / max_in_flight, min_io_bytes);
+        max_io_bytes = MIN(max_io_bytes, BDRV_REQUEST_MAX_BYTES);
+
+        /* Move at most by a factor of two per window */
+        io_bytes = muldiv64(tput / max_in_flight, MIRROR_TUNE_OP_NS,
+                            NANOSECONDS_PER_SECOND);
+        io_bytes = MIN(MAX(io_bytes, s->max_io_bytes / 2),
+                       (int64_t)s->max_io_bytes * 2);
+        io_bytes = MAX((int64_t)pow2floor(io_bytes), min_io_bytes);
+        io_bytes = MIN(io_bytes, max_io_bytes);
+        if (io_bytes != s->max_io_bytes) {
+            /* Latency depends on the request size */
+            s->tune_min_lat_ns = 0;
+        }
+
+        trace_mirror_tune(s, tput, lat, max_in_flight, io_bytes);
+        qatomic_set(&s->max_in_flight, max_in_flight);
+        qatomic_set(&s->max_io_bytes, io_bytes);
+        s->tune_tput = tput;
+    }
+
+    s->tune_start_ns = now;
+    s->tune_bytes = 0;
+    s->tune_lat_ns = 0;
+    s->tune_ops = 0;
+    s->tune_saturated = false;
+}
+
 static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -265,6 +368,10 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
     }
 
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    if (ret >= 0 && !s->initial_zeroing_ongoing) {
+        mirror_tune(s, op->bytes,
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns);
+    }
     mirror_write_complete(op, ret);
 }
 
@@ -375,6 +482,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
 
     while (s->buf_free_count < nb_chunks) {
         trace_mirror_yield_in_flight(s, op->offset, s->in_flight);
+        s->tune_saturated = true;
         mirror_wait_for_free_in_flight_slot(s);
     }
 
@@ -395,6 +503,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -487,7 +596,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int max_io_bytes = s->max_io_bytes;
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -599,8 +708,9 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
+            s->tune_saturated = true;
             mirror_wait_for_free_in_flight_slot(s);
         }
 
@@ -861,7 +971,7 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1002,6 +1112,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         s->granularity < s->target_cluster_size) {
         s->buf_size = MAX(s->buf_size, s->target_cluster_size);
         s->cow_bitmap = bitmap_new(length);
+        qatomic_set(&s->max_io_bytes,
+                    MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES));
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
     bdrv_graph_co_rdunlock();
@@ -1015,6 +1127,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     mirror_free_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->tune_start_ns = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || job_is_cancelled(&s->common.job)) {
@@ -1064,9 +1177,12 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
         if (delta < BLOCK_JOB_SLICE_TIME &&
             iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
+                if (cnt != 0) {
+                    s->tune_saturated = true;
+                }
                 mirror_wait_for_free_in_flight_slot(s);
                 continue;
             } else if (cnt != 0) {
@@ -1292,6 +1408,8 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
 
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
+        .chunk_size = qatomic_read(&s->max_io_bytes),
+        .max_in_flight = qatomic_read(&s->max_in_flight),
     };
 }
 
@@ -1879,6 +1997,8 @@ static BlockJob *mirror_start_job(
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->max_in_flight = MAX_IN_FLIGHT;
     s->unmap = unmap;
     if (auto_complete) {
         s->should_complete = true;
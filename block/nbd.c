@@ -34,6 +34,7 @@
 #include "qemu/option.h"
 #include "qemu/cutils.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qmp/qstring.h"
@@ -48,9 +49,19 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
+/* 1 MiB of cached extents, see the block-status-extents option */
+#define MAX_NBD_BLOCK_STATUS_EXTENTS (1 * MiB / sizeof(NBDExtent64))
+
+/*
+ * The index of a request covers all connections, so that the cookie tells
+ * which connection the request was sent on.
+ */
 #define COOKIE_TO_INDEX(cookie) ((cookie) - 1)
 #define INDEX_TO_COOKIE(index)  ((index) + 1)
+#define INDEX_TO_CHANNEL(index) ((index) / MAX_NBD_REQUESTS)
+#define INDEX_TO_REQUEST(index) ((index) % MAX_NBD_REQUESTS)
 
 typedef struct {
     Coroutine *coroutine;
@@ -65,20 +76,14 @@ typedef enum NBDClientState {
     NBD_CLIENT_QUIT
 } NBDClientState;
 
-typedef struct BDRVNBDState {
+/* One connection to the server */
+typedef struct NBDClientChannel {
     QIOChannel *ioc; /* The current I/O channel */
-    NBDExportInfo info;
+    NBDClientConnection *conn;
 
-    /*
-     * Protects state, free_sema, in_flight, requests[].coroutine,
-     * reconnect_delay_timer.
-     */
-    QemuMutex requests_lock;
-    NBDClientState state;
-    CoQueue free_sema;
+    /* Protected by BDRVNBDState.requests_lock */
     unsigned in_flight;
     NBDClientRequest requests[MAX_NBD_REQUESTS];
-    QEMUTimer *reconnect_delay_timer;
 
     /* Protects sending data on the socket.  */
     CoMutex send_mutex;
@@ -89,6 +94,29 @@ typedef struct BDRVNBDState {
      */
     CoMutex receive_mutex;
     NBDReply reply;
+} NBDClientChannel;
+
+typedef struct BDRVNBDState {
+    NBDExportInfo info;
+
+    /*
+     * Protects state, free_sema, in_flight, num_channels,
+     * channels[].in_flight, channels[].requests[].coroutine,
+     * reconnect_delay_timer.
+     */
+    QemuMutex requests_lock;
+    NBDClientState state;
+    CoQueue free_sema;
+    unsigned in_flight;
+    QEMUTimer *reconnect_delay_timer;
+
+    /*
+     * channels[0] is the connection that is used for the negotiation and
+     * that is reconnected after errors; with multi-conn, requests are spread
+     * over the first num_channels connections.
+     */
+    NBDClientChannel channels[MAX_NBD_CONNECTIONS];
+    unsigned num_channels;
 
     QEMUTimer *open_timer;
 
@@ -104,18 +132,78 @@ typedef struct BDRVNBDState {
     char *tlshostname;
     char *x_dirty_bitmap;
     bool alloc_depth;
+    uint32_t multi_conn;
+    uint32_t block_status_extents;
 
-    NBDClientConnection *conn;
+    /*
+     * Extents of the last block status reply, starting at extents_offset,
+     * that block status requests are answered from until a write or a
+     * reconnect invalidates them.  extents_generation is bumped on every
+     * invalidation, so that a reply that raced with a write is not cached.
+     */
+    QemuMutex extents_lock;
+    NBDExtent64 *extents;
+    unsigned nb_extents;
+    uint64_t extents_offset;
+    uint64_t extents_generation;
+    /* The extent of the last lookup, and its offset */
+    unsigned extents_hint;
+    uint64_t extents_hint_offset;
 } BDRVNBDState;
 
 static void nbd_yank(void *opaque);
 
+static inline NBDClientChannel *nbd_cookie_channel(BDRVNBDState *s,
+                                                   uint64_t cookie)
+{
+    return &s->channels[INDEX_TO_CHANNEL(COOKIE_TO_INDEX(cookie))];
+}
+
+static inline NBDClientRequest *nbd_cookie_request(BDRVNBDState *s,
+                                                   uint64_t cookie)
+{
+    return &nbd_cookie_channel(s, cookie)->requests[
+        INDEX_TO_REQUEST(COOKIE_TO_INDEX(cookie))];
+}
+
+/* Shut down all connections.  Called with s->requests_lock held.  */
+static void nbd_shutdown_channels(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        if (s->channels[i].ioc) {
+            qio_channel_shutdown(s->channels[i].ioc,
+                                 QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+}
+
+/* Drop the additional connections of multi-conn */
+static void nbd_close_secondary_channels(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 1; i < MAX_NBD_CONNECTIONS; i++) {
+        NBDClientChannel *ch = &s->channels[i];
+
+        if (ch->ioc) {
+            qio_channel_shutdown(ch->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            object_unref(OBJECT(ch->ioc));
+            ch->ioc = NULL;
+        }
+    }
+}
+
 static void nbd_clear_bdrvstate(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    nbd_client_connection_release(s->conn);
-    s->conn = NULL;
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        nbd_client_connection_release(s->channels[i].conn);
+        s->channels[i].conn = NULL;
+    }
 
     yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
 
@@ -134,9 +222,92 @@ static void nbd_clear_bdrvstate(BlockDriverState *bs)
     s->tlshostname = NULL;
     g_free(s->x_dirty_bitmap);
     s->x_dirty_bitmap = NULL;
+    g_free(s->extents);
+    s->extents = NULL;
+    s->nb_extents = 0;
+    qemu_mutex_destroy(&s->extents_lock);
+}
+
+static void nbd_extents_invalidate(BDRVNBDState *s)
+{
+    QEMU_LOCK_GUARD(&s->extents_lock);
+    s->nb_extents = 0;
+    s->extents_generation++;
+}
+
+static uint64_t nbd_extents_generation(BDRVNBDState *s)
+{
+    QEMU_LOCK_GUARD(&s->extents_lock);
+    return s->extents_generation;
+}
+
+/*
+ * Keep the @nb_extents extents in @extents, which start at @offset, for
+ * nbd_extents_lookup(), unless there was an invalidation since
+ * @generation.  Takes ownership of @extents.
+ */
+static void nbd_extents_store(BDRVNBDState *s, uint64_t offset,
+                              NBDExtent64 *extents, unsigned nb_extents,
+                              uint64_t generation)
+{
+    WITH_QEMU_LOCK_GUARD(&s->extents_lock) {
+        if (generation == s->extents_generation) {
+            g_free(s->extents);
+            s->extents = g_steal_pointer(&extents);
+            s->nb_extents = nb_extents;
+            s->extents_offset = offset;
+            s->extents_hint = 0;
+            s->extents_hint_offset = offset;
+        }
+    }
+    g_free(extents);
+}
+
+/*
+ * Look up the cached extent containing @offset.  On success, return true
+ * with the extent's flags in *@flags and the number of bytes from @offset
+ * to its end, at most @bytes, in *@pnum.
+ */
+static bool nbd_extents_lookup(BDRVNBDState *s, uint64_t offset,
+                               uint64_t bytes, uint64_t *pnum,
+                               uint64_t *flags)
+{
+    uint64_t start;
+    unsigned i;
+
+    QEMU_LOCK_GUARD(&s->extents_lock);
+    if (!s->nb_extents || offset < s->extents_offset) {
+        return false;
+    }
+
+    /*
+     * Block status is mostly queried sequentially, so scanning from the
+     * extent of the last lookup usually finds the right one at once.
+     */
+    if (offset >= s->extents_hint_offset) {
+        i = s->extents_hint;
+        start = s->extents_hint_offset;
+    } else {
+        i = 0;
+        start = s->extents_offset;
+    }
+
+    for (; i < s->nb_extents; i++) {
+        uint64_t end = start + s->extents[i].length;
+
+        if (offset < end) {
+            *pnum = MIN(end - offset, bytes);
+            *flags = s->extents[i].flags;
+            s->extents_hint = i;
+            s->extents_hint_offset = start;
+            return true;
+        }
+        start = end;
+    }
+    return false;
 }
 
-/* Called with s->receive_mutex taken.  */
+/* Called with ch->receive_mutex taken.  */
 static bool coroutine_fn nbd_recv_coroutine_wake_one(NBDClientRequest *req)
 {
     if (req->receiving) {
@@ -148,13 +319,13 @@ static bool coroutine_fn nbd_recv_coroutine_wake_one(NBDClientRequest *req)
     return false;
 }
 
-static void coroutine_fn nbd_recv_coroutines_wake(BDRVNBDState *s)
+static void coroutine_fn nbd_recv_coroutines_wake(NBDClientChannel *ch)
 {
     int i;
 
-    QEMU_LOCK_GUARD(&s->receive_mutex);
+    QEMU_LOCK_GUARD(&ch->receive_mutex);
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (nbd_recv_coroutine_wake_one(&s->requests[i])) {
+        if (nbd_recv_coroutine_wake_one(&ch->requests[i])) {
             return;
         }
     }
@@ -164,7 +335,7 @@ static void coroutine_fn nbd_recv_coroutines_wake(BDRVNBDState *s)
 static void coroutine_fn nbd_channel_error_locked(BDRVNBDState *s, int ret)
 {
     if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        nbd_shutdown_channels(s);
     }
 
     if (ret == -EIO) {
@@ -191,6 +362,18 @@ static void reconnect_delay_timer_del(BDRVNBDState *s)
     }
 }
 
+/* Stop waiting for any of the connections that are being established */
+static void nbd_cancel_connections(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        if (s->channels[i].conn) {
+            nbd_co_establish_connection_cancel(s->channels[i].conn);
+        }
+    }
+}
+
 static void reconnect_delay_timer_cb(void *opaque)
 {
     BDRVNBDState *s = opaque;
@@ -202,7 +385,7 @@ static void reconnect_delay_timer_cb(void *opaque)
         }
         s->state = NBD_CLIENT_CONNECTING_NOWAIT;
     }
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connections(s);
 }
 
 static void reconnect_delay_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
@@ -221,12 +404,14 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
     assert(!s->in_flight);
 
-    if (s->ioc) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    nbd_close_secondary_channels(s);
+    if (s->channels[0].ioc) {
+        qio_channel_shutdown(s->channels[0].ioc, QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
                                  nbd_yank, s->bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+        object_unref(OBJECT(s->channels[0].ioc));
+        s->channels[0].ioc = NULL;
     }
 
     WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
@@ -246,7 +431,7 @@ static void open_timer_cb(void *opaque)
 {
     BDRVNBDState *s = opaque;
 
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connections(s);
     open_timer_del(s);
 }
 
@@ -315,18 +500,88 @@ nbd_handle_updated_info(BlockDriverState *bs, Error **errp)
     return 0;
 }
 
+/*
+ * Secondary connections must see the export exactly like the primary one,
+ * since requests are parsed with s->info whatever connection they use.
+ */
+static bool nbd_same_export_info(NBDExportInfo *a, NBDExportInfo *b)
+{
+    return a->mode == b->mode &&
+        a->base_allocation == b->base_allocation &&
+        a->size == b->size &&
+        a->flags == b->flags &&
+        a->min_block == b->min_block &&
+        a->opt_block == b->opt_block &&
+        a->max_block == b->max_block &&
+        a->context_id == b->context_id;
+}
+
+/*
+ * Open the additional connections of multi-conn once the primary one is
+ * established.  This requires the server to advertise
+ * NBD_FLAG_CAN_MULTI_CONN, which guarantees that all connections see the
+ * same data and that a flush on any of them covers the writes completed on
+ * all of them; otherwise, only the primary connection is used.  Failing to
+ * open an additional connection is not fatal either.
+ *
+ * Returns the number of usable connections.
+ */
+static unsigned coroutine_fn
+nbd_co_establish_secondary_channels(BDRVNBDState *s)
+{
+    unsigned i;
+
+    if (s->multi_conn <= 1 || !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_client_multi_conn(s->multi_conn, 1);
+        return 1;
+    }
+
+    for (i = 1; i < s->multi_conn; i++) {
+        NBDClientChannel *ch = &s->channels[i];
+        NBDExportInfo info;
+
+        assert(!ch->ioc);
+        if (!ch->conn) {
+            ch->conn = nbd_client_connection_new(s->saddr, true, s->export,
+                                                 s->x_dirty_bitmap,
+                                                 s->tlscreds, s->tlshostname);
+        }
+
+        ch->ioc = nbd_co_establish_connection(ch->conn, &info, true, NULL);
+        if (!ch->ioc) {
+            break;
+        }
+        if (!nbd_same_export_info(&s->info, &info)) {
+            NBDRequest request = { .type = NBD_CMD_DISC, .mode = info.mode };
+
+            nbd_send_request(ch->ioc, &request);
+            object_unref(OBJECT(ch->ioc));
+            ch->ioc = NULL;
+            break;
+        }
+
+        qio_channel_set_blocking(ch->ioc, false, NULL);
+        qio_channel_set_follow_coroutine_ctx(ch->ioc, true);
+    }
+
+    trace_nbd_client_multi_conn(s->multi_conn, i);
+    return i;
+}
+
 int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
                                                 bool blocking, Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDClientChannel *ch = &s->channels[0];
+    unsigned num_channels;
     int ret;
     IO_CODE();
 
     assert_bdrv_graph_readable();
-    assert(!s->ioc);
+    assert(!ch->ioc);
 
-    s->ioc = nbd_co_establish_connection(s->conn, &s->info, blocking, errp);
-    if (!s->ioc) {
+    ch->ioc = nbd_co_establish_connection(ch->conn, &s->info, blocking, errp);
+    if (!ch->ioc) {
         return -ECONNREFUSED;
     }
 
@@ -341,21 +596,27 @@ int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
          */
         NBDRequest request = { .type = NBD_CMD_DISC, .mode = s->info.mode };
 
-        nbd_send_request(s->ioc, &request);
+        nbd_send_request(ch->ioc, &request);
 
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
                                  nbd_yank, bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+        object_unref(OBJECT(ch->ioc));
+        ch->ioc = NULL;
 
         return ret;
     }
 
-    qio_channel_set_blocking(s->ioc, false, NULL);
-    qio_channel_set_follow_coroutine_ctx(s->ioc, true);
+    qio_channel_set_blocking(ch->ioc, false, NULL);
+    qio_channel_set_follow_coroutine_ctx(ch->ioc, true);
+
+    num_channels = nbd_co_establish_secondary_channels(s);
+
+    /* The export may have changed while we were disconnected */
+    nbd_extents_invalidate(s);
 
     /* successfully connected */
     WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
+        s->num_channels = num_channels;
         s->state = NBD_CLIENT_CONNECTED;
     }
 
@@ -395,12 +656,13 @@ static void coroutine_fn GRAPH_RDLOCK nbd_reconnect_attempt(BDRVNBDState *s)
             s->reconnect_delay * NANOSECONDS_PER_SECOND);
     }
 
-    /* Finalize previous connection if any */
-    if (s->ioc) {
+    /* Finalize previous connections if any */
+    nbd_close_secondary_channels(s);
+    if (s->channels[0].ioc) {
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
                                  nbd_yank, s->bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+        object_unref(OBJECT(s->channels[0].ioc));
+        s->channels[0].ioc = NULL;
     }
 
     qemu_mutex_unlock(&s->requests_lock);
@@ -420,26 +682,27 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
                                             Error **errp)
 {
     int ret;
-    uint64_t ind = COOKIE_TO_INDEX(cookie), ind2;
-    QEMU_LOCK_GUARD(&s->receive_mutex);
+    NBDClientChannel *ch = nbd_cookie_channel(s, cookie);
+    uint64_t ind = INDEX_TO_REQUEST(COOKIE_TO_INDEX(cookie)), ind2;
+    QEMU_LOCK_GUARD(&ch->receive_mutex);
 
     while (true) {
-        if (s->reply.cookie == cookie) {
+        if (ch->reply.cookie == cookie) {
             /* We are done */
             return 0;
         }
 
-        if (s->reply.cookie != 0) {
+        if (ch->reply.cookie != 0) {
             /*
              * Some other request is being handled now. It should already be
-             * woken by whoever set s->reply.cookie (or never wait in this
+             * woken by whoever set ch->reply.cookie (or never wait in this
              * yield). So, we should not wake it here.
              */
-            ind2 = COOKIE_TO_INDEX(s->reply.cookie);
-            assert(!s->requests[ind2].receiving);
+            ind2 = INDEX_TO_REQUEST(COOKIE_TO_INDEX(ch->reply.cookie));
+            assert(!ch->requests[ind2].receiving);
 
-            s->requests[ind].receiving = true;
-            qemu_co_mutex_unlock(&s->receive_mutex);
+            ch->requests[ind].receiving = true;
+            qemu_co_mutex_unlock(&ch->receive_mutex);
 
             qemu_coroutine_yield();
             /*
@@ -447,18 +710,18 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
              * 1. From this function, executing in parallel coroutine, when our
              *    cookie is received.
              * 2. From nbd_co_receive_one_chunk(), when previous request is
-             *    finished and s->reply.cookie set to 0.
+             *    finished and ch->reply.cookie set to 0.
              * Anyway, it's OK to lock the mutex and go to the next iteration.
              */
 
-            qemu_co_mutex_lock(&s->receive_mutex);
-            assert(!s->requests[ind].receiving);
+            qemu_co_mutex_lock(&ch->receive_mutex);
+            assert(!ch->requests[ind].receiving);
             continue;
         }
 
         /* We are under mutex and cookie is 0. We have to do the dirty work. */
-        assert(s->reply.cookie == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, s->info.mode, errp);
+        assert(ch->reply.cookie == 0);
+        ret = nbd_receive_reply(s->bs, ch->ioc, &ch->reply, s->info.mode, errp);
         if (ret == 0) {
             ret = -EIO;
             error_setg(errp, "server dropped connection");
@@ -467,35 +730,55 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
             nbd_channel_error(s, ret);
             return ret;
         }
-        if (nbd_reply_is_structured(&s->reply) &&
+        if (nbd_reply_is_structured(&ch->reply) &&
             s->info.mode < NBD_MODE_STRUCTURED) {
             nbd_channel_error(s, -EINVAL);
             error_setg(errp, "unexpected structured reply");
             return -EINVAL;
         }
-        ind2 = COOKIE_TO_INDEX(s->reply.cookie);
-        if (ind2 >= MAX_NBD_REQUESTS || !s->requests[ind2].coroutine) {
+        /* The reply must be for a request sent on this connection */
+        ind2 = COOKIE_TO_INDEX(ch->reply.cookie);
+        if (INDEX_TO_CHANNEL(ind2) != (uint64_t)(ch - s->channels) ||
+            !ch->requests[INDEX_TO_REQUEST(ind2)].coroutine) {
             nbd_channel_error(s, -EINVAL);
             error_setg(errp, "unexpected cookie value");
             return -EINVAL;
         }
-        if (s->reply.cookie == cookie) {
+        if (ch->reply.cookie == cookie) {
             /* We are done */
             return 0;
         }
-        nbd_recv_coroutine_wake_one(&s->requests[ind2]);
+        nbd_recv_coroutine_wake_one(&ch->requests[INDEX_TO_REQUEST(ind2)]);
     }
 }
 
+/*
+ * Pick the connection with the fewest requests in flight.  Called with
+ * s->requests_lock held.
+ */
+static NBDClientChannel *nbd_pick_channel(BDRVNBDState *s)
+{
+    NBDClientChannel *best = &s->channels[0];
+    unsigned i;
+
+    for (i = 1; i < s->num_channels; i++) {
+        if (s->channels[i].in_flight < best->in_flight) {
+            best = &s->channels[i];
+        }
+    }
+    return best;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 nbd_co_send_request(BlockDriverState *bs, NBDRequest *request,
                     QEMUIOVector *qiov)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDClientChannel *ch = NULL;
     int rc, i = -1;
 
     qemu_mutex_lock(&s->requests_lock);
-    while (s->in_flight == MAX_NBD_REQUESTS ||
+    while (s->in_flight == MAX_NBD_REQUESTS * s->num_channels ||
            (s->state != NBD_CLIENT_CONNECTED && s->in_flight > 0)) {
         qemu_co_queue_wait(&s->free_sema, &s->requests_lock);
     }
@@ -512,43 +795,48 @@ nbd_co_send_request(BlockDriverState *bs, NBDRequest *request,
         }
     }
 
+    ch = nbd_pick_channel(s);
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
+        if (ch->requests[i].coroutine == NULL) {
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    s->requests[i].coroutine = qemu_coroutine_self();
-    s->requests[i].offset = request->from;
-    s->requests[i].receiving = false;
+    ch->in_flight++;
+    trace_nbd_client_request_channel(ch - s->channels, ch->in_flight);
+    ch->requests[i].coroutine = qemu_coroutine_self();
+    ch->requests[i].offset = request->from;
+    ch->requests[i].receiving = false;
     qemu_mutex_unlock(&s->requests_lock);
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    request->cookie = INDEX_TO_COOKIE(i);
+    qemu_co_mutex_lock(&ch->send_mutex);
+    request->cookie = INDEX_TO_COOKIE((ch - s->channels) * MAX_NBD_REQUESTS +
+                                      i);
     request->mode = s->info.mode;
 
-    assert(s->ioc);
+    assert(ch->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
-        if (rc >= 0 && qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+        qio_channel_set_cork(ch->ioc, true);
+        rc = nbd_send_request(ch->ioc, request);
+        if (rc >= 0 && qio_channel_writev_all(ch->ioc, qiov->iov, qiov->niov,
                                               NULL) < 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(ch->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(ch->ioc, request);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&ch->send_mutex);
 
     if (rc < 0) {
         qemu_mutex_lock(&s->requests_lock);
 err:
         nbd_channel_error_locked(s, rc);
         if (i != -1) {
-            s->requests[i].coroutine = NULL;
+            ch->requests[i].coroutine = NULL;
+            ch->in_flight--;
         }
         s->in_flight--;
         qemu_co_queue_next(&s->free_sema);
@@ -610,19 +898,25 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
 
 /*
  * nbd_parse_blockstatus_payload
- * Based on our request, we expect only one extent in reply, for the
- * base:allocation context.
+ * Based on our request, we expect extents for the base:allocation context
+ * only, and a single one if @max_extents is 1 (NBD_CMD_FLAG_REQ_ONE).  At
+ * most @max_extents extents covering at most @orig_length bytes are stored
+ * in @extents, and their number in *@nb_extents.
  */
 static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, bool wide,
                                          uint64_t orig_length,
-                                         NBDExtent64 *extent, Error **errp)
+                                         NBDExtent64 *extents,
+                                         unsigned max_extents,
+                                         unsigned *nb_extents, Error **errp)
 {
     uint32_t context_id;
     uint32_t count;
-    size_t ext_len = wide ? sizeof(*extent) : sizeof(NBDExtent32);
+    size_t ext_len = wide ? sizeof(*extents) : sizeof(NBDExtent32);
     size_t pay_len = sizeof(context_id) + wide * sizeof(count) + ext_len;
+    unsigned n = 0;
+    uint64_t total = 0;
 
     /* The server succeeded, so it must have sent [at least] one extent */
     if (chunk->length < pay_len) {
@@ -642,72 +936,104 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
 
     if (wide) {
         count = payload_advance32(&payload);
-        extent->length = payload_advance64(&payload);
-        extent->flags = payload_advance64(&payload);
     } else {
-        count = 0;
-        extent->length = payload_advance32(&payload);
-        extent->flags = payload_advance32(&payload);
+        count = (chunk->length - sizeof(context_id)) / ext_len;
     }
-
-    if (extent->length == 0) {
-        error_setg(errp, "Protocol error: server sent status chunk with "
-                   "zero length");
-        return -EINVAL;
+    if (count * ext_len != chunk->length - (pay_len - ext_len)) {
+        trace_nbd_parse_blockstatus_compliance("extent count does not match "
+                                               "payload length");
+        count = MIN(count, (chunk->length - (pay_len - ext_len)) / ext_len);
     }
 
-    /*
-     * A server sending unaligned block status is in violation of the
-     * protocol, but as qemu-nbd 3.1 is such a server (at least for
-     * POSIX files that are not a multiple of 512 bytes, since qemu
-     * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
-     * still sees an implicit hole beyond the real EOF), it's nicer to
-     * work around the misbehaving server. If the request included
-     * more than the final unaligned block, truncate it back to an
-     * aligned result; if the request was only the final block, round
-     * up to the full block and change the status to fully-allocated
-     * (always a safe status, even if it loses information).
-     */
-    if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
-                                              s->info.min_block)) {
-        trace_nbd_parse_blockstatus_compliance("extent length is unaligned");
-        if (extent->length > s->info.min_block) {
-            extent->length = QEMU_ALIGN_DOWN(extent->length,
-                                             s->info.min_block);
+    while (n < MIN(count, max_extents) && total < orig_length) {
+        NBDExtent64 *extent = &extents[n];
+        bool last = false;
+
+        if (wide) {
+            extent->length = payload_advance64(&payload);
+            extent->flags = payload_advance64(&payload);
         } else {
-            extent->length = s->info.min_block;
-            extent->flags = 0;
+            extent->length = payload_advance32(&payload);
+            extent->flags = payload_advance32(&payload);
         }
-    }
 
-    /*
-     * We used NBD_CMD_FLAG_REQ_ONE, so the server should not have
-     * sent us any more than one extent, nor should it have included
-     * status beyond our request in that extent. Furthermore, a wide
-     * server should have replied with an accurate count (we left
-     * count at 0 for a narrow server).  However, it's easy enough to
-     * ignore the server's noncompliance without killing the
-     * connection; just ignore trailing extents, and clamp things to
-     * the length of our request.
-     */
-    if (count != wide || chunk->length > pay_len) {
-        trace_nbd_parse_blockstatus_compliance("unexpected extent count");
-    }
-    if (extent->length > orig_length) {
-        extent->length = orig_length;
-        trace_nbd_parse_blockstatus_compliance("extent length too large");
+        if (extent->length == 0) {
+            if (n) {
+                trace_nbd_parse_blockstatus_compliance("zero length extent");
+                break;
+            }
+            error_setg(errp, "Protocol error: server sent status chunk with "
+                       "zero length");
+            return -EINVAL;
+        }
+
+        /*
+         * A server sending unaligned block status is in violation of the
+         * protocol, but as qemu-nbd 3.1 is such a server (at least for
+         * POSIX files that are not a multiple of 512 bytes, since qemu
+         * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
+         * still sees an implicit hole beyond the real EOF), it's nicer to
+         * work around the misbehaving server. If the request included
+         * more than the final unaligned block, truncate it back to an
+         * aligned result; if the request was only the final block, round
+         * up to the full block and change the status to fully-allocated
+         * (always a safe status, even if it loses information).  Only
+         * the first extent gets this treatment, any later ones are
+         * dropped and will be asked for again.
+         */
+        if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
+                                                  s->info.min_block)) {
+            trace_nbd_parse_blockstatus_compliance("extent length is "
+                                                   "unaligned");
+            if (n) {
+                break;
+            }
+            if (extent->length > s->info.min_block) {
+                extent->length = QEMU_ALIGN_DOWN(extent->length,
+                                                 s->info.min_block);
+            } else {
+                extent->length = s->info.min_block;
+                extent->flags = 0;
+            }
+            last = true;
+        }
+
+        /*
+         * The server should not have included status beyond our request,
+         * but it's easy enough to clamp things to the length of our
+         * request without killing the connection.
+         */
+        if (extent->length > orig_length - total) {
+            extent->length = orig_length - total;
+            trace_nbd_parse_blockstatus_compliance("extent length too large");
+        }
+
+        /*
+         * HACK: if we are using x-dirty-bitmaps to access
+         * qemu:allocation-depth, treat all depths > 2 the same as 2,
+         * since nbd_client_co_block_status is only expecting the low two
+         * bits to be set.
+         */
+        if (s->alloc_depth && extent->flags > 2) {
+            extent->flags = 2;
+        }
+
+        total += extent->length;
+        n++;
+        if (last) {
+            break;
+        }
     }
 
     /*
-     * HACK: if we are using x-dirty-bitmaps to access
-     * qemu:allocation-depth, treat all depths > 2 the same as 2,
-     * since nbd_client_co_block_status is only expecting the low two
-     * bits to be set.
+     * With NBD_CMD_FLAG_REQ_ONE, the server should not have sent us any
+     * more than one extent.  Just ignore trailing extents.
      */
-    if (s->alloc_depth && extent->flags > 2) {
-        extent->flags = 2;
+    if (max_extents == 1 && count > 1) {
+        trace_nbd_parse_blockstatus_compliance("unexpected extent count");
     }
 
+    *nb_extents = n;
     return 0;
 }
 
@@ -754,16 +1080,17 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
 }
 
 static int coroutine_fn
-nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
+nbd_co_receive_offset_data_payload(BDRVNBDState *s, NBDClientChannel *ch,
+                                   uint64_t orig_offset,
                                    QEMUIOVector *qiov, Error **errp)
 {
     QEMUIOVector sub_qiov;
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &ch->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&ch->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -772,7 +1099,7 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(ch->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -790,7 +1117,7 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(ch->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -798,14 +1125,14 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDClientChannel *ch, void **payload, uint32_t max_len, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&ch->reply));
 
-    len = s->reply.structured.length;
+    len = ch->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -816,13 +1143,13 @@ static coroutine_fn int nbd_co_receive_structured_payload(
         return -EINVAL;
     }
 
-    if (len > NBD_MAX_MALLOC_PAYLOAD) {
+    if (len > max_len) {
         error_setg(errp, "Payload too large");
         return -EINVAL;
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(ch->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -853,9 +1180,10 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
 {
     ERRP_GUARD();
     int ret;
-    int i = COOKIE_TO_INDEX(cookie);
+    NBDClientChannel *ch = nbd_cookie_channel(s, cookie);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
+    uint32_t max_len = NBD_MAX_MALLOC_PAYLOAD;
 
     if (payload) {
         *payload = NULL;
@@ -867,29 +1195,29 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         error_prepend(errp, "Connection closed: ");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(ch->ioc);
 
-    assert(s->reply.cookie == cookie);
+    assert(ch->reply.cookie == cookie);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&ch->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(ch->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(ch->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
     assert(s->info.mode >= NBD_MODE_STRUCTURED);
-    chunk = &s->reply.structured;
+    chunk = &ch->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -911,15 +1239,25 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
-                                                  qiov, errp);
+        return nbd_co_receive_offset_data_payload(
+            s, ch, nbd_cookie_request(s, cookie)->offset, qiov, errp);
     }
 
     if (nbd_reply_type_is_error(chunk->type)) {
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    /*
+     * Without NBD_CMD_FLAG_REQ_ONE, the server may send as many extents as
+     * fit in a reply, even if only the first block_status_extents are kept.
+     */
+    if ((chunk->type == NBD_REPLY_TYPE_BLOCK_STATUS ||
+         chunk->type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) &&
+        s->block_status_extents > 1) {
+        max_len = NBD_MAX_BUFFER_SIZE;
+    }
+
+    ret = nbd_co_receive_structured_payload(ch, payload, max_len, errp);
     if (ret < 0) {
         return ret;
     }
@@ -943,6 +1281,7 @@ static coroutine_fn int nbd_co_receive_one_chunk(
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
+    NBDClientChannel *ch = nbd_cookie_channel(s, cookie);
     int ret = nbd_co_do_receive_one_chunk(s, cookie, only_structured,
                                           request_ret, qiov, payload, errp);
 
@@ -951,11 +1290,11 @@ static coroutine_fn int nbd_co_receive_one_chunk(
         nbd_channel_error(s, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
+        *reply = ch->reply;
     }
-    s->reply.cookie = 0;
+    ch->reply.cookie = 0;
 
-    nbd_recv_coroutines_wake(s);
+    nbd_recv_coroutines_wake(ch);
 
     return ret;
 }
@@ -1059,7 +1398,8 @@ static bool coroutine_fn nbd_reply_chunk_iter_receive(BDRVNBDState *s,
 
 break_loop:
     qemu_mutex_lock(&s->requests_lock);
-    s->requests[COOKIE_TO_INDEX(cookie)].coroutine = NULL;
+    nbd_cookie_request(s, cookie)->coroutine = NULL;
+    nbd_cookie_channel(s, cookie)->in_flight--;
     s->in_flight--;
     qemu_co_queue_next(&s->free_sema);
     qemu_mutex_unlock(&s->requests_lock);
@@ -1138,7 +1478,8 @@ nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t cookie,
 
 static int coroutine_fn
 nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
-                                 uint64_t length, NBDExtent64 *extent,
+                                 uint64_t length, NBDExtent64 *extents,
+                                 unsigned max_extents, unsigned *nb_extents,
                                  int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
@@ -1147,7 +1488,7 @@ nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
     Error *local_err = NULL;
     bool received = false;
 
-    assert(!extent->length);
+    *nb_extents = 0;
     NBD_FOREACH_REPLY_CHUNK(s, iter, cookie, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
@@ -1171,7 +1512,7 @@ nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
 
             ret = nbd_parse_blockstatus_payload(
                 s, &reply.structured, payload, wide,
-                length, extent, &local_err);
+                length, extents, max_extents, nb_extents, &local_err);
             if (ret < 0) {
                 nbd_channel_error(s, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
@@ -1192,7 +1533,7 @@ nbd_co_receive_blockstatus_reply(BDRVNBDState *s, uint64_t cookie,
         payload = NULL;
     }
 
-    if (!extent->length && !iter.request_ret) {
+    if (!*nb_extents && !iter.request_ret) {
         error_setg(&local_err, "Server did not reply with any status extents");
         nbd_iter_channel_error(&iter, -EIO, &local_err);
     }
@@ -1209,6 +1550,9 @@ nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    bool changes_data = request->type == NBD_CMD_WRITE ||
+                        request->type == NBD_CMD_WRITE_ZEROES ||
+                        request->type == NBD_CMD_TRIM;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1218,6 +1562,14 @@ nbd_co_request(BlockDriverState *bs, NBDRequest *request,
         assert(request->type != NBD_CMD_WRITE);
     }
 
+    /*
+     * Invalidate cached block status both before and after the request, so
+     * that a block status reply that raced with it is not kept either.
+     */
+    if (changes_data) {
+        nbd_extents_invalidate(s);
+    }
+
     do {
         ret = nbd_co_send_request(bs, request, write_qiov);
         if (ret < 0) {
@@ -1237,6 +1589,10 @@ nbd_co_request(BlockDriverState *bs, NBDRequest *request,
         }
     } while (ret < 0 && nbd_client_will_reconnect(s));
 
+    if (changes_data) {
+        nbd_extents_invalidate(s);
+    }
+
     return ret ? ret : request_ret;
 }
 
@@ -1401,15 +1757,25 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
         int64_t *pnum, int64_t *map, BlockDriverState **file)
 {
     int ret, request_ret;
-    NBDExtent64 extent = { 0 };
+    g_autofree NBDExtent64 *extents = NULL;
+    unsigned nb_extents = 0;
+    uint64_t generation;
+    uint64_t extent_len, flags;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     Error *local_err = NULL;
+    bool req_one = s->block_status_extents == 1;
 
+    /*
+     * Without NBD_CMD_FLAG_REQ_ONE, ask for the status up to the end of
+     * the image, so that the following calls can be answered from the
+     * extents of the reply.
+     */
     NBDRequest request = {
         .type = NBD_CMD_BLOCK_STATUS,
         .from = offset,
-        .len = MIN(bytes, s->info.size - offset),
-        .flags = NBD_CMD_FLAG_REQ_ONE,
+        .len = req_one ? MIN(bytes, s->info.size - offset)
+                       : s->info.size - offset,
+        .flags = req_one ? NBD_CMD_FLAG_REQ_ONE : 0,
     };
 
     if (!s->info.base_allocation) {
@@ -1437,17 +1803,26 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
         return BDRV_BLOCK_ZERO;
     }
 
+    if (!req_one && nbd_extents_lookup(s, offset, bytes, &extent_len,
+                                       &flags)) {
+        goto out;
+    }
+
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
+    extents = g_new(NBDExtent64, s->block_status_extents);
+    generation = nbd_extents_generation(s);
     do {
         ret = nbd_co_send_request(bs, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_blockstatus_reply(s, request.cookie, bytes,
-                                               &extent, &request_ret,
+        ret = nbd_co_receive_blockstatus_reply(s, request.cookie, request.len,
+                                               extents,
+                                               s->block_status_extents,
+                                               &nb_extents, &request_ret,
                                                &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.cookie,
@@ -1463,12 +1838,21 @@ static int coroutine_fn GRAPH_RDLOCK nbd_client_co_block_status(
         return ret ? ret : request_ret;
     }
 
-    assert(extent.length);
-    *pnum = extent.length;
+    assert(nb_extents && extents[0].length);
+    extent_len = MIN(extents[0].length, bytes);
+    flags = extents[0].flags;
+    if (!req_one) {
+        trace_nbd_client_block_status_extents(offset, request.len, nb_extents);
+        nbd_extents_store(s, offset, g_steal_pointer(&extents), nb_extents,
+                          generation);
+    }
+
+out:
+    *pnum = extent_len;
     *map = offset;
     *file = bs;
-    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
-        (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+    return (flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+        (flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
         BDRV_BLOCK_OFFSET_VALID;
 }
 
@@ -1490,7 +1874,7 @@ static void nbd_yank(void *opaque)
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     QEMU_LOCK_GUARD(&s->requests_lock);
-    qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    nbd_shutdown_channels(s);
     s->state = NBD_CLIENT_QUIT;
 }
 
@@ -1498,9 +1882,12 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC, .mode = s->info.mode };
+    int i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        if (s->channels[i].ioc) {
+            nbd_send_request(s->channels[i].ioc, &request);
+        }
     }
 
     nbd_teardown_connection(bs);
@@ -1840,6 +2227,18 @@ static QemuOptsList nbd_runtime_opts = {
                     "attempts until successful or until @open-timeout seconds "
                     "have elapsed. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server, if it supports "
+                    "multiple connections. Default 1",
+        },
+        {
+            .name = "block-status-extents",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of extents to keep from each block "
+                    "status reply. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1896,6 +2295,22 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
     s->open_timeout = qemu_opt_get_number(opts, "open-timeout", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
+    s->block_status_extents =
+        qemu_opt_get_number(opts, "block-status-extents", 1);
+    if (s->block_status_extents < 1 ||
+        s->block_status_extents > MAX_NBD_BLOCK_STATUS_EXTENTS) {
+        error_setg(errp, "block-status-extents must be between 1 and %zu",
+                   MAX_NBD_BLOCK_STATUS_EXTENTS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1908,12 +2323,17 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     s->bs = bs;
     qemu_mutex_init(&s->requests_lock);
+    qemu_mutex_init(&s->extents_lock);
     qemu_co_queue_init(&s->free_sema);
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->receive_mutex);
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        qemu_co_mutex_init(&s->channels[i].send_mutex);
+        qemu_co_mutex_init(&s->channels[i].receive_mutex);
+    }
+    s->num_channels = 1;
 
     if (!yank_register_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name), errp)) {
         return -EEXIST;
@@ -1924,12 +2344,14 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->conn = nbd_client_connection_new(s->saddr, true, s->export,
-                                        s->x_dirty_bitmap, s->tlscreds,
-                                        s->tlshostname);
+    s->channels[0].conn = nbd_client_connection_new(s->saddr, true,
+                                                    s->export,
+                                                    s->x_dirty_bitmap,
+                                                    s->tlscreds,
+                                                    s->tlshostname);
 
     if (s->open_timeout) {
-        nbd_client_connection_enable_retry(s->conn);
+        nbd_client_connection_enable_retry(s->channels[0].conn);
         open_timer_init(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
                         s->open_timeout * NANOSECONDS_PER_SECOND);
     }
@@ -1947,7 +2369,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
      */
     open_timer_del(s);
 
-    nbd_client_connection_enable_retry(s->conn);
+    nbd_client_connection_enable_retry(s->channels[0].conn);
 
     return 0;
 
@@ -2108,7 +2530,7 @@ static void nbd_cancel_in_flight(BlockDriverState *bs)
     }
     qemu_mutex_unlock(&s->requests_lock);
 
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connections(s);
 }
 
 static void nbd_attach_aio_context(BlockDriverState *bs,
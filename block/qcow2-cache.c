@@ -24,26 +24,55 @@
 
 #include "qemu/osdep.h"
 #include "block/block-io.h"
+#include "qemu/atomic.h"
+#include "qemu/lockable.h"
 #include "qemu/memalign.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * The cache is split into shards of consecutive entries.  A table is cached
+ * in the shard selected by its offset, so lookups only scan that shard, and
+ * each shard replaces its entries with the clock algorithm.  If all entries
+ * of that shard are in use, the table borrows an entry of the next shard, so
+ * lookups that miss in the first shard also scan the next one.
+ *
+ * Tables are only loaded, written back and modified by callers that hold
+ * s->lock.  The lock of a shard protects the offsets of its entries, so that
+ * qcow2_cache_peek() can also look up tables without s->lock: an entry that
+ * can be found always holds the table of its offset.
+ */
+#define QCOW2_CACHE_SHARD_MIN_ENTRIES 16
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
-    uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Set when the table is used, cleared by the clock hand */
+    bool     referenced;
+    /* Set when the table is used, cleared by qcow2_cache_clean_unused() */
+    bool     used;
 } Qcow2CachedTable;
 
+typedef struct Qcow2CacheShard {
+    QemuMutex lock;
+    /* Index of the first entry of the shard */
+    int       first;
+    int       size;
+    /* Next entry to consider for replacement, relative to @first */
+    int       clock_hand;
+} Qcow2CacheShard;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
+    Qcow2CacheShard        *shards;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     nb_shards;
+    int                     shard_size;
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
-    uint64_t                cache_clean_lru_counter;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +88,26 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+/* Returns the shard in which the table at @offset is cached */
+static inline Qcow2CacheShard *qcow2_cache_offset_shard(Qcow2Cache *c,
+                                                        uint64_t offset)
+{
+    return &c->shards[(offset / c->table_size) % c->nb_shards];
+}
+
+/* Returns the shard that @shard borrows entries from when it is full */
+static inline Qcow2CacheShard *qcow2_cache_next_shard(Qcow2Cache *c,
+                                                      Qcow2CacheShard *shard)
+{
+    return &c->shards[(shard - c->shards + 1) % c->nb_shards];
+}
+
+/* Returns the shard of entry @i */
+static inline Qcow2CacheShard *qcow2_cache_entry_shard(Qcow2Cache *c, int i)
+{
+    return &c->shards[MIN(i / c->shard_size, c->nb_shards - 1)];
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -86,38 +135,52 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+/* Called with the shard lock held */
+static inline void qcow2_cache_entry_reset(Qcow2CachedTable *t)
+{
+    t->offset = 0;
+    t->referenced = false;
+    t->used = false;
+}
+
+/* Called with the shard lock held */
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
-        t->lru_counter <= c->cache_clean_lru_counter;
+    return t->ref == 0 && !t->dirty && t->offset != 0 && !t->used;
 }
 
 void qcow2_cache_clean_unused(Qcow2Cache *c)
 {
-    int i = 0;
-    while (i < c->size) {
-        int to_clean = 0;
-
-        /* Skip the entries that we don't need to clean */
-        while (i < c->size && !can_clean_entry(c, i)) {
-            i++;
-        }
-
-        /* And count how many we can clean in a row */
-        while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
-            i++;
-            to_clean++;
-        }
-
-        if (to_clean > 0) {
-            qcow2_cache_table_release(c, i - to_clean, to_clean);
+    int n;
+
+    for (n = 0; n < c->nb_shards; n++) {
+        Qcow2CacheShard *shard = &c->shards[n];
+        int end = shard->first + shard->size;
+        int i = shard->first;
+
+        QEMU_LOCK_GUARD(&shard->lock);
+        while (i < end) {
+            int to_clean = 0;
+
+            /* Skip the entries that we don't need to clean */
+            while (i < end && !can_clean_entry(c, i)) {
+                c->entries[i].used = false;
+                i++;
+            }
+
+            /* And count how many we can clean in a row */
+            while (i < end && can_clean_entry(c, i)) {
+                qcow2_cache_entry_reset(&c->entries[i]);
+                i++;
+                to_clean++;
+            }
+
+            if (to_clean > 0) {
+                qcow2_cache_table_release(c, i - to_clean, to_clean);
+            }
         }
     }
-
-    c->cache_clean_lru_counter = c->lru_counter;
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -125,6 +188,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -142,7 +206,18 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    /* The last shard also gets the entries left over by the division */
+    c->nb_shards = MAX(num_tables / QCOW2_CACHE_SHARD_MIN_ENTRIES, 1);
+    c->shard_size = num_tables / c->nb_shards;
+    c->shards = g_new0(Qcow2CacheShard, c->nb_shards);
+    for (i = 0; i < c->nb_shards; i++) {
+        qemu_mutex_init(&c->shards[i].lock);
+        c->shards[i].first = i * c->shard_size;
+        c->shards[i].size = i == c->nb_shards - 1 ?
+                            num_tables - c->shards[i].first : c->shard_size;
     }
 
     return c;
@@ -156,7 +231,12 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    for (i = 0; i < c->nb_shards; i++) {
+        qemu_mutex_destroy(&c->shards[i].lock);
+    }
+
     qemu_vfree(c->table_array);
+    g_free(c->shards);
     g_free(c->entries);
     g_free(c);
 
@@ -300,36 +380,103 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret, i, n;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+    for (n = 0; n < c->nb_shards; n++) {
+        Qcow2CacheShard *shard = &c->shards[n];
+
+        QEMU_LOCK_GUARD(&shard->lock);
+        for (i = shard->first; i < shard->first + shard->size; i++) {
+            assert(c->entries[i].ref == 0);
+            qcow2_cache_entry_reset(&c->entries[i]);
+        }
+        shard->clock_hand = 0;
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
-    c->lru_counter = 0;
-
     return 0;
 }
 
+/* Returns the entry of @shard holding the table at @offset, or -1 */
+static int qcow2_cache_shard_find(Qcow2Cache *c, Qcow2CacheShard *shard,
+                                  uint64_t offset)
+{
+    int i;
+
+    for (i = shard->first; i < shard->first + shard->size; i++) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the entry holding the table at @offset, or -1.  If the table is
+ * found, the lock of the shard of its entry is held on return and the shard
+ * is stored in @shardp.
+ */
+static int qcow2_cache_lookup_lock(Qcow2Cache *c, uint64_t offset,
+                                   Qcow2CacheShard **shardp)
+{
+    Qcow2CacheShard *shard = qcow2_cache_offset_shard(c, offset);
+    int n, i;
+
+    for (n = 0; n < MIN(c->nb_shards, 2); n++) {
+        qemu_mutex_lock(&shard->lock);
+        i = qcow2_cache_shard_find(c, shard, offset);
+        if (i >= 0) {
+            *shardp = shard;
+            return i;
+        }
+        qemu_mutex_unlock(&shard->lock);
+        shard = qcow2_cache_next_shard(c, shard);
+    }
+    return -1;
+}
+
+/*
+ * Returns the entry of @shard to replace, i.e. the first unused entry that
+ * the clock hand finds without its referenced bit set, or -1 if all entries
+ * are in use.  The bits of the entries that the hand passes are cleared.
+ */
+static int qcow2_cache_shard_evict(Qcow2Cache *c, Qcow2CacheShard *shard)
+{
+    int n;
+
+    for (n = 0; n < 2 * shard->size; n++) {
+        int i = shard->first + shard->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++shard->clock_hand == shard->size) {
+            shard->clock_hand = 0;
+        }
+        if (t->ref) {
+            continue;
+        }
+        if (t->offset && t->referenced) {
+            t->referenced = false;
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
 static int GRAPH_RDLOCK
 qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i;
+    Qcow2CacheShard *shard;
+    int i, n;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,40 +491,58 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup_lock(c, offset, &shard);
+    if (i >= 0) {
+        c->entries[i].ref++;
+        c->entries[i].referenced = true;
+        c->entries[i].used = true;
+        qemu_mutex_unlock(&shard->lock);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    /*
+     * Replace an entry of the shard of @offset or, if all of them are in
+     * use, borrow one from the next shard.  Callers hold s->lock, so the
+     * table cannot be added concurrently by someone else.
+     */
+    shard = qcow2_cache_offset_shard(c, offset);
+    for (n = 0; n < MIN(c->nb_shards, 2); n++) {
+        WITH_QEMU_LOCK_GUARD(&shard->lock) {
+            i = qcow2_cache_shard_evict(c, shard);
+            if (i >= 0) {
+                /*
+                 * Keep qcow2_cache_clean_unused() away while the entry is
+                 * replaced
+                 */
+                c->entries[i].ref++;
+                goto replace;
+            }
+        }
+        trace_qcow2_cache_get_shard_full(qemu_coroutine_self(),
+                                         c == s->l2_table_cache,
+                                         (int)(shard - c->shards));
+        shard = qcow2_cache_next_shard(c, shard);
     }
 
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
+
+replace:
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
-        return ret;
+        goto fail;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        qcow2_cache_entry_reset(&c->entries[i]);
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -386,21 +551,30 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         ret = bdrv_pread(bs->file, offset, c->table_size,
                          qcow2_cache_get_table_addr(c, i), 0);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
 
-    c->entries[i].offset = offset;
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        c->entries[i].offset = offset;
+        c->entries[i].referenced = true;
+        c->entries[i].used = true;
+    }
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
 
     return 0;
+
+fail:
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        c->entries[i].ref--;
+    }
+    return ret;
 }
 
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
@@ -418,14 +592,12 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
+    Qcow2CacheShard *shard = qcow2_cache_entry_shard(c, i);
 
+    QEMU_LOCK_GUARD(&shard->lock);
     c->entries[i].ref--;
     *table = NULL;
 
-    if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
-    }
-
     assert(c->entries[i].ref >= 0);
 }
 
@@ -438,24 +610,58 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
+    Qcow2CacheShard *shard;
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    i = qcow2_cache_lookup_lock(c, offset, &shard);
+    if (i < 0) {
+        return NULL;
+    }
+    qemu_mutex_unlock(&shard->lock);
+    return qcow2_cache_get_table_addr(c, i);
+}
+
+#ifdef CONFIG_ATOMIC64
+/*
+ * Reads the big endian 64-bit word @index of the table at @offset if that
+ * table is cached, without loading it.  Unlike the functions above, this
+ * may be called without s->lock.  The word may be modified concurrently by
+ * the holder of s->lock, so only use it where that is harmless.
+ *
+ * Returns true if the table is cached.
+ */
+bool qcow2_cache_peek(Qcow2Cache *c, uint64_t offset, int index,
+                      uint64_t *value)
+{
+    Qcow2CacheShard *shard;
+    uint64_t *t;
+    int i;
+
+    assert(index >= 0 && index < c->table_size / sizeof(uint64_t));
+
+    i = qcow2_cache_lookup_lock(c, offset, &shard);
+    if (i < 0) {
+        return false;
     }
-    return NULL;
+
+    c->entries[i].referenced = true;
+    c->entries[i].used = true;
+    t = qcow2_cache_get_table_addr(c, i);
+    *value = qatomic_read__nocheck(&t[index]);
+    qemu_mutex_unlock(&shard->lock);
+    return true;
 }
+#endif
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
+    Qcow2CacheShard *shard = qcow2_cache_entry_shard(c, i);
 
+    QEMU_LOCK_GUARD(&shard->lock);
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_reset(&c->entries[i]);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
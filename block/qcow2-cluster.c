@@ -30,6 +30,7 @@
 #include "qcow2.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
@@ -83,6 +84,17 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2L1TableFree {
+    struct rcu_head rcu;
+    uint64_t *l1_table;
+} Qcow2L1TableFree;
+
+static void qcow2_l1_table_free_rcu(Qcow2L1TableFree *f)
+{
+    qemu_vfree(f->l1_table);
+    g_free(f);
+}
+
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size)
 {
@@ -91,6 +103,7 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     uint64_t *new_l1_table;
     int64_t old_l1_table_offset, old_l1_size;
     int64_t new_l1_table_offset, new_l1_size;
+    Qcow2L1TableFree *free_l1;
     uint8_t data[12];
 
     if (min_size <= s->l1_size)
@@ -177,12 +190,18 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
+    /*
+     * qcow2_get_host_offset_cached() may still be reading the old table.  It
+     * reads l1_size before l1_table, so publish the larger size last.
+     */
+    free_l1 = g_new(Qcow2L1TableFree, 1);
+    free_l1->l1_table = s->l1_table;
+    call_rcu(free_l1, qcow2_l1_table_free_rcu, rcu);
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
+    qatomic_rcu_set(&s->l1_table, new_l1_table);
     old_l1_size = s->l1_size;
-    s->l1_size = new_l1_size;
+    qatomic_store_release(&s->l1_size, new_l1_size);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -742,6 +761,91 @@ fail:
     return ret;
 }
 
+#ifdef CONFIG_ATOMIC64
+/*
+ * qcow2_get_host_offset_cached
+ *
+ * Like qcow2_get_host_offset(), but may be called without s->lock, so that
+ * reads from several threads do not serialize on it.  It only handles
+ * requests within a single cluster whose L2 slice is already cached, and only
+ * plain normal, zero and unallocated clusters in images without subclusters.
+ *
+ * Returns true on success, or false if the caller has to take s->lock and
+ * use qcow2_get_host_offset().  In that case nothing is changed.
+ */
+bool qcow2_get_host_offset_cached(BlockDriverState *bs, uint64_t offset,
+                                  unsigned int bytes, uint64_t *host_offset,
+                                  QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int offset_in_cluster = offset_into_cluster(s, offset);
+    uint64_t l1_index, l1_entry, l2_offset, l2_entry, host_cluster_offset;
+    uint64_t start_of_slice;
+    uint64_t *l1_table;
+    QCow2SubclusterType type;
+
+    if (has_subclusters(s) || offset_in_cluster + bytes > s->cluster_size) {
+        return false;
+    }
+
+    l1_index = offset_to_l1_index(s, offset);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        /* Pairs with the store in qcow2_grow_l1_table() */
+        if (l1_index >= qatomic_load_acquire(&s->l1_size)) {
+            return false;
+        }
+        l1_table = qatomic_rcu_read(&s->l1_table);
+        l1_entry = qatomic_read__nocheck(&l1_table[l1_index]);
+    }
+
+    l2_offset = l1_entry & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return false;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    if (!qcow2_cache_peek(s->l2_table_cache, l2_offset + start_of_slice,
+                          offset_to_l2_slice_index(s, offset), &l2_entry)) {
+        return false;
+    }
+    l2_entry = be64_to_cpu(l2_entry);
+
+    type = qcow2_get_subcluster_type(bs, l2_entry, 0, 0);
+    switch (type) {
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        if (s->qcow_version < 3) {
+            return false;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        *host_offset = 0;
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        if (s->qcow_version < 3) {
+            return false;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_NORMAL:
+        host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        if (offset_into_cluster(s, host_cluster_offset) ||
+            (has_data_file(bs) &&
+             host_cluster_offset != offset - offset_in_cluster)) {
+            /* Let qcow2_get_host_offset() signal the corruption */
+            return false;
+        }
+        *host_offset = host_cluster_offset + offset_in_cluster;
+        break;
+    default:
+        return false;
+    }
+
+    *subcluster_type = type;
+    return true;
+}
+#endif
+
 /*
  * get_cluster_table
  *
@@ -857,6 +961,12 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return cluster_offset;
     }
 
+    /* A load that reserved these bytes before they were freed is stale */
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_invalidate(s->compressed_cache, cluster_offset,
+                                          compressed_size);
+    }
+
     nb_csectors =
         (cluster_offset + compressed_size - 1) / QCOW2_COMPRESSED_SECTOR_SIZE -
         (cluster_offset / QCOW2_COMPRESSED_SECTOR_SIZE);
@@ -1621,14 +1731,15 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+            qcow2_alloc_data_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
         *host_offset = cluster_offset;
         return 0;
     } else {
-        int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        int64_t ret = qcow2_alloc_data_clusters_at(bs, *host_offset,
+                                                   *nb_clusters);
         if (ret < 0) {
             return ret;
         }
@@ -0,0 +1,350 @@
+/*
+ * Cache of decompressed clusters for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Compressed clusters are read and decompressed as a whole even if the guest
+ * only asks for a few sectors, so sequential reads of a compressed image
+ * decompress every cluster many times.  This cache keeps the decompressed
+ * data of recently read clusters, indexed by the host offset of their
+ * compressed data, which is what the L2 entry points to.
+ *
+ * Entries are either loaded (data != NULL) or being loaded by a readahead
+ * coroutine (data == NULL), in which case they only exist to prevent the
+ * same cluster from being read twice.  Evicting uses the clock algorithm
+ * and never picks an entry that is being loaded.
+ *
+ * Every load of a cluster that is meant to end up in the cache reserves its
+ * entry first, and only fills that reservation.  Compressed clusters are
+ * never rewritten in place, but the host cluster may be freed and reused
+ * for other compressed data.  Freeing or allocating host clusters drops the
+ * entries that overlap them, found through a second hash table indexed by
+ * host cluster.  Dropping an entry bumps a generation number, which tags
+ * new reservations: a load whose reservation was dropped cannot fill a
+ * later reservation of the same offset with stale data.
+ *
+ * The cache has its own lock because it is accessed without s->lock by
+ * qcow2_co_preadv_compressed(), possibly from several threads.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedEntry {
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;          /* NULL if not loaded yet */
+    uint64_t generation;    /* generation of the reservation */
+    bool readahead;         /* loaded by readahead and not used yet */
+    bool referenced;        /* used since the clock hand last passed */
+    bool used;
+} Qcow2CompressedEntry;
+
+/* The entries whose compressed data overlaps a host cluster */
+typedef struct Qcow2CompressedHostCluster {
+    uint64_t offset;
+    GSList *entries;
+} Qcow2CompressedHostCluster;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+    GHashTable *table;      /* coffset -> Qcow2CompressedEntry */
+    GHashTable *host_clusters; /* offset -> Qcow2CompressedHostCluster */
+    Qcow2CompressedEntry *entries;
+    int size;
+    int clock_hand;
+    size_t cluster_size;
+    uint64_t generation;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters,
+                                                    size_t cluster_size)
+{
+    Qcow2CompressedCache *c;
+
+    assert(num_clusters > 0);
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    qemu_mutex_init(&c->lock);
+    c->table = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->host_clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+    c->entries = g_try_new0(Qcow2CompressedEntry, num_clusters);
+    if (!c->entries) {
+        qcow2_compressed_cache_destroy(c);
+        return NULL;
+    }
+    c->size = num_clusters;
+    c->cluster_size = cluster_size;
+
+    return c;
+}
+
+static inline uint64_t
+qcow2_compressed_cache_host_cluster(Qcow2CompressedCache *c, uint64_t offset)
+{
+    return offset & ~((uint64_t)c->cluster_size - 1);
+}
+
+/* Add @e to c->table and to the host clusters it overlaps */
+static void qcow2_compressed_cache_insert(Qcow2CompressedCache *c,
+                                          Qcow2CompressedEntry *e)
+{
+    uint64_t hc = qcow2_compressed_cache_host_cluster(c, e->coffset);
+    uint64_t end = e->coffset + MAX(e->csize, 1);
+
+    g_hash_table_insert(c->table, &e->coffset, e);
+
+    for (; hc < end; hc += c->cluster_size) {
+        Qcow2CompressedHostCluster *h;
+
+        h = g_hash_table_lookup(c->host_clusters, &hc);
+        if (!h) {
+            h = g_new0(Qcow2CompressedHostCluster, 1);
+            h->offset = hc;
+            g_hash_table_insert(c->host_clusters, &h->offset, h);
+        }
+        h->entries = g_slist_prepend(h->entries, e);
+    }
+}
+
+static void qcow2_compressed_cache_drop(Qcow2CompressedCache *c,
+                                        Qcow2CompressedEntry *e)
+{
+    uint64_t hc = qcow2_compressed_cache_host_cluster(c, e->coffset);
+    uint64_t end = e->coffset + MAX(e->csize, 1);
+
+    g_hash_table_remove(c->table, &e->coffset);
+
+    for (; hc < end; hc += c->cluster_size) {
+        Qcow2CompressedHostCluster *h;
+
+        h = g_hash_table_lookup(c->host_clusters, &hc);
+        h->entries = g_slist_remove(h->entries, e);
+        if (!h->entries) {
+            g_hash_table_remove(c->host_clusters, &hc);
+        }
+    }
+
+    qemu_vfree(e->data);
+    *e = (Qcow2CompressedEntry) {};
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; c->entries && i < c->size; i++) {
+        if (c->entries[i].used) {
+            qcow2_compressed_cache_drop(c, &c->entries[i]);
+        }
+    }
+    g_free(c->entries);
+    g_hash_table_destroy(c->host_clusters);
+    g_hash_table_destroy(c->table);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+/*
+ * Copy @bytes from the cached cluster whose compressed data is at @coffset,
+ * starting at @offset_in_cluster, to @qiov.  Returns false on a cache miss.
+ *
+ * *@readahead is set if the entry was loaded by readahead and this is its
+ * first use, which means that the caller should read further ahead.
+ */
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 QEMUIOVector *qiov, size_t qiov_offset,
+                                 size_t offset_in_cluster, size_t bytes,
+                                 bool *readahead)
+{
+    Qcow2CompressedEntry *e;
+
+    assert(offset_in_cluster + bytes <= c->cluster_size);
+
+    QEMU_LOCK_GUARD(&c->lock);
+    e = g_hash_table_lookup(c->table, &coffset);
+    if (!e || !e->data) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_cluster, bytes);
+    e->referenced = true;
+    *readahead = e->readahead;
+    e->readahead = false;
+
+    return true;
+}
+
+/* Must be called with c->lock held */
+static Qcow2CompressedEntry *
+qcow2_compressed_cache_evict(Qcow2CompressedCache *c)
+{
+    int i;
+
+    /*
+     * Two rounds are enough to find an entry unless they are all being
+     * loaded, in which case the cache is too small for the readahead and
+     * the new cluster is simply not cached.
+     */
+    for (i = 0; i < 2 * c->size; i++) {
+        Qcow2CompressedEntry *e = &c->entries[c->clock_hand];
+
+        c->clock_hand = (c->clock_hand + 1) % c->size;
+        if (!e->used) {
+            return e;
+        }
+        if (!e->data) {
+            continue;
+        }
+        if (e->referenced) {
+            e->referenced = false;
+            continue;
+        }
+
+        trace_qcow2_compressed_cache_evict(c, e->coffset);
+        qcow2_compressed_cache_drop(c, e);
+        return e;
+    }
+
+    return NULL;
+}
+
+/*
+ * Reserve an entry for the cluster whose compressed data is at @coffset,
+ * before reading it.  Returns false if the cluster is already cached or
+ * being loaded, or if no entry is available.
+ *
+ * On success, *@generation identifies the reservation, which must be
+ * passed to qcow2_compressed_cache_add() once the compressed data has been
+ * read and decompressed.  @readahead tells whether the cluster is read
+ * ahead of the guest.
+ */
+bool qcow2_compressed_cache_reserve(Qcow2CompressedCache *c, uint64_t coffset,
+                                    int csize, bool readahead,
+                                    uint64_t *generation)
+{
+    Qcow2CompressedEntry *e;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    if (g_hash_table_contains(c->table, &coffset)) {
+        return false;
+    }
+
+    e = qcow2_compressed_cache_evict(c);
+    if (!e) {
+        return false;
+    }
+
+    *e = (Qcow2CompressedEntry) {
+        .coffset    = coffset,
+        .csize      = csize,
+        .generation = c->generation,
+        .readahead  = readahead,
+        .referenced = !readahead,
+        .used       = true,
+    };
+    qcow2_compressed_cache_insert(c, e);
+    *generation = c->generation;
+
+    return true;
+}
+
+/*
+ * Fill the entry reserved for the cluster at @coffset with its decompressed
+ * @data.  The cache takes ownership of @data, which must have been
+ * allocated with qemu_blockalign() and be one cluster large.
+ *
+ * @generation is the value returned by qcow2_compressed_cache_reserve().
+ * If the reservation was dropped since then, @data may be stale and is
+ * dropped as well.  If @data is NULL, the reservation is released.
+ */
+void qcow2_compressed_cache_add(Qcow2CompressedCache *c, uint64_t coffset,
+                                int csize, uint8_t *data, uint64_t generation)
+{
+    Qcow2CompressedEntry *e;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    e = g_hash_table_lookup(c->table, &coffset);
+
+    if (!e || e->data || e->generation != generation) {
+        /* Not our reservation anymore */
+        qemu_vfree(data);
+        return;
+    }
+
+    if (!data || e->csize != csize) {
+        qcow2_compressed_cache_drop(c, e);
+        qemu_vfree(data);
+        return;
+    }
+
+    e->data = data;
+}
+
+/*
+ * Drop all entries whose compressed data overlaps the host range
+ * [@offset, @offset + @bytes).  Called when host clusters are freed and when
+ * they are allocated for compressed data.
+ */
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    uint64_t hc = qcow2_compressed_cache_host_cluster(c, offset);
+    bool dropped = false;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    for (; hc < offset + bytes; hc += c->cluster_size) {
+        Qcow2CompressedHostCluster *h;
+        GSList *l, *next;
+
+        h = g_hash_table_lookup(c->host_clusters, &hc);
+        if (!h) {
+            continue;
+        }
+
+        /* Dropping the last entry frees @h, so don't look at it after that */
+        for (l = h->entries; l; l = next) {
+            Qcow2CompressedEntry *e = l->data;
+
+            next = l->next;
+            if (e->coffset < offset + bytes &&
+                offset < e->coffset + e->csize)
+            {
+                qcow2_compressed_cache_drop(c, e);
+                dropped = true;
+            }
+        }
+    }
+
+    /* Loads whose reservation was just dropped must not fill a new one */
+    if (dropped) {
+        c->generation++;
+    }
+}
+
+/* Drop all entries */
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    c->generation++;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].used) {
+            qcow2_compressed_cache_drop(c, &c->entries[i]);
+        }
+    }
+}
@@ -901,6 +901,12 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            if (s->compressed_cache) {
+                qcow2_compressed_cache_invalidate(s->compressed_cache,
+                                                  cluster_offset,
+                                                  s->cluster_size);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1065,6 +1071,104 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
     return i;
 }
 
+/*
+ * With the cluster-pool-size option, guest data clusters are taken from a
+ * pool of contiguous clusters whose refcounts have been set in advance.
+ * Allocating writes then only update refcounts once per refill of the pool
+ * instead of once per request, and new data stays contiguous in the image
+ * file even when many requests allocate concurrently.
+ *
+ * Until they are used, the clusters of the pool look leaked on disk.  The
+ * pool is released on inactivation and before operations that rely on
+ * exact refcounts.
+ */
+
+/*
+ * Allocates @size bytes of guest data clusters, from the pool if possible.
+ * Returns the host offset of the clusters, or -errno.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset;
+
+    if (size > s->cluster_pool_size) {
+        return qcow2_alloc_clusters(bs, size);
+    }
+
+    if (s->cluster_pool_bytes < size) {
+        int64_t ret;
+
+        /* Try to grow the pool in place so that data stays contiguous */
+        if (s->cluster_pool_bytes) {
+            ret = qcow2_alloc_clusters_at(bs, s->cluster_pool_offset +
+                                          s->cluster_pool_bytes,
+                                          size_to_clusters(s,
+                                              s->cluster_pool_size));
+            if (ret < 0) {
+                return ret;
+            }
+            s->cluster_pool_bytes += ret << s->cluster_bits;
+        }
+
+        if (s->cluster_pool_bytes < size) {
+            qcow2_release_cluster_pool(bs);
+            ret = qcow2_alloc_clusters(bs, s->cluster_pool_size);
+            if (ret < 0) {
+                return ret;
+            }
+            s->cluster_pool_offset = ret;
+            s->cluster_pool_bytes = s->cluster_pool_size;
+        }
+        trace_qcow2_cluster_pool_refill(bs, s->cluster_pool_offset,
+                                        s->cluster_pool_bytes);
+    }
+
+    offset = s->cluster_pool_offset;
+    s->cluster_pool_offset += size;
+    s->cluster_pool_bytes -= size;
+    return offset;
+}
+
+/*
+ * Like qcow2_alloc_clusters_at(), but takes the clusters from the pool if
+ * @offset is where the pool starts.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                             int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes;
+
+    if (!s->cluster_pool_bytes || offset != s->cluster_pool_offset) {
+        return qcow2_alloc_clusters_at(bs, offset, nb_clusters);
+    }
+
+    bytes = MIN(nb_clusters << s->cluster_bits, s->cluster_pool_bytes);
+    s->cluster_pool_offset += bytes;
+    s->cluster_pool_bytes -= bytes;
+    return bytes >> s->cluster_bits;
+}
+
+/* Frees the clusters left in the pool */
+void GRAPH_RDLOCK qcow2_release_cluster_pool(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->cluster_pool_bytes) {
+        return;
+    }
+
+    trace_qcow2_cluster_pool_release(bs, s->cluster_pool_offset,
+                                     s->cluster_pool_bytes);
+    qcow2_free_clusters(bs, s->cluster_pool_offset, s->cluster_pool_bytes,
+                        QCOW2_DISCARD_NEVER);
+    s->cluster_pool_offset = 0;
+    s->cluster_pool_bytes = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -701,6 +701,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CLUSTER_POOL_SIZE,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+    QCOW2_OPT_COMPRESSED_READAHEAD,
     NULL
 };
 
@@ -817,6 +820,22 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Allocate guest data clusters in batches of this size",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of compressed clusters to decompress ahead of "
+                    "sequential reads",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -979,6 +998,10 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t cluster_pool_size;
+    Qcow2CompressedCache *compressed_cache;
+    uint64_t compressed_cache_size;
+    int compressed_readahead;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,6 +1014,7 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size, compressed_readahead;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1079,6 +1103,52 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->cluster_pool_size = qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE,
+                                             0);
+    if (r->cluster_pool_size > QCOW2_MAX_CLUSTER_POOL_SIZE) {
+        error_setg(errp, QCOW2_OPT_CLUSTER_POOL_SIZE " must not exceed %"
+                   PRId64, (int64_t) QCOW2_MAX_CLUSTER_POOL_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->cluster_pool_size = ROUND_UP(r->cluster_pool_size, s->cluster_size);
+
+    compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE, 0);
+    if (compressed_cache_size / s->cluster_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compressed_cache_size = compressed_cache_size;
+    /* Keep the cache and its contents if the size does not change */
+    if (compressed_cache_size &&
+        compressed_cache_size != s->compressed_cache_size) {
+        r->compressed_cache =
+            qcow2_compressed_cache_create(DIV_ROUND_UP(compressed_cache_size,
+                                                       s->cluster_size),
+                                          s->cluster_size);
+        if (!r->compressed_cache) {
+            error_setg(errp, "Could not allocate compressed cluster cache");
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    compressed_readahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSED_READAHEAD,
+                            DEFAULT_COMPRESSED_READAHEAD);
+    if (compressed_readahead > QCOW2_MAX_COMPRESSED_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_READAHEAD " must not exceed %d",
+                   QCOW2_MAX_COMPRESSED_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    /* Leave room for the clusters that are being read */
+    r->compressed_readahead =
+        MIN(compressed_readahead,
+            DIV_ROUND_UP(compressed_cache_size, s->cluster_size) / 2);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1214,8 +1284,8 @@ fail:
     return ret;
 }
 
-static void qcow2_update_options_commit(BlockDriverState *bs,
-                                        Qcow2ReopenState *r)
+static void GRAPH_RDLOCK
+qcow2_update_options_commit(BlockDriverState *bs, Qcow2ReopenState *r)
 {
     BDRVQcow2State *s = bs->opaque;
     int i;
@@ -1239,6 +1309,19 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->discard_no_unref = r->discard_no_unref;
 
+    if (s->cluster_pool_size != r->cluster_pool_size) {
+        /* The clusters of the old pool go back through the new caches */
+        qcow2_release_cluster_pool(bs);
+        s->cluster_pool_size = r->cluster_pool_size;
+    }
+
+    if (s->compressed_cache_size != r->compressed_cache_size) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = r->compressed_cache;
+        s->compressed_cache_size = r->compressed_cache_size;
+    }
+    s->compressed_readahead = r->compressed_readahead;
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1258,6 +1341,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_compressed_cache_destroy(r->compressed_cache);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1278,12 +1362,59 @@ qcow2_update_options(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 }
 
+static uint8_t compression_type_to_header(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return QCOW2_COMPRESSION_HEADER_DEFLATE;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return QCOW2_COMPRESSION_HEADER_ZSTD;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return QCOW2_COMPRESSION_HEADER_LZ4;
+#endif
+    default:
+        abort();
+    }
+}
+
+static int compression_type_from_header(uint8_t value,
+                                        Qcow2CompressionType *type,
+                                        Error **errp)
+{
+    switch (value) {
+    case QCOW2_COMPRESSION_HEADER_DEFLATE:
+        *type = QCOW2_COMPRESSION_TYPE_ZLIB;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_HEADER_ZSTD:
+        *type = QCOW2_COMPRESSION_TYPE_ZSTD;
+        break;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_HEADER_LZ4:
+        *type = QCOW2_COMPRESSION_TYPE_LZ4;
+        break;
+#endif
+    default:
+        error_setg(errp, "qcow2: unknown compression type: %u", value);
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
 static int validate_compression_type(BDRVQcow2State *s, Error **errp)
 {
     switch (s->compression_type) {
     case QCOW2_COMPRESSION_TYPE_ZLIB:
 #ifdef CONFIG_ZSTD
     case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
 #endif
         break;
 
@@ -1438,7 +1569,11 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
      * the only valid (default) compression type in that case
      */
     if (header.header_length > offsetof(QCowHeader, compression_type)) {
-        s->compression_type = header.compression_type;
+        ret = compression_type_from_header(header.compression_type,
+                                           &s->compression_type, errp);
+        if (ret) {
+            goto fail;
+        }
     } else {
         s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     }
@@ -1992,6 +2127,12 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        /*
+         * The refcounts must be final before the image is marked clean.
+         * The pool just refills on its next use if the reopen is aborted.
+         */
+        qcow2_release_cluster_pool(state->bs);
+
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
         if (ret < 0) {
             goto fail;
@@ -2389,12 +2530,15 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (!qcow2_get_host_offset_cached(bs, offset, cur_bytes,
+                                          &host_offset, &type)) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2756,6 +2900,13 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_cluster_pool(bs);
+
+    /* Another process may rewrite the image while we are inactive */
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_clear(s->compressed_cache);
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2792,6 +2943,9 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    s->compressed_cache_size = 0;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2957,7 +3111,8 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
-        .compression_type       = s->compression_type,
+        .compression_type       =
+            compression_type_to_header(s->compression_type),
     };
 
     /* For older versions, write a shorter header */
@@ -3508,7 +3663,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     int refcount_order;
     uint64_t *refcount_table;
     int ret;
-    uint8_t compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    Qcow2CompressionType compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
 
     assert(create_options->driver == BLOCKDEV_DRIVER_QCOW2);
     qcow2_opts = &create_options->u.qcow2;
@@ -3678,6 +3833,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
 #ifdef CONFIG_ZSTD
         case QCOW2_COMPRESSION_TYPE_ZSTD:
             break;
+#endif
+#ifdef CONFIG_LZ4
+        case QCOW2_COMPRESSION_TYPE_LZ4:
+            break;
 #endif
         default:
             error_setg(errp, "Unknown compression type");
@@ -3710,7 +3869,8 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         /* don't deal with endianness since compression_type is 1 byte long */
-        .compression_type           = compression_type,
+        .compression_type           =
+            compression_type_to_header(compression_type),
         .header_length              = cpu_to_be32(sizeof(*header)),
     };
 
@@ -4307,6 +4467,9 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /* The pool may be beyond the new end, and it would make the image grow */
+    qcow2_release_cluster_pool(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4657,41 +4820,76 @@ fail:
     return ret;
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
-                                 uint64_t offset, uint64_t bytes,
-                                 QEMUIOVector *qiov, size_t qiov_offset)
+static bool qcow2_is_compressed_cluster_request(BlockDriverState *bs,
+                                                int64_t offset, int64_t bytes)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
+
+    return !offset_into_cluster(s, offset) &&
+        (bytes == s->cluster_size || (bytes > 0 && bytes < s->cluster_size &&
+         offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS));
+}
+
+/*
+ * Compress one cluster of guest data without allocating anything, so that
+ * it can run in parallel with other compressions and with the writes.
+ * Returns the compressed length, or -ENOSPC if the cluster does not compress
+ * into min(@out_size, cluster_size - 1) bytes.
+ */
+static ssize_t coroutine_fn GRAPH_RDLOCK
+qcow2_co_compress_cluster(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          const void *buf, void *out_buf, size_t out_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *pad_buf = NULL;
     ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
 
-    assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
-           (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
+    if (has_data_file(bs)) {
+        return -ENOTSUP;
+    }
+    if (!qcow2_is_compressed_cluster_request(bs, offset, bytes)) {
+        return -EINVAL;
+    }
 
-    buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+        pad_buf = qemu_blockalign(bs, s->cluster_size);
+        memcpy(pad_buf, buf, bytes);
+        memset(pad_buf + bytes, 0, s->cluster_size - bytes);
+        buf = pad_buf;
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
-
-    out_buf = g_malloc(s->cluster_size);
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+    trace_qcow2_compress_start(qemu_coroutine_self(), offset);
+    out_len = qcow2_co_compress(bs, out_buf, MIN(out_size, s->cluster_size - 1),
                                 buf, s->cluster_size);
+    trace_qcow2_compress_done(qemu_coroutine_self(), offset, out_len);
+
+    qemu_vfree(pad_buf);
+
     if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
-        if (ret < 0) {
-            goto fail;
-        }
-        goto success;
+        return -ENOSPC;
     } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
+    }
+    return out_len;
+}
+
+/* Allocate a compressed cluster for @offset and write @out_buf into it */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_pwrite_compressed_data(BlockDriverState *bs,
+                                int64_t offset, int64_t bytes,
+                                const void *out_buf, size_t out_len)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (has_data_file(bs)) {
+        return -ENOTSUP;
+    }
+    if (!qcow2_is_compressed_cluster_request(bs, offset, bytes) ||
+        out_len == 0 || out_len >= s->cluster_size) {
+        return -EINVAL;
     }
 
     qemu_co_mutex_lock(&s->lock);
@@ -4699,23 +4897,53 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                                 &cluster_offset);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
-        goto fail;
+        return ret;
     }
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
 
     BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
-success:
-    ret = 0;
-fail:
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
+                                 uint64_t offset, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+    ssize_t out_len;
+    uint8_t *buf, *out_buf;
+
+    assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
+           (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
+
+    buf = qemu_blockalign(bs, bytes);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
+
+    out_buf = g_malloc(s->cluster_size);
+
+    out_len = qcow2_co_compress_cluster(bs, offset, bytes, buf, out_buf,
+                                        s->cluster_size);
+    if (out_len == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+    } else if (out_len < 0) {
+        ret = out_len;
+    } else {
+        ret = qcow2_co_pwrite_compressed_data(bs, offset, bytes,
+                                              out_buf, out_len);
+    }
+
     qemu_vfree(buf);
     g_free(out_buf);
     return ret;
@@ -4804,29 +5032,20 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/* Read the compressed cluster at @coffset and decompress it into @out_buf */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_load_compressed(BlockDriverState *bs, uint64_t coffset, int csize,
+                         uint8_t *out_buf)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
-
-    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    uint8_t *buf;
+    int ret;
 
     buf = g_try_malloc(csize);
     if (!buf) {
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
@@ -4838,15 +5057,170 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
 
     return ret;
 }
 
+typedef struct Qcow2CompressedReadahead {
+    BlockDriverState *bs;
+    uint64_t coffset;
+    int csize;
+    uint64_t generation;
+} Qcow2CompressedReadahead;
+
+static void coroutine_fn qcow2_compressed_readahead_entry(void *opaque)
+{
+    Qcow2CompressedReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *data;
+
+    GRAPH_RDLOCK_GUARD();
+
+    data = qemu_blockalign(bs, s->cluster_size);
+    if (qcow2_co_load_compressed(bs, ra->coffset, ra->csize, data) < 0) {
+        /* Not an error, the guest will get it when it reads the cluster */
+        qemu_vfree(data);
+        data = NULL;
+    }
+    qcow2_compressed_cache_add(s->compressed_cache, ra->coffset, ra->csize,
+                               data, ra->generation);
+
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Start decompressing the compressed clusters among the @nb_clusters guest
+ * clusters that start at @offset in the background.  Each cluster gets its
+ * own coroutine, so that they are decompressed in parallel on the thread
+ * pool, and the result goes to the compressed cluster cache.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+qcow2_compressed_readahead(BlockDriverState *bs, uint64_t offset,
+                           int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int i;
+
+    for (i = 0; i < nb_clusters && offset < end; i++) {
+        Qcow2CompressedReadahead *ra;
+        QCow2SubclusterType type;
+        unsigned int bytes = s->cluster_size;
+        uint64_t l2_entry, coffset, generation;
+        bool reserved = false;
+        int csize, ret;
+        Coroutine *co;
+
+        /*
+         * Reserve the entry under s->lock, so that the host cluster cannot
+         * be freed between the lookup and the reservation
+         */
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        if (ret == 0 && type == QCOW2_SUBCLUSTER_COMPRESSED) {
+            qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+            reserved = qcow2_compressed_cache_reserve(s->compressed_cache,
+                                                      coffset, csize, true,
+                                                      &generation);
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            return;
+        }
+        offset += s->cluster_size;
+        if (!reserved) {
+            continue;
+        }
+        trace_qcow2_compressed_readahead(bs, offset - s->cluster_size,
+                                         coffset);
+
+        ra = g_new(Qcow2CompressedReadahead, 1);
+        *ra = (Qcow2CompressedReadahead) {
+            .bs         = bs,
+            .coffset    = coffset,
+            .csize      = csize,
+            .generation = generation,
+        };
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(qcow2_compressed_readahead_entry, ra);
+        aio_co_enter(qemu_get_current_aio_context(), co);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0, csize;
+    uint64_t coffset, generation = 0;
+    uint8_t *out_buf;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint64_t next_cluster = start_of_cluster(s, offset) + s->cluster_size;
+    bool readahead, reserved = false;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    if (s->compressed_cache) {
+        if (qcow2_compressed_cache_read(s->compressed_cache, coffset,
+                                        qiov, qiov_offset, offset_in_cluster,
+                                        bytes, &readahead)) {
+            /*
+             * First use of a cluster that was read ahead: slide the window
+             * by one cluster, everything before is already in the cache.
+             */
+            if (readahead && s->compressed_readahead) {
+                qcow2_compressed_readahead(bs, next_cluster +
+                    (uint64_t)(s->compressed_readahead - 1) * s->cluster_size,
+                    1);
+            }
+            return 0;
+        }
+        reserved = qcow2_compressed_cache_reserve(s->compressed_cache,
+                                                  coffset, csize, false,
+                                                  &generation);
+    }
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    ret = qcow2_co_load_compressed(bs, coffset, csize, out_buf);
+    if (ret < 0) {
+        qemu_vfree(out_buf);
+        if (reserved) {
+            qcow2_compressed_cache_add(s->compressed_cache, coffset, csize,
+                                       NULL, generation);
+        }
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+
+    if (s->compressed_cache) {
+        if (reserved) {
+            qcow2_compressed_cache_add(s->compressed_cache, coffset, csize,
+                                       out_buf, generation);
+        } else {
+            qemu_vfree(out_buf);
+        }
+        if (s->compressed_readahead) {
+            qcow2_compressed_readahead(bs, next_cluster,
+                                       s->compressed_readahead);
+        }
+    } else {
+        qemu_vfree(out_buf);
+    }
+
+    return 0;
+}
+
 static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -5007,6 +5381,13 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_cluster_pool(bs);
+
+    /* make_completely_empty() drops all refcounts without update_refcount() */
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_clear(s->compressed_cache);
+    }
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5510,8 +5891,9 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
             return -EINVAL;
         }
         if (ret) {
-            error_setg(errp, "Cannot downgrade an image with zstd compression "
-                       "type and existing compressed clusters");
+            error_setg(errp, "Cannot downgrade an image with %s compression "
+                       "type and existing compressed clusters",
+                       Qcow2CompressionType_str(s->compression_type));
             return -ENOTSUP;
         }
         /*
@@ -6152,6 +6534,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_copy_range_to              = qcow2_co_copy_range_to,
     .bdrv_co_truncate                   = qcow2_co_truncate,
     .bdrv_co_pwritev_compressed_part    = qcow2_co_pwritev_compressed_part,
+    .bdrv_co_compress                   = qcow2_co_compress_cluster,
+    .bdrv_co_pwrite_compressed_data     = qcow2_co_pwrite_compressed_data,
     .bdrv_make_empty                    = qcow2_make_empty,
 
     .bdrv_snapshot_create               = qcow2_snapshot_create,
@@ -128,6 +128,11 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define QCOW2_MAX_CLUSTER_POOL_SIZE (1 * GiB)
+
+#define DEFAULT_COMPRESSED_READAHEAD 8 /* clusters */
+#define QCOW2_MAX_COMPRESSED_READAHEAD 64
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +155,9 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_POOL_SIZE "cluster-pool-size"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_COMPRESSED_READAHEAD "compressed-readahead"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +238,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -249,6 +258,16 @@ enum {
     QCOW2_FEAT_TYPE_AUTOCLEAR       = 2,
 };
 
+/*
+ * Values of the compression_type header field.  They are not the same as
+ * Qcow2CompressionType, whose values depend on the configured libraries.
+ */
+enum {
+    QCOW2_COMPRESSION_HEADER_DEFLATE = 0,
+    QCOW2_COMPRESSION_HEADER_ZSTD    = 1,
+    QCOW2_COMPRESSION_HEADER_LZ4     = 2,
+};
+
 /* Incompatible feature bits */
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR      = 0,
@@ -348,6 +367,11 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Decompressed clusters, NULL if disabled */
+    Qcow2CompressedCache *compressed_cache;
+    uint64_t compressed_cache_size; /* in bytes, as set by the user */
+    int compressed_readahead; /* in clusters */
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -357,6 +381,11 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Guest data clusters allocated in advance, see qcow2-refcount.c */
+    uint64_t cluster_pool_size; /* refill size in bytes, 0 if disabled */
+    uint64_t cluster_pool_offset;
+    uint64_t cluster_pool_bytes; /* bytes left in the pool */
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -873,6 +902,15 @@ int64_t GRAPH_RDLOCK coroutine_fn
 qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t size);
+
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                             int64_t nb_clusters);
+
+void GRAPH_RDLOCK qcow2_release_cluster_pool(BlockDriverState *bs);
+
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
@@ -931,6 +969,20 @@ int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
+#ifdef CONFIG_ATOMIC64
+bool GRAPH_RDLOCK
+qcow2_get_host_offset_cached(BlockDriverState *bs, uint64_t offset,
+                             unsigned int bytes, uint64_t *host_offset,
+                             QCow2SubclusterType *subcluster_type);
+#else
+static inline bool
+qcow2_get_host_offset_cached(BlockDriverState *bs, uint64_t offset,
+                             unsigned int bytes, uint64_t *host_offset,
+                             QCow2SubclusterType *subcluster_type)
+{
+    return false;
+}
+#endif
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
@@ -1020,8 +1072,29 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
+#ifdef CONFIG_ATOMIC64
+bool qcow2_cache_peek(Qcow2Cache *c, uint64_t offset, int index,
+                      uint64_t *value);
+#endif
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(int num_clusters,
+                                                    size_t cluster_size);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 QEMUIOVector *qiov, size_t qiov_offset,
+                                 size_t offset_in_cluster, size_t bytes,
+                                 bool *readahead);
+bool qcow2_compressed_cache_reserve(Qcow2CompressedCache *c, uint64_t coffset,
+                                    int csize, bool readahead,
+                                    uint64_t *generation);
+void qcow2_compressed_cache_add(Qcow2CompressedCache *c, uint64_t coffset,
+                                int csize, uint8_t *data, uint64_t generation);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes);
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
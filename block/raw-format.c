@@ -604,6 +604,19 @@ raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+raw_co_sendfile(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                QIOChannel *ioc, const struct iovec *hdr, int hdr_niov)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, &offset, bytes, false);
+    if (ret) {
+        return -ENOTSUP;
+    }
+    return bdrv_co_sendfile(bs->file, offset, bytes, ioc, hdr, hdr_niov);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -656,6 +669,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_co_sendfile       = &raw_co_sendfile,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_co_getlength    = &raw_co_getlength,
     .is_format            = true,
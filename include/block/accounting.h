@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-types-common.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -94,6 +95,24 @@ struct BlockAcctStats {
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 };
 
+/*
+ * How the requests of a node were handed to the kernel by Linux AIO or
+ * io_uring.  A submission is one io_submit()/io_uring_enter() call that
+ * contained requests of the node, possibly along with requests of other
+ * nodes served by the same AioContext.
+ */
+#define BLOCK_ACCT_SUBMIT_BATCH_BINS 8
+
+typedef struct BlockAcctSubmitStats {
+    Stat64 submissions;
+    Stat64 requests;
+    /*
+     * Submissions by their total number of requests, in the intervals
+     * [1, 2), [2, 4), ... [64, 128), [128, +inf)
+     */
+    Stat64 batch_bins[BLOCK_ACCT_SUBMIT_BATCH_BINS];
+} BlockAcctSubmitStats;
+
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
@@ -115,6 +134,8 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
+void block_acct_submit_batch(BlockAcctSubmitStats **stats, unsigned int n);
+uint64_t block_acct_submit_batch_boundary(int bin);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
@@ -56,6 +56,7 @@ typedef void IOHandler(void *opaque);
 struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
+typedef struct LuringParams LuringParams;
 
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
@@ -213,6 +214,8 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     LuringState *linux_io_uring;
+    /* LuringStates set up with non-default LuringParams */
+    GSList *linux_io_uring_extra;
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -513,6 +516,18 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/*
+ * Setup a LuringState with @params bound to this AioContext, or return the
+ * one that already exists.  A NULL @params stands for the default setup.
+ */
+LuringState *aio_setup_linux_io_uring_params(AioContext *ctx,
+                                             const LuringParams *params,
+                                             Error **errp);
+
+/* Return the LuringState with @params bound to this AioContext */
+LuringState *aio_get_linux_io_uring_params(AioContext *ctx,
+                                           const LuringParams *params);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
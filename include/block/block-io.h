@@ -328,6 +328,60 @@ bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                    int64_t bytes, BdrvRequestFlags read_flags,
                    BdrvRequestFlags write_flags);
 
+/**
+ * bdrv_co_sendfile:
+ *
+ * Send the iovec @hdr to the socket channel @ioc, followed by @bytes of data
+ * read from @child at @offset.  The data goes from the host page cache to the
+ * socket without being copied through a buffer in QEMU, which is only
+ * possible for a chain of drivers that do not transform the data (e.g. raw
+ * over file).
+ *
+ * @ioc must be non-blocking; the request yields while the socket is full.
+ * The caller must not write to it until the request has completed.
+ *
+ * Returns: 0 if succeeded; -ENOTSUP, before anything was written to @ioc, if
+ * the data cannot be sent this way or if the request is invalid, in which
+ * case the caller should read it into a buffer instead; any other negative
+ * error code may leave @ioc with a partial reply, and the caller must drop
+ * the connection.
+ **/
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_sendfile(BdrvChild *child, int64_t offset, int64_t bytes,
+                 QIOChannel *ioc, const struct iovec *hdr, int hdr_niov);
+
+/**
+ * bdrv_co_compress:
+ *
+ * Compress @bytes bytes of @buf, the data of a compressed write at @offset,
+ * into @out_buf without touching the image.  The result can then be stored
+ * with bdrv_co_pwrite_compressed_data(), which is the only half of the write
+ * that allocates space, so that callers can compress clusters in parallel
+ * and still lay them out in order.
+ *
+ * Returns: the compressed length; -ENOSPC if the data does not compress into
+ * @out_size bytes, in which case the caller should write it uncompressed;
+ * -ENOTSUP if the driver cannot split compressed writes, in which case the
+ * caller should use a write with BDRV_REQ_WRITE_COMPRESSED; or another
+ * negative error code.
+ **/
+ssize_t coroutine_fn GRAPH_RDLOCK
+bdrv_co_compress(BdrvChild *child, int64_t offset, int64_t bytes,
+                 const void *buf, void *out_buf, size_t out_size);
+
+/**
+ * bdrv_co_pwrite_compressed_data:
+ *
+ * Store @out_len bytes of @out_buf, as returned by bdrv_co_compress() for
+ * the same @offset and @bytes, as the compressed data of that range.
+ *
+ * Returns: 0 if succeeded; negative error code if failed.
+ **/
+int coroutine_fn GRAPH_RDLOCK
+bdrv_co_pwrite_compressed_data(BdrvChild *child, int64_t offset,
+                               int64_t bytes, const void *out_buf,
+                               size_t out_len);
+
 /*
  * "I/O or GS" API functions. These functions can run without
  * the BQL, but only in one specific iothread/main loop.
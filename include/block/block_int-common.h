@@ -605,6 +605,18 @@ struct BlockDriver {
         BdrvChild *dst, int64_t dst_offset, int64_t bytes,
         BdrvRequestFlags read_flags, BdrvRequestFlags write_flags);
 
+    /*
+     * Send @hdr and then [offset, offset + bytes) to the socket @ioc, either
+     * by mapping the range onto a child and invoking bdrv_co_sendfile(), or
+     * directly if @bs is the leaf.
+     *
+     * See the comment of bdrv_co_sendfile for the parameter and return value
+     * semantics.
+     */
+    int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_sendfile)(
+        BlockDriverState *bs, int64_t offset, int64_t bytes, QIOChannel *ioc,
+        const struct iovec *hdr, int hdr_niov);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -728,6 +740,22 @@ struct BlockDriver {
         BlockDriverState *bs, int64_t offset, int64_t bytes,
         QEMUIOVector *qiov, size_t qiov_offset);
 
+    /*
+     * The two halves of a compressed write, for callers that want to
+     * compress several clusters in parallel but store them in order.
+     *
+     * See the comments of bdrv_co_compress and
+     * bdrv_co_pwrite_compressed_data for the parameter and return value
+     * semantics.
+     */
+    ssize_t coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_compress)(
+        BlockDriverState *bs, int64_t offset, int64_t bytes,
+        const void *buf, void *out_buf, size_t out_size);
+
+    int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_pwrite_compressed_data)(
+        BlockDriverState *bs, int64_t offset, int64_t bytes,
+        const void *out_buf, size_t out_len);
+
     int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_get_info)(
         BlockDriverState *bs, BlockDriverInfo *bdi);
 
@@ -29,6 +29,12 @@ typedef struct BlockExportDriver {
      */
     size_t instance_size;
 
+    /*
+     * True if the driver can spread its work over the AioContexts given with
+     * the iothreads option, see BlockExport.iothread_ctxs.
+     */
+    bool supports_multithread;
+
     /* Creates and starts a new block export */
     int (*create)(BlockExport *, BlockExportOptions *, Error **);
 
@@ -73,6 +79,14 @@ struct BlockExport {
     /* The AioContext whose lock protects this BlockExport object. */
     AioContext *ctx;
 
+    /*
+     * The AioContexts of the iothreads option, in which the driver may
+     * submit requests to blk.  ctx is the first of them.  NULL if the
+     * option was not given.
+     */
+    AioContext **iothread_ctxs;
+    size_t num_iothread_ctxs;
+
     /* The block device to export */
     BlockBackend *blk;
 
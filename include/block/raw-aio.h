@@ -16,6 +16,7 @@
 #ifndef QEMU_RAW_AIO_H
 #define QEMU_RAW_AIO_H
 
+#include "block/accounting.h"
 #include "block/aio.h"
 #include "qemu/iov.h"
 
@@ -31,6 +32,7 @@
 #define QEMU_AIO_ZONE_REPORT  0x0100
 #define QEMU_AIO_ZONE_MGMT    0x0200
 #define QEMU_AIO_ZONE_APPEND  0x0400
+#define QEMU_AIO_SENDFILE     0x0800
 #define QEMU_AIO_TYPE_MASK \
         (QEMU_AIO_READ | \
          QEMU_AIO_WRITE | \
@@ -42,7 +44,8 @@
          QEMU_AIO_TRUNCATE | \
          QEMU_AIO_ZONE_REPORT | \
          QEMU_AIO_ZONE_MGMT | \
-         QEMU_AIO_ZONE_APPEND)
+         QEMU_AIO_ZONE_APPEND | \
+         QEMU_AIO_SENDFILE)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
@@ -56,23 +59,52 @@ typedef struct LinuxAioState LinuxAioState;
 LinuxAioState *laio_init(Error **errp);
 void laio_cleanup(LinuxAioState *s);
 
-/* laio_co_submit: submit I/O requests in the thread's current AioContext. */
+/*
+ * laio_co_submit: submit I/O requests in the thread's current AioContext.
+ * Batches that include the request are accounted in @submit_stats if it is
+ * not NULL.
+ */
 int coroutine_fn laio_co_submit(int fd, uint64_t offset, QEMUIOVector *qiov,
-                                int type, uint64_t dev_max_batch);
+                                int type, uint64_t dev_max_batch,
+                                BlockAcctSubmitStats *submit_stats);
 
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context);
 void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+struct LuringParams {
+    /* Submit requests from a kernel thread (IORING_SETUP_SQPOLL) */
+    bool sqpoll;
+    /* Idle time before the SQPOLL thread sleeps in ms, 0 for the default */
+    uint32_t sq_thread_idle;
+    /* CPU to pin the SQPOLL thread to, or -1 */
+    int sq_thread_cpu;
+    /* Poll the device for completions (IORING_SETUP_IOPOLL) */
+    bool iopoll;
+};
+
+LuringState *luring_init(const LuringParams *params, Error **errp);
 void luring_cleanup(LuringState *s);
+bool luring_params_equal(const LuringParams *a, const LuringParams *b);
+const LuringParams *luring_get_params(LuringState *s);
 
-/* luring_co_submit: submit I/O requests in the thread's current AioContext. */
+/*
+ * luring_co_submit: submit I/O requests in the thread's current AioContext,
+ * on the ring set up with @params.  Batches that include the request are
+ * accounted in @submit_stats if it is not NULL.
+ */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type);
+                                  QEMUIOVector *qiov, int type,
+                                  const LuringParams *params, bool fixed,
+                                  BlockAcctSubmitStats *submit_stats);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
+#ifdef CONFIG_LINUX_IO_URING_FIXED
+void luring_unregister_fd(int fd);
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
+#endif
 #endif
 
 #ifdef _WIN32
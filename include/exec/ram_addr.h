@@ -45,7 +45,8 @@ static inline long clear_bmap_size(uint64_t pages, uint8_t shift)
 
 /**
  * clear_bmap_set: set clear bitmap for the page range.  Must be with
- * bitmap_mutex held.
+ * bitmap_mutex held.  The bits are set atomically, since the dirty
+ * bitmap of a RAMBlock may be synchronized by several threads at once.
  *
  * @rb: the ramblock to operate on
  * @start: the start page number
@@ -58,7 +59,8 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
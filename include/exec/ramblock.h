@@ -58,6 +58,16 @@ struct RAMBlock {
     off_t bitmap_offset;
     uint64_t pages_offset;
 
+    /*
+     * Below fields are only used by the hot page predictor on the source
+     * side of precopy.  Memory is split in regions covered by one
+     * unsigned long of bmap each.
+     */
+    /* bitmap of the pages sent since the last dirty sync */
+    unsigned long *hot_sent_bmap;
+    /* number of consecutive syncs that found each sent region dirty */
+    uint8_t *hot_score;
+
     /* Bitmap of already received pages.  Only used on destination side. */
     unsigned long *receivedmap;
 
@@ -195,6 +195,23 @@ bool buffer_is_zero_ool(const void *vbuf, size_t len);
 bool buffer_is_zero_ge256(const void *vbuf, size_t len);
 bool test_buffer_is_zero_next_accel(void);
 
+/**
+ * buffer_is_zero_batch:
+ * @bufs: array of @n buffers
+ * @n: number of buffers
+ * @len: length in bytes of every buffer
+ * @zero: bitmap of at least @n bits
+ *
+ * Test @n buffers of the same length at once, setting bit i of @zero
+ * if and only if @bufs[i] is all zero.  The accelerated function is
+ * looked up once for the whole batch, and the next buffer is prefetched
+ * while the current one is tested.
+ *
+ * Returns the number of zero buffers.
+ */
+size_t buffer_is_zero_batch(const void * const *bufs, size_t n, size_t len,
+                            unsigned long *zero);
+
 static inline bool buffer_is_zero_sample3(const char *buf, size_t len)
 {
     /*
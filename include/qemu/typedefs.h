@@ -99,6 +99,7 @@ typedef struct QEMUSGList QEMUSGList;
 typedef struct QemuSpin QemuSpin;
 typedef struct QEMUTimer QEMUTimer;
 typedef struct QEMUTimerListGroup QEMUTimerListGroup;
+typedef struct QIOChannel QIOChannel;
 typedef struct QList QList;
 typedef struct QNull QNull;
 typedef struct QNum QNum;
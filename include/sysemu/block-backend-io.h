@@ -117,6 +117,10 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    int64_t bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
 
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int64_t bytes, QIOChannel *ioc,
+                                 const struct iovec *hdr, int hdr_niov);
+
 int coroutine_fn blk_co_block_status_above(BlockBackend *blk,
                                            BlockDriverState *base,
                                            int64_t offset, int64_t bytes,
@@ -184,6 +188,14 @@ int co_wrapper_mixed blk_pwrite_compressed(BlockBackend *blk,
 int coroutine_fn blk_co_pwrite_compressed(BlockBackend *blk, int64_t offset,
                                           int64_t bytes, const void *buf);
 
+ssize_t coroutine_fn blk_co_compress(BlockBackend *blk, int64_t offset,
+                                     int64_t bytes, const void *buf,
+                                     void *out_buf, size_t out_size);
+int coroutine_fn blk_co_pwrite_compressed_data(BlockBackend *blk,
+                                               int64_t offset, int64_t bytes,
+                                               const void *out_buf,
+                                               size_t out_len);
+
 int co_wrapper_mixed blk_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                                        int64_t bytes,
                                        BdrvRequestFlags flags);
@@ -7,6 +7,8 @@
 
 #include "qemu/osdep.h"
 #include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qemu/bitops.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
@@ -220,18 +222,45 @@ int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
     return (ret < 0) ? ret : 0;
 }
 
+/*
+ * Read every run of contiguous pages set in the bitmap of the job with a
+ * single pread, straight into guest memory.
+ */
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDRecvData *data = p->data;
-    size_t ret;
-
-    ret = qio_channel_pread(p->c, (char *) data->opaque,
-                            data->size, data->file_offset, errp);
-    if (ret != data->size) {
-        error_prepend(errp,
-                      "multifd recv (%u): read 0x%zx, expected 0x%zx",
-                      p->id, ret, data->size);
-        return -1;
+    int page_bits = qemu_target_page_bits();
+    unsigned long set_bit_idx, clear_bit_idx;
+
+    for (set_bit_idx = find_first_bit(data->bitmap, data->num_pages);
+         set_bit_idx < data->num_pages;
+         set_bit_idx = find_next_bit(data->bitmap, data->num_pages,
+                                     clear_bit_idx + 1)) {
+        size_t offset, len;
+
+        clear_bit_idx = find_next_zero_bit(data->bitmap, data->num_pages,
+                                           set_bit_idx + 1);
+        offset = set_bit_idx << page_bits;
+        len = (clear_bit_idx - set_bit_idx) << page_bits;
+
+        while (len) {
+            ssize_t ret;
+
+            ret = qio_channel_pread(p->c, (char *)data->opaque + offset, len,
+                                    data->file_offset + offset, errp);
+            if (ret <= 0) {
+                if (!ret) {
+                    error_setg(errp, "unexpected end of file");
+                }
+                error_prepend(errp,
+                              "multifd recv (%u): read 0x%zx at 0x%" PRIx64
+                              ": ", p->id, len,
+                              (uint64_t)data->file_offset + offset);
+                return -1;
+            }
+            offset += ret;
+            len -= ret;
+        }
     }
 
     return 0;
@@ -113,6 +113,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
                        info->ram->multifd_bytes >> 10);
+        if (info->ram->multifd_raw_pages) {
+            monitor_printf(mon, "multifd raw pages: %" PRIu64 " pages\n",
+                           info->ram->multifd_raw_pages);
+        }
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
 
@@ -160,6 +164,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->hot_pages) {
+        monitor_printf(mon, "hot page checks: %" PRIu64 "\n",
+                       info->hot_pages->checks);
+        monitor_printf(mon, "hot page hits: %" PRIu64 "\n",
+                       info->hot_pages->hits);
+        monitor_printf(mon, "hot page hit rate: %0.2f\n",
+                       info->hot_pages->hit_rate);
+        monitor_printf(mon, "hot regions: %" PRIu64 "\n",
+                       info->hot_pages->hot_regions);
+        monitor_printf(mon, "postponed pages: %" PRIu64 " pages\n",
+                       info->hot_pages->postponed_pages);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -303,6 +320,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
             MigrationParameter_str(MIGRATION_PARAMETER_ZERO_PAGE_DETECTION),
             qapi_enum_lookup(&ZeroPageDetection_lookup,
                 params->zero_page_detection));
+        assert(params->has_dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
+        assert(params->has_postcopy_prefetch_pages);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES),
+            params->postcopy_prefetch_pages);
         monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -573,10 +598,22 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_LZ4_LEVEL:
+        p->has_multifd_lz4_level = true;
+        visit_type_uint8(v, param, &p->multifd_lz4_level, &err);
+        break;
     case MIGRATION_PARAMETER_ZERO_PAGE_DETECTION:
         p->has_zero_page_detection = true;
         visit_type_ZeroPageDetection(v, param, &p->zero_page_detection, &err);
         break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+        p->has_postcopy_prefetch_pages = true;
+        visit_type_uint32(v, param, &p->postcopy_prefetch_pages, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -64,6 +64,10 @@ typedef struct {
      * Number of bytes sent through multifd channels.
      */
     Stat64 multifd_bytes;
+    /*
+     * Number of normal pages sent through multifd without compression.
+     */
+    Stat64 multifd_raw_pages;
     /*
      * Number of pages transferred that were not full of zeros.
      */
@@ -130,6 +130,19 @@ static void migration_downtime_end(MigrationState *s)
     trace_vmstate_downtime_checkpoint("src-downtime-end");
 }
 
+/*
+ * Account the time since @start_us (QEMU_CLOCK_REALTIME) to @phase of the
+ * downtime breakdown.  Must be called with the BQL held.
+ */
+void migration_downtime_phase_add(MigrationDowntimePhase phase,
+                                  int64_t start_us)
+{
+    MigrationState *s = migrate_get_current();
+
+    s->downtime_phases[phase] += qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 start_us;
+}
+
 static bool migration_needs_multiple_sockets(void)
 {
     return migrate_multifd() || migrate_postcopy_preempt();
@@ -192,6 +205,7 @@ static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 
 static int migration_stop_vm(MigrationState *s, RunState state)
 {
+    int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int ret;
 
     migration_downtime_start(s);
@@ -200,6 +214,7 @@ static int migration_stop_vm(MigrationState *s, RunState state)
     global_state_store();
 
     ret = vm_stop_force_state(state);
+    migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_VM_STOP, start_us);
 
     trace_vmstate_downtime_checkpoint("src-vm-stopped");
     trace_migration_completion_vm_stop(ret);
@@ -1154,6 +1169,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
     info->ram->multifd_bytes = stat64_get(&mig_stats.multifd_bytes);
+    info->ram->multifd_raw_pages = stat64_get(&mig_stats.multifd_raw_pages);
     info->ram->pages_per_second = s->pages_per_second;
     info->ram->precopy_bytes = stat64_get(&mig_stats.precopy_bytes);
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
@@ -1170,6 +1186,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
     }
 
+    if (migrate_postpone_hot_pages()) {
+        info->hot_pages = QAPI_CLONE(HotPageStats, &hot_page_counters);
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -1313,6 +1333,26 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+MigrationDowntimeBreakdown *qmp_query_migrate_downtime_breakdown(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationDowntimeBreakdown *info = g_new0(MigrationDowntimeBreakdown, 1);
+    MigrationDowntimePhaseInfoList **tail = &info->phases;
+    int i;
+
+    for (i = 0; i < MIGRATION_DOWNTIME_PHASE__MAX; i++) {
+        MigrationDowntimePhaseInfo *phase = g_new0(MigrationDowntimePhaseInfo,
+                                                   1);
+
+        phase->phase = i;
+        phase->time = s->downtime_phases[i];
+        QAPI_LIST_APPEND(tail, phase);
+    }
+    info->sections = qemu_savevm_downtime_sections();
+
+    return info;
+}
+
 void qmp_migrate_start_postcopy(Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -1653,6 +1693,7 @@ int migrate_init(MigrationState *s, Error **errp)
     s->pages_per_second = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    memset(s->downtime_phases, 0, sizeof(s->downtime_phases));
     s->setup_time = 0;
     s->start_postcopy = false;
     s->migration_thread_running = false;
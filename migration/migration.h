@@ -339,6 +339,11 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /*
+     * Time spent in each phase of the final stage (us).  Protected by the
+     * BQL.
+     */
+    uint64_t downtime_phases[MIGRATION_DOWNTIME_PHASE__MAX];
     bool capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
 
@@ -514,6 +519,9 @@ int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque);
 #define qemu_ram_foreach_block \
   #warning "Use foreach_not_ignored_block in migration code"
 
+void migration_downtime_phase_add(MigrationDowntimePhase phase,
+                                  int64_t start_us);
+
 void migration_make_urgent_request(void);
 void migration_consume_urgent_request(void);
 bool migration_rate_limit(void);
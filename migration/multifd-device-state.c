@@ -0,0 +1,373 @@
+/*
+ * Multifd device state transfer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu/coroutine.h"
+#include "qemu/lockable.h"
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "trace.h"
+
+/*
+ * With the multifd-device-state capability, the state of the
+ * non-iterable devices is saved in memory by the migration thread and
+ * handed in batches to the multifd channels, which compress it and send
+ * it in parallel.  The main channel only carries a
+ * MIG_CMD_MULTIFD_DEVICE_STATE command with the id of each batch, at
+ * the place the devices would have been, so that the destination still
+ * loads them in order.
+ *
+ * A device state packet is a normal multifd packet without pages, with
+ * MULTIFD_FLAG_DEVICE_STATE set.  It is followed by next_packet_size
+ * bytes of data, compressed with the multifd-compression method unless
+ * that does not make it smaller than the device_state_size bytes of the
+ * original state.  The compression flags of the packet tell which.
+ */
+
+static struct {
+    /* protects the fields below */
+    QemuMutex lock;
+    /* signaled when a device state arrives or when multifd exits */
+    QemuCond cond;
+    /* coroutine waiting in multifd_device_state_get(), if any */
+    Coroutine *waiter;
+    /* device states received but not loaded yet, indexed by id */
+    GHashTable *states;
+    bool exiting;
+} *device_state_recv;
+
+/*
+ * Compress @size bytes of @data with the multifd-compression method.
+ *
+ * Returns the compressed length and sets @zbuf and @flag to the
+ * compressed data and its MULTIFD_FLAG_* compression flag, or returns 0
+ * if the data is better sent as is.
+ */
+static size_t device_state_compress(const uint8_t *data, size_t size,
+                                    uint8_t **zbuf, uint32_t *flag)
+{
+    g_autofree uint8_t *buf = NULL;
+    size_t len = 0;
+
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_ZLIB: {
+        uLongf zlen = compressBound(size);
+
+        buf = g_try_malloc(zlen);
+        if (buf && compress2(buf, &zlen, data, size,
+                             migrate_multifd_zlib_level()) == Z_OK) {
+            len = zlen;
+            *flag = MULTIFD_FLAG_ZLIB;
+        }
+        break;
+    }
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD: {
+        size_t zlen = ZSTD_compressBound(size);
+
+        buf = g_try_malloc(zlen);
+        if (buf) {
+            zlen = ZSTD_compress(buf, zlen, data, size,
+                                 migrate_multifd_zstd_level());
+            if (!ZSTD_isError(zlen)) {
+                len = zlen;
+                *flag = MULTIFD_FLAG_ZSTD;
+            }
+        }
+        break;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case MULTIFD_COMPRESSION_LZ4: {
+        int zlen = LZ4_compressBound(size);
+
+        buf = zlen > 0 ? g_try_malloc(zlen) : NULL;
+        if (buf) {
+            zlen = LZ4_compress_fast((const char *)data, (char *)buf, size,
+                                     zlen, migrate_multifd_lz4_level());
+            if (zlen > 0) {
+                len = zlen;
+                *flag = MULTIFD_FLAG_LZ4;
+            }
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (!len || len >= size) {
+        return 0;
+    }
+    *zbuf = g_steal_pointer(&buf);
+    return len;
+}
+
+/*
+ * Decompress @len bytes of @buf, compressed with the method of @flag,
+ * into the @size bytes of @data.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int device_state_decompress(uint32_t flag, const uint8_t *buf,
+                                   uint32_t len, uint8_t *data, uint32_t size)
+{
+    switch (flag) {
+    case MULTIFD_FLAG_ZLIB: {
+        uLongf dlen = size;
+
+        if (uncompress(data, &dlen, buf, len) != Z_OK || dlen != size) {
+            return -1;
+        }
+        return 0;
+    }
+#ifdef CONFIG_ZSTD
+    case MULTIFD_FLAG_ZSTD: {
+        size_t dlen = ZSTD_decompress(data, size, buf, len);
+
+        return ZSTD_isError(dlen) || dlen != size ? -1 : 0;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case MULTIFD_FLAG_LZ4:
+        return LZ4_decompress_safe((const char *)buf, (char *)data, len,
+                                   size) == (int)size ? 0 : -1;
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* Called with device_state_recv->lock held */
+static Coroutine *device_state_recv_wake(void)
+{
+    qemu_cond_broadcast(&device_state_recv->cond);
+    return g_steal_pointer(&device_state_recv->waiter);
+}
+
+/**
+ * multifd_send_device_state_packet: send the device state of a channel
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+int multifd_send_device_state_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDDeviceState *ds = &p->device_state;
+    g_autofree uint8_t *zbuf = NULL;
+    uint32_t flag = MULTIFD_FLAG_NOCOMP;
+    uint8_t *buf = ds->data;
+    uint32_t len;
+    int ret;
+
+    len = device_state_compress(ds->data, ds->size, &zbuf, &flag);
+    if (len) {
+        buf = zbuf;
+    } else {
+        flag = MULTIFD_FLAG_NOCOMP;
+        len = ds->size;
+    }
+
+    p->flags = MULTIFD_FLAG_DEVICE_STATE | flag;
+    p->next_packet_size = len;
+    multifd_send_fill_packet(p);
+    p->packet->device_state_id = cpu_to_be32(ds->id);
+    p->packet->device_state_size = cpu_to_be32(ds->size);
+
+    p->iov[0].iov_base = p->packet;
+    p->iov[0].iov_len = p->packet_len;
+    p->iov[1].iov_base = buf;
+    p->iov[1].iov_len = len;
+    ret = qio_channel_writev_all(p->c, p->iov, 2, errp);
+    if (ret == 0) {
+        stat64_add(&mig_stats.multifd_bytes, p->packet_len + len);
+    }
+    trace_multifd_send_device_state(p->id, ds->id, ds->size, len);
+
+    p->flags = 0;
+    p->next_packet_size = 0;
+    g_free(ds->data);
+    ds->data = NULL;
+    ds->size = 0;
+
+    return ret;
+}
+
+void multifd_device_state_recv_setup(void)
+{
+    device_state_recv = g_new0(typeof(*device_state_recv), 1);
+    qemu_mutex_init(&device_state_recv->lock);
+    qemu_cond_init(&device_state_recv->cond);
+    device_state_recv->states =
+        g_hash_table_new_full(NULL, NULL, NULL,
+                              (GDestroyNotify)g_bytes_unref);
+}
+
+void multifd_device_state_recv_cleanup(void)
+{
+    if (!device_state_recv) {
+        return;
+    }
+
+    g_hash_table_destroy(device_state_recv->states);
+    qemu_cond_destroy(&device_state_recv->cond);
+    qemu_mutex_destroy(&device_state_recv->lock);
+    g_free(device_state_recv);
+    device_state_recv = NULL;
+}
+
+/* Wake up the main thread if it is waiting for a device state */
+void multifd_device_state_recv_kick(void)
+{
+    Coroutine *co;
+
+    if (!device_state_recv) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&device_state_recv->lock) {
+        device_state_recv->exiting = true;
+        co = device_state_recv_wake();
+    }
+    if (co) {
+        aio_co_wake(co);
+    }
+}
+
+/**
+ * multifd_recv_device_state: receive the device state of a packet
+ *
+ * Reads and decompresses the device state that follows the packet, and
+ * makes it available to multifd_device_state_get().
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t id = be32_to_cpu(p->packet->device_state_id);
+    uint32_t size = be32_to_cpu(p->packet->device_state_size);
+    uint32_t flag = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t len = p->next_packet_size;
+    g_autofree uint8_t *buf = NULL;
+    Coroutine *co;
+    uint8_t *data;
+    int ret;
+
+    if (size > MULTIFD_DEVICE_STATE_MAX_SIZE || len > size ||
+        (flag == MULTIFD_FLAG_NOCOMP && len != size)) {
+        error_setg(errp, "multifd %u: device state %u has invalid size %u "
+                   "(%u compressed)", p->id, id, size, len);
+        return -1;
+    }
+
+    buf = g_try_malloc(len);
+    if (!buf) {
+        error_setg(errp, "multifd %u: out of memory for device state %u",
+                   p->id, id);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)buf, len, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (flag == MULTIFD_FLAG_NOCOMP) {
+        data = g_steal_pointer(&buf);
+    } else {
+        data = g_try_malloc(size);
+        if (!data) {
+            error_setg(errp, "multifd %u: out of memory for device state %u",
+                       p->id, id);
+            return -1;
+        }
+        if (device_state_decompress(flag, buf, len, data, size)) {
+            g_free(data);
+            error_setg(errp, "multifd %u: failed to decompress device state "
+                       "%u (flags %x)", p->id, id, flag);
+            return -1;
+        }
+    }
+    trace_multifd_recv_device_state(p->id, id, size, len);
+
+    WITH_QEMU_LOCK_GUARD(&device_state_recv->lock) {
+        if (g_hash_table_contains(device_state_recv->states,
+                                  GUINT_TO_POINTER(id))) {
+            g_free(data);
+            error_setg(errp, "multifd %u: device state %u received twice",
+                       p->id, id);
+            return -1;
+        }
+        g_hash_table_insert(device_state_recv->states, GUINT_TO_POINTER(id),
+                            g_bytes_new_take(data, size));
+        co = device_state_recv_wake();
+    }
+    if (co) {
+        aio_co_wake(co);
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_device_state_get: wait for a device state from the channels
+ *
+ * Called by the main thread when it reaches the place of the device
+ * state in the migration stream.  In coroutine context this yields
+ * until the state arrives, so the main loop keeps running meanwhile.
+ *
+ * Returns the device state, to be freed by the caller, or NULL if
+ * multifd is exiting.
+ *
+ * @id: id of the device state
+ * @size: set to the size of the device state
+ */
+uint8_t *multifd_device_state_get(uint32_t id, size_t *size)
+{
+    gpointer bytes;
+
+    if (!device_state_recv) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&device_state_recv->lock);
+    while (!g_hash_table_steal_extended(device_state_recv->states,
+                                        GUINT_TO_POINTER(id), NULL, &bytes)) {
+        if (device_state_recv->exiting) {
+            return NULL;
+        }
+        if (qemu_in_coroutine()) {
+            /* Woken up by aio_co_wake() once a new state is inserted */
+            assert(!device_state_recv->waiter);
+            device_state_recv->waiter = qemu_coroutine_self();
+            qemu_mutex_unlock(&device_state_recv->lock);
+            qemu_coroutine_yield();
+            qemu_mutex_lock(&device_state_recv->lock);
+        } else {
+            qemu_cond_wait(&device_state_recv->cond,
+                           &device_state_recv->lock);
+        }
+    }
+
+    return g_bytes_unref_to_data(bytes, size);
+}
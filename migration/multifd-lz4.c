@@ -0,0 +1,311 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/*
+ * Every page is compressed as an independent lz4 block, so that the
+ * destination can decompress straight into guest memory without having
+ * to keep a dictionary around.  The compressed buffer starts with a
+ * table holding the big endian size of each block, followed by the
+ * blocks themselves.  A block whose size is equal to the page size was
+ * not compressible and is sent as is.
+ */
+
+struct lz4_data {
+    /* lz4 compression state, reused for every page of the channel */
+    void *state;
+    /* acceleration factor */
+    int accel;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+    /* uncompressed buffer of size qemu_target_page_size() */
+    uint8_t *buf;
+};
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+    const char *err_msg;
+
+    z->accel = migrate_multifd_lz4_level();
+    z->state = g_try_malloc(LZ4_sizeofState());
+    if (!z->state) {
+        err_msg = "out of memory for lz4 state";
+        goto err_free_z;
+    }
+    /* Size table followed by the worst case of every page sent raw */
+    z->zbuff_len = p->page_count * (sizeof(uint32_t) + p->page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        err_msg = "out of memory for zbuff";
+        goto err_free_state;
+    }
+    z->buf = g_try_malloc(p->page_size);
+    if (!z->buf) {
+        err_msg = "out of memory for buf";
+        goto err_free_zbuff;
+    }
+    p->compress_data = z;
+    return 0;
+
+err_free_zbuff:
+    g_free(z->zbuff);
+err_free_state:
+    g_free(z->state);
+err_free_z:
+    g_free(z);
+    error_setg(errp, "multifd %u: %s", p->id, err_msg);
+    return -1;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->state);
+    z->state = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct lz4_data *z = p->compress_data;
+    uint32_t *sizes = (uint32_t *)z->zbuff;
+    uint32_t out_size = pages->normal_num * sizeof(uint32_t);
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        uint8_t *dst = z->zbuff + out_size;
+        int ret;
+
+        /*
+         * Since the VM might be running, the page may be changing concurrently
+         * with compression. lz4 does not guarantee that this is safe,
+         * therefore copy the page before compressing it.
+         */
+        memcpy(z->buf, p->pages->block->host + pages->offset[i], p->page_size);
+
+        /*
+         * Leave no room for a block as large as the page, so that lz4 gives
+         * up early on incompressible data and the page is sent raw.
+         */
+        ret = LZ4_compress_fast_extState(z->state, (const char *)z->buf,
+                                         (char *)dst, p->page_size,
+                                         p->page_size - 1, z->accel);
+        if (ret < 0) {
+            error_setg(errp, "multifd %u: lz4 compression returned %d",
+                       p->id, ret);
+            return -1;
+        }
+        if (ret == 0) {
+            memcpy(dst, z->buf, p->page_size);
+            ret = p->page_size;
+        }
+        sizes[i] = cpu_to_be32(ret);
+        out_size += ret;
+    }
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+out:
+    p->flags |= MULTIFD_FLAG_LZ4;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    /* Size table followed by the worst case of every page sent raw */
+    z->zbuff_len = p->page_count * (sizeof(uint32_t) + p->page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return the memory used by the channel.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->compress_data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * lz4_recv: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t *sizes = (uint32_t *)z->zbuff;
+    uint32_t in_pos;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    in_pos = p->normal_num * sizeof(uint32_t);
+    if (in_size < in_pos || in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size %u is invalid for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint32_t size = be32_to_cpu(sizes[i]);
+        uint8_t *page = p->host + p->normal[i];
+
+        if (size > p->page_size || size > in_size - in_pos) {
+            error_setg(errp, "multifd %u: block size %u is invalid",
+                       p->id, size);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+
+        if (size == p->page_size) {
+            memcpy(page, z->zbuff + in_pos, p->page_size);
+        } else {
+            ret = LZ4_decompress_safe((const char *)z->zbuff + in_pos,
+                                      (char *)page, size, p->page_size);
+            if (ret != p->page_size) {
+                error_setg(errp, "multifd %u: lz4 decompression returned %d "
+                           "instead of %u", p->id, ret, p->page_size);
+                return -1;
+            }
+        }
+        in_pos += size;
+    }
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv = lz4_recv
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
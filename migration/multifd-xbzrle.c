@@ -0,0 +1,413 @@
+/*
+ * Multifd XBZRLE implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "page_cache.h"
+#include "ram.h"
+#include "xbzrle.h"
+
+/*
+ * With multifd, the XBZRLE cache is split in one slice per channel so
+ * that the channels can encode pages in parallel.  A page can be queued
+ * to any channel, so the slice holding it is picked from its address
+ * rather than from the channel: each slice has its own lock and a given
+ * page always lives in the same slice.
+ *
+ * The XBZRLE pages of a packet are sent after the raw pages.  Their
+ * data starts with a table holding the big endian size of each page,
+ * followed by the pages themselves:
+ *  - a size of 0 means that the page did not change;
+ *  - a size equal to the page size means that the page is sent as is,
+ *    either because it was just inserted in the cache or because the
+ *    encoding would have been larger than the page;
+ *  - anything else is an XBZRLE encoded page.
+ * Pages are always sent from the copy that ends up in the cache, so
+ * that the cache matches the destination memory even if the guest keeps
+ * writing to the page.
+ */
+
+typedef struct {
+    /* protects the cache of the slice */
+    QemuMutex lock;
+    PageCache *cache;
+} MultiFDXbzrleSlice;
+
+static struct {
+    MultiFDXbzrleSlice *slices;
+    int num_slices;
+    /* whether pages are looked up in the cache, set after the first round */
+    bool started;
+    uint8_t *zero_page;
+    /* protects xbzrle_counters */
+    QemuMutex counters_lock;
+} *multifd_xbzrle;
+
+static MultiFDXbzrleSlice *multifd_xbzrle_slice(ram_addr_t addr,
+                                                uint64_t *key)
+{
+    uint64_t page = addr >> qemu_target_page_bits();
+    int n = multifd_xbzrle->num_slices;
+
+    /* Consecutive pages of a slice must use consecutive cache entries */
+    *key = (page / n) << qemu_target_page_bits();
+    return &multifd_xbzrle->slices[page % n];
+}
+
+/*
+ * The page cache wants a power of two number of pages, round the share
+ * of each channel down to that.
+ */
+static uint64_t multifd_xbzrle_slice_size(uint64_t cache_size, int channels)
+{
+    uint64_t pages = cache_size / channels / qemu_target_page_size();
+
+    return pow2floor(MAX(pages, 1)) * qemu_target_page_size();
+}
+
+static void multifd_xbzrle_slices_fini(MultiFDXbzrleSlice *slices, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (slices[i].cache) {
+            cache_fini(slices[i].cache);
+        }
+        qemu_mutex_destroy(&slices[i].lock);
+    }
+    g_free(slices);
+}
+
+/**
+ * multifd_xbzrle_setup: create the cache slices of the channels
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @channels: number of multifd channels
+ * @errp: pointer to an error
+ */
+int multifd_xbzrle_setup(int channels, Error **errp)
+{
+    uint64_t slice_size;
+    int i;
+
+    if (!migrate_xbzrle()) {
+        return 0;
+    }
+
+    slice_size = multifd_xbzrle_slice_size(migrate_xbzrle_cache_size(),
+                                           channels);
+    multifd_xbzrle = g_new0(typeof(*multifd_xbzrle), 1);
+    qemu_mutex_init(&multifd_xbzrle->counters_lock);
+    multifd_xbzrle->zero_page = g_malloc0(qemu_target_page_size());
+    multifd_xbzrle->num_slices = channels;
+    multifd_xbzrle->slices = g_new0(MultiFDXbzrleSlice, channels);
+    for (i = 0; i < channels; i++) {
+        qemu_mutex_init(&multifd_xbzrle->slices[i].lock);
+    }
+    for (i = 0; i < channels; i++) {
+        multifd_xbzrle->slices[i].cache =
+            cache_init(slice_size, qemu_target_page_size(), errp);
+        if (!multifd_xbzrle->slices[i].cache) {
+            error_prepend(errp, "multifd xbzrle: ");
+            multifd_xbzrle_cleanup();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void multifd_xbzrle_cleanup(void)
+{
+    if (!multifd_xbzrle) {
+        return;
+    }
+
+    multifd_xbzrle_slices_fini(multifd_xbzrle->slices,
+                               multifd_xbzrle->num_slices);
+    g_free(multifd_xbzrle->zero_page);
+    qemu_mutex_destroy(&multifd_xbzrle->counters_lock);
+    g_free(multifd_xbzrle);
+    multifd_xbzrle = NULL;
+}
+
+/* Called once the first round of RAM has been queued */
+void multifd_xbzrle_start(void)
+{
+    if (multifd_xbzrle) {
+        qatomic_set(&multifd_xbzrle->started, true);
+    }
+}
+
+/**
+ * multifd_xbzrle_cache_resize: resize the cache slices
+ *
+ * Called from xbzrle_cache_resize() in the main thread, possibly while
+ * the channels are using the cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @new_size: new size of the whole cache
+ * @errp: pointer to an error
+ */
+int multifd_xbzrle_cache_resize(uint64_t new_size, Error **errp)
+{
+    int n, i;
+    g_autofree PageCache **caches = NULL;
+
+    if (!multifd_xbzrle) {
+        return 0;
+    }
+
+    n = multifd_xbzrle->num_slices;
+    caches = g_new0(PageCache *, n);
+    for (i = 0; i < n; i++) {
+        caches[i] = cache_init(multifd_xbzrle_slice_size(new_size, n),
+                               qemu_target_page_size(), errp);
+        if (!caches[i]) {
+            while (i) {
+                cache_fini(caches[--i]);
+            }
+            return -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        MultiFDXbzrleSlice *slice = &multifd_xbzrle->slices[i];
+
+        WITH_QEMU_LOCK_GUARD(&slice->lock) {
+            cache_fini(slice->cache);
+            slice->cache = caches[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called when a page is sent as a zero page, otherwise a
+ * previous (now 0'd) cached page would be stale.
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    MultiFDXbzrleSlice *slice;
+    uint64_t key;
+
+    if (!multifd_xbzrle || !qatomic_read(&multifd_xbzrle->started)) {
+        return;
+    }
+
+    slice = multifd_xbzrle_slice(addr, &key);
+    WITH_QEMU_LOCK_GUARD(&slice->lock) {
+        cache_insert(slice->cache, key, multifd_xbzrle->zero_page,
+                     stat64_get(&mig_stats.dirty_sync_count));
+    }
+}
+
+/*
+ * Encode one page into @dst, which has room for a whole page.
+ *
+ * Returns the size of the page in the packet, or -1 if the page could
+ * not be inserted in the cache and must be sent as a normal page.
+ */
+static int multifd_xbzrle_encode_page(MultiFDSendParams *p, ram_addr_t addr,
+                                      uint8_t *host, uint8_t *dst,
+                                      XBZRLECacheStats *stats)
+{
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    MultiFDXbzrleSlice *slice;
+    uint8_t *cached;
+    uint64_t key;
+    int len;
+
+    slice = multifd_xbzrle_slice(addr, &key);
+    QEMU_LOCK_GUARD(&slice->lock);
+
+    if (!cache_is_cached(slice->cache, key, generation)) {
+        stats->cache_miss++;
+        if (cache_insert(slice->cache, key, host, generation) == -1) {
+            return -1;
+        }
+        memcpy(dst, get_cached_data(slice->cache, key), p->page_size);
+        return p->page_size;
+    }
+
+    stats->pages++;
+    cached = get_cached_data(slice->cache, key);
+    memcpy(p->xbzrle_page, host, p->page_size);
+
+    /* Leave no room for an encoding as large as the page itself */
+    len = xbzrle_encode_buffer(cached, p->xbzrle_page, p->page_size,
+                               dst, p->page_size - 1);
+    if (len) {
+        memcpy(cached, p->xbzrle_page, p->page_size);
+    }
+    if (len == -1) {
+        stats->overflow++;
+        memcpy(dst, p->xbzrle_page, p->page_size);
+        len = p->page_size;
+    }
+    stats->bytes += len + sizeof(uint32_t);
+
+    return len;
+}
+
+/**
+ * multifd_send_xbzrle_page_detect: Encode the pages found in the cache
+ *
+ * Moves the pages handled by XBZRLE after the normal pages in
+ * p->pages->offset, fills the XBZRLE buffers of the channel and updates
+ * p->pages->normal_num and p->pages->xbzrle_num.  Must be called after
+ * zero page detection.
+ *
+ * @p: Params for the channel that we are using
+ */
+void multifd_send_xbzrle_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *rb = pages->block;
+    XBZRLECacheStats stats = {};
+    uint32_t *sizes = (uint32_t *)p->xbzrle_buf;
+    uint8_t *data = p->xbzrle_buf + p->page_count * sizeof(uint32_t);
+    uint32_t data_size = 0, normal_num = 0, xbzrle_num = 0;
+    uint32_t i;
+
+    pages->xbzrle_num = 0;
+    p->xbzrle_size = 0;
+
+    if (!multifd_xbzrle || !qatomic_read(&multifd_xbzrle->started)) {
+        return;
+    }
+
+    for (i = pages->normal_num; i < pages->num; i++) {
+        multifd_xbzrle_cache_zero_page(rb->offset + pages->offset[i]);
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        int len;
+
+        len = multifd_xbzrle_encode_page(p, rb->offset + offset,
+                                         rb->host + offset,
+                                         data + data_size, &stats);
+        if (len < 0) {
+            pages->offset[normal_num++] = offset;
+            continue;
+        }
+
+        p->xbzrle_offset[xbzrle_num] = offset;
+        sizes[xbzrle_num] = cpu_to_be32(len);
+        xbzrle_num++;
+        data_size += len;
+    }
+
+    if (xbzrle_num) {
+        memcpy(&pages->offset[normal_num], p->xbzrle_offset,
+               xbzrle_num * sizeof(ram_addr_t));
+        pages->normal_num = normal_num;
+        pages->xbzrle_num = xbzrle_num;
+        p->xbzrle_data_size = data_size;
+        p->xbzrle_size = xbzrle_num * sizeof(uint32_t) + data_size;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&multifd_xbzrle->counters_lock) {
+        xbzrle_counters.cache_miss += stats.cache_miss;
+        xbzrle_counters.pages += stats.pages;
+        xbzrle_counters.overflow += stats.overflow;
+        xbzrle_counters.bytes += stats.bytes;
+    }
+}
+
+/*
+ * The size table and the data of the XBZRLE pages are sent after the
+ * raw pages.
+ */
+void multifd_send_prepare_xbzrle_iovs(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+
+    p->iov[p->iovs_num].iov_base = p->xbzrle_buf;
+    p->iov[p->iovs_num].iov_len = pages->xbzrle_num * sizeof(uint32_t);
+    p->iovs_num++;
+    p->iov[p->iovs_num].iov_base = p->xbzrle_buf +
+                                   p->page_count * sizeof(uint32_t);
+    p->iov[p->iovs_num].iov_len = p->xbzrle_data_size;
+    p->iovs_num++;
+}
+
+/**
+ * multifd_recv_xbzrle_page_process: read and decode the XBZRLE pages
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+int multifd_recv_xbzrle_page_process(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->xbzrle_size;
+    uint32_t in_pos = p->xbzrle_num * sizeof(uint32_t);
+    uint32_t *sizes;
+    int ret;
+
+    if (in_size < in_pos ||
+        in_size > p->page_count * (sizeof(uint32_t) + p->page_size)) {
+        error_setg(errp, "multifd %u: xbzrle size %u is invalid for %u pages",
+                   p->id, in_size, p->xbzrle_num);
+        return -1;
+    }
+
+    if (!p->xbzrle_buf) {
+        p->xbzrle_buf = g_malloc(p->page_count *
+                                 (sizeof(uint32_t) + p->page_size));
+    }
+    sizes = (uint32_t *)p->xbzrle_buf;
+
+    ret = qio_channel_read_all(p->c, (void *)p->xbzrle_buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (int i = 0; i < p->xbzrle_num; i++) {
+        uint32_t size = be32_to_cpu(sizes[i]);
+        uint8_t *page = p->host + p->xbzrle[i];
+
+        if (size > p->page_size || size > in_size - in_pos) {
+            error_setg(errp, "multifd %u: xbzrle page size %u is invalid",
+                       p->id, size);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->xbzrle[i]);
+
+        if (size == p->page_size) {
+            memcpy(page, p->xbzrle_buf + in_pos, size);
+        } else if (size &&
+                   xbzrle_decode_buffer(p->xbzrle_buf + in_pos, size, page,
+                                        p->page_size) == -1) {
+            error_setg(errp, "multifd %u: failed to decode xbzrle page",
+                       p->id);
+            return -1;
+        }
+        in_pos += size;
+    }
+
+    if (in_pos != in_size) {
+        error_setg(errp, "multifd %u: xbzrle size received %u size expected %u",
+                   p->id, in_size, in_pos);
+        return -1;
+    }
+
+    return 0;
+}
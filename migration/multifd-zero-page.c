@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 #include "exec/ramblock.h"
 #include "migration.h"
 #include "multifd.h"
@@ -36,6 +37,30 @@ static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
     pages_offset[b] = temp;
 }
 
+/*
+ * Test all the pages of p->pages at once, in batches of one bitmap
+ * word, filling p->zero_bmap.
+ *
+ * Returns the number of zero pages.
+ */
+static uint32_t multifd_zero_page_scan(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    const void *bufs[BITS_PER_LONG];
+    uint32_t i, j, n, zero_num = 0;
+
+    for (i = 0; i < pages->num; i += n) {
+        n = MIN(BITS_PER_LONG, pages->num - i);
+        for (j = 0; j < n; j++) {
+            bufs[j] = pages->block->host + pages->offset[i + j];
+        }
+        zero_num += buffer_is_zero_batch(bufs, n, p->page_size,
+                                         &p->zero_bmap[BIT_WORD(i)]);
+    }
+
+    return zero_num;
+}
+
 /**
  * multifd_send_zero_page_detect: Perform zero page detection on all pages.
  *
@@ -48,6 +73,7 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
 {
     MultiFDPages_t *pages = p->pages;
     RAMBlock *rb = pages->block;
+    unsigned long *zero = p->zero_bmap;
     int i = 0;
     int j = pages->num - 1;
 
@@ -56,6 +82,11 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
         return;
     }
 
+    if (!multifd_zero_page_scan(p)) {
+        pages->normal_num = pages->num;
+        return;
+    }
+
     /*
      * Sort the page offset array by moving all normal pages to
      * the left and all zero pages to the right of the array.
@@ -63,12 +94,16 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
     while (i <= j) {
         uint64_t offset = pages->offset[i];
 
-        if (!buffer_is_zero(rb->host + offset, p->page_size)) {
+        if (!test_bit(i, zero)) {
             i++;
             continue;
         }
 
         swap_page_offset(pages->offset, i, j);
+        /* The page now at i is the one that was at j */
+        if (!test_bit(j, zero)) {
+            clear_bit(i, zero);
+        }
         ram_release_page(rb->idstr, offset);
         j--;
     }
@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -166,6 +167,103 @@ static void multifd_send_prepare_iovs(MultiFDSendParams *p)
     p->next_packet_size = pages->normal_num * p->page_size;
 }
 
+/*
+ * Adaptive compression: instead of checking the whole page, look at
+ * MULTIFD_RAW_SAMPLES evenly spread chunks of MULTIFD_RAW_SAMPLE_SIZE
+ * bytes, and count how many different byte values they contain.  Random
+ * looking data (already compressed or encrypted) uses about 160 of the 256
+ * possible values in 256 bytes, while data that compresses well uses far
+ * fewer.
+ */
+#define MULTIFD_RAW_SAMPLES 16
+#define MULTIFD_RAW_SAMPLE_SIZE 16
+#define MULTIFD_RAW_BYTE_SET_THRESHOLD 144
+
+static bool multifd_page_is_compressible(const uint8_t *page,
+                                         uint32_t page_size)
+{
+    uint32_t stride = page_size / MULTIFD_RAW_SAMPLES;
+    unsigned long seen[BITS_TO_LONGS(256)] = { 0 };
+    int byte_set = 0;
+
+    for (int i = 0; i < MULTIFD_RAW_SAMPLES; i++) {
+        const uint8_t *sample = page + i * stride;
+
+        for (int j = 0; j < MULTIFD_RAW_SAMPLE_SIZE; j++) {
+            if (!test_and_set_bit(sample[j], seen)) {
+                byte_set++;
+            }
+        }
+    }
+
+    return byte_set < MULTIFD_RAW_BYTE_SET_THRESHOLD;
+}
+
+/**
+ * multifd_send_raw_page_detect: Find the pages not worth compressing.
+ *
+ * Sorts the normal pages that are expected to compress well before the
+ * ones that are not in p->pages->offset, and updates p->pages->normal_num
+ * and p->pages->raw_num.  Must be called after zero page detection.
+ *
+ * @p: Params for the channel that we are using
+ */
+void multifd_send_raw_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    RAMBlock *rb = pages->block;
+    int i = 0;
+    int j = pages->normal_num - 1;
+
+    if (!migrate_multifd_adaptive_compression() ||
+        migrate_multifd_compression() == MULTIFD_COMPRESSION_NONE) {
+        pages->raw_num = 0;
+        return;
+    }
+
+    while (i <= j) {
+        ram_addr_t offset = pages->offset[i];
+
+        if (multifd_page_is_compressible(rb->host + offset, p->page_size)) {
+            i++;
+            continue;
+        }
+
+        pages->offset[i] = pages->offset[j];
+        pages->offset[j] = offset;
+        j--;
+    }
+
+    pages->raw_num = pages->normal_num - i;
+    pages->normal_num = i;
+}
+
+/*
+ * Raw pages are sent after whatever the compression method put in the
+ * packet, straight from guest memory.
+ */
+static void multifd_send_prepare_raw_iovs(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t end = pages->normal_num + pages->raw_num;
+
+    for (int i = pages->normal_num; i < end; i++) {
+        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
+        p->iov[p->iovs_num].iov_len = p->page_size;
+        p->iovs_num++;
+    }
+}
+
+static int multifd_recv_raw_page_process(MultiFDRecvParams *p, Error **errp)
+{
+    for (int i = 0; i < p->raw_num; i++) {
+        p->iov[i].iov_base = p->host + p->raw[i];
+        p->iov[i].iov_len = p->page_size;
+        ramblock_recv_bitmap_set_offset(p->block, p->raw[i]);
+    }
+    return qio_channel_readv_all(p->c, p->iov, p->raw_num, errp);
+}
+
 /**
  * nocomp_send_prepare: prepare date to be able to send
  *
@@ -199,6 +297,7 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
         multifd_send_prepare_header(p);
     }
 
+    multifd_send_xbzrle_page_detect(p);
     multifd_send_prepare_iovs(p);
     p->flags |= MULTIFD_FLAG_NOCOMP;
 
@@ -310,6 +409,8 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->raw_num = 0;
+    pages->xbzrle_num = 0;
     pages->block = NULL;
 }
 
@@ -401,12 +502,28 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = p->pages;
     uint64_t packet_num;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->raw_num -
+                        pages->xbzrle_num;
     int i;
 
+    if (pages->raw_num) {
+        p->flags |= MULTIFD_FLAG_RAW;
+    } else {
+        p->flags &= ~MULTIFD_FLAG_RAW;
+    }
+
+    if (pages->xbzrle_num) {
+        p->flags |= MULTIFD_FLAG_XBZRLE;
+    } else {
+        p->flags &= ~MULTIFD_FLAG_XBZRLE;
+    }
+
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->normal_pages = cpu_to_be32(pages->normal_num);
+    packet->raw_pages = cpu_to_be32(pages->raw_num);
+    packet->xbzrle_pages = cpu_to_be32(pages->xbzrle_num);
+    packet->xbzrle_size = cpu_to_be32(p->xbzrle_size);
     packet->zero_pages = cpu_to_be32(zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
 
@@ -425,10 +542,13 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
     }
 
     p->packets_sent++;
-    p->total_normal_pages += pages->normal_num;
+    p->total_normal_pages += pages->normal_num + pages->raw_num +
+                             pages->xbzrle_num;
+    p->total_raw_pages += pages->raw_num;
     p->total_zero_pages += zero_num;
 
-    trace_multifd_send(p->id, packet_num, pages->normal_num, zero_num,
+    trace_multifd_send(p->id, packet_num, pages->normal_num, pages->raw_num,
+                       zero_num,
                        p->flags, p->next_packet_size);
 }
 
@@ -475,24 +595,54 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->raw_num = 0;
+    if (p->flags & MULTIFD_FLAG_RAW) {
+        p->raw_num = be32_to_cpu(packet->raw_pages);
+        if (p->raw_num > packet->pages_alloc - p->normal_num) {
+            error_setg(errp, "multifd: received packet "
+                       "with %u raw pages and expected maximum raw pages "
+                       "are %u",
+                       p->raw_num, packet->pages_alloc - p->normal_num);
+            return -1;
+        }
+    }
+
+    p->xbzrle_num = 0;
+    p->xbzrle_size = 0;
+    if (p->flags & MULTIFD_FLAG_XBZRLE) {
+        p->xbzrle_num = be32_to_cpu(packet->xbzrle_pages);
+        if (p->xbzrle_num > packet->pages_alloc - p->normal_num - p->raw_num) {
+            error_setg(errp, "multifd: received packet "
+                       "with %u xbzrle pages and expected maximum xbzrle "
+                       "pages are %u", p->xbzrle_num,
+                       packet->pages_alloc - p->normal_num - p->raw_num);
+            return -1;
+        }
+        p->xbzrle_size = be32_to_cpu(packet->xbzrle_size);
+    }
+
     p->zero_num = be32_to_cpu(packet->zero_pages);
-    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+    if (p->zero_num > packet->pages_alloc - p->normal_num - p->raw_num -
+                      p->xbzrle_num) {
         error_setg(errp, "multifd: received packet "
                    "with %u zero pages and expected maximum zero pages are %u",
-                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+                   p->zero_num,
+                   packet->pages_alloc - p->normal_num - p->raw_num -
+                   p->xbzrle_num) ;
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
     p->packets_recved++;
-    p->total_normal_pages += p->normal_num;
+    p->total_normal_pages += p->normal_num + p->raw_num + p->xbzrle_num;
     p->total_zero_pages += p->zero_num;
 
-    trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
-                       p->flags, p->next_packet_size);
+    trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->raw_num,
+                       p->zero_num, p->flags, p->next_packet_size);
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    if (p->normal_num == 0 && p->raw_num == 0 && p->xbzrle_num == 0 &&
+        p->zero_num == 0) {
         return 0;
     }
 
@@ -518,9 +668,36 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
-    for (i = 0; i < p->zero_num; i++) {
+    for (i = 0; i < p->raw_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
 
+        if (offset > (p->block->used_length - p->page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->raw[i] = offset;
+    }
+
+    for (i = 0; i < p->xbzrle_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->raw_num + i]);
+
+        if (offset > (p->block->used_length - p->page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->xbzrle[i] = offset;
+    }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->raw_num +
+                                                     p->xbzrle_num + i]);
+
         if (offset > (p->block->used_length - p->page_size)) {
             error_setg(errp, "multifd: offset too long %" PRIu64
                        " (max " RAM_ADDR_FMT ")",
@@ -556,33 +733,17 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 }
 
 /*
- * How we use multifd_send_state->pages and channel->pages?
- *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
- *    - to not have to do so many mallocs during migration
- *    - to make easier to know what to free at the end of migration
- *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
- *
- * Returns true if succeed, false otherwise.
+ * Wait until a channel is free and return it, or NULL if multifd is
+ * exiting.
  */
-static bool multifd_send_pages(void)
+static MultiFDSendParams *multifd_send_get_idle_channel(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
 
     if (multifd_send_should_exit()) {
-        return false;
+        return NULL;
     }
 
     /* We wait here, until at least one channel is ready */
@@ -596,7 +757,7 @@ static bool multifd_send_pages(void)
     next_channel %= migrate_multifd_channels();
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_send_should_exit()) {
-            return false;
+            return NULL;
         }
         p = &multifd_send_state->params[i];
         /*
@@ -614,7 +775,40 @@ static bool multifd_send_pages(void)
      * qatomic_store_release() in multifd_send_thread().
      */
     smp_mb_acquire();
-    assert(!p->pages->num);
+    assert(!p->pages->num && !p->device_state.data);
+
+    return p;
+}
+
+/*
+ * How we use multifd_send_state->pages and channel->pages?
+ *
+ * We create a pages for each channel, and a main one.  Each time that
+ * we need to send a batch of pages we interchange the ones between
+ * multifd_send_state and the channel that is sending it.  There are
+ * two reasons for that:
+ *    - to not have to do so many mallocs during migration
+ *    - to make easier to know what to free at the end of migration
+ *
+ * This way we always know who is the owner of each "pages" struct,
+ * and we don't need any locking.  It belongs to the migration thread
+ * or to the channel thread.  Switching is safe because the migration
+ * thread is using the channel mutex when changing it, and the channel
+ * have to had finish with its own, otherwise pending_job can't be
+ * false.
+ *
+ * Returns true if succeed, false otherwise.
+ */
+static bool multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    p = multifd_send_get_idle_channel();
+    if (!p) {
+        return false;
+    }
+
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     /*
@@ -642,6 +836,50 @@ static inline void multifd_enqueue(MultiFDPages_t *pages, ram_addr_t offset)
     pages->offset[pages->num++] = offset;
 }
 
+/*
+ * Whether the state of the non-iterable devices is sent on the multifd
+ * channels.
+ */
+bool multifd_device_state_active(void)
+{
+    return migrate_multifd_device_state() && multifd_send_state &&
+           multifd_use_packets();
+}
+
+/**
+ * multifd_send_device_state: queue device state on a multifd channel
+ *
+ * The channel compresses the device state and sends it.  It takes
+ * ownership of @data, which is freed once sent.
+ *
+ * Returns true if succeed, false otherwise.
+ *
+ * @id: id of the device state in the migration stream
+ * @data: device state to send
+ * @size: size of @data, at most MULTIFD_DEVICE_STATE_MAX_SIZE
+ */
+bool multifd_send_device_state(uint32_t id, uint8_t *data, size_t size)
+{
+    MultiFDSendParams *p;
+
+    assert(size <= MULTIFD_DEVICE_STATE_MAX_SIZE);
+
+    p = multifd_send_get_idle_channel();
+    if (!p) {
+        g_free(data);
+        return false;
+    }
+
+    p->device_state.id = id;
+    p->device_state.data = data;
+    p->device_state.size = size;
+    /* Pairs with the qatomic_load_acquire() in multifd_send_thread() */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
 /* Returns true if enqueue successful, false otherwise */
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset)
 {
@@ -785,6 +1023,16 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     p->packet = NULL;
     g_free(p->iov);
     p->iov = NULL;
+    g_free(p->zero_bmap);
+    p->zero_bmap = NULL;
+    g_free(p->xbzrle_buf);
+    p->xbzrle_buf = NULL;
+    g_free(p->xbzrle_offset);
+    p->xbzrle_offset = NULL;
+    g_free(p->xbzrle_page);
+    p->xbzrle_page = NULL;
+    g_free(p->device_state.data);
+    p->device_state.data = NULL;
     multifd_send_state->ops->send_cleanup(p, errp);
 
     return *errp == NULL;
@@ -824,6 +1072,7 @@ void multifd_send_shutdown(void)
         }
     }
 
+    multifd_xbzrle_cleanup();
     multifd_send_cleanup_state();
 }
 
@@ -926,6 +1175,19 @@ static void *multifd_send_thread(void *opaque)
             break;
         }
 
+        /*
+         * Read pending_job flag before p->device_state.  Pairs with the
+         * qatomic_store_release() in multifd_send_device_state().
+         */
+        if (qatomic_load_acquire(&p->pending_job) && p->device_state.data) {
+            ret = multifd_send_device_state_packet(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+            qatomic_store_release(&p->pending_job, false);
+            continue;
+        }
+
         /*
          * Read pending_job flag before p->pages.  Pairs with the
          * qatomic_store_release() in multifd_send_pages().
@@ -941,6 +1203,14 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            if (pages->raw_num) {
+                multifd_send_prepare_raw_iovs(p);
+            }
+
+            if (pages->xbzrle_num) {
+                multifd_send_prepare_xbzrle_iovs(p);
+            }
+
             if (migrate_mapped_ram()) {
                 ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
                                               p->pages->block, &local_err);
@@ -955,9 +1225,15 @@ static void *multifd_send_thread(void *opaque)
             }
 
             stat64_add(&mig_stats.multifd_bytes,
-                       p->next_packet_size + p->packet_len);
-            stat64_add(&mig_stats.normal_pages, pages->normal_num);
-            stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+                       p->next_packet_size + p->packet_len +
+                       (uint64_t)pages->raw_num * p->page_size +
+                       p->xbzrle_size);
+            stat64_add(&mig_stats.normal_pages,
+                       pages->normal_num + pages->raw_num);
+            stat64_add(&mig_stats.multifd_raw_pages, pages->raw_num);
+            stat64_add(&mig_stats.zero_pages,
+                       pages->num - pages->normal_num - pages->raw_num -
+                       pages->xbzrle_num);
 
             multifd_pages_reset(p->pages);
             p->next_packet_size = 0;
@@ -1006,7 +1282,7 @@ out:
     rcu_unregister_thread();
     migration_threads_remove(thread);
     trace_multifd_send_thread_end(p->id, p->packets_sent, p->total_normal_pages,
-                                  p->total_zero_pages);
+                                  p->total_raw_pages, p->total_zero_pages);
 
     return NULL;
 }
@@ -1180,15 +1456,25 @@ bool multifd_send_setup(void)
             p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
             p->packet->version = cpu_to_be32(MULTIFD_VERSION);
 
-            /* We need one extra place for the packet header */
-            p->iov = g_new0(struct iovec, page_count + 1);
+            /*
+             * We need one extra place for the packet header, and two for
+             * the size table and the data of the XBZRLE pages
+             */
+            p->iov = g_new0(struct iovec, page_count + 3);
         } else {
             p->iov = g_new0(struct iovec, page_count);
         }
+        p->zero_bmap = bitmap_new(page_count);
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->page_size = qemu_target_page_size();
         p->page_count = page_count;
         p->write_flags = 0;
+        if (migrate_xbzrle()) {
+            p->xbzrle_buf = g_malloc(page_count *
+                                     (sizeof(uint32_t) + p->page_size));
+            p->xbzrle_offset = g_new0(ram_addr_t, page_count);
+            p->xbzrle_page = g_malloc(p->page_size);
+        }
 
         if (!multifd_new_send_channel_create(p, &local_err)) {
             return false;
@@ -1204,13 +1490,12 @@ bool multifd_send_setup(void)
         qemu_sem_wait(&multifd_send_state->channels_created);
     }
 
-    for (i = 0; i < thread_count; i++) {
+    ret = multifd_xbzrle_setup(thread_count, &local_err);
+
+    for (i = 0; !ret && i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         ret = multifd_send_state->ops->send_setup(p, &local_err);
-        if (ret) {
-            break;
-        }
     }
 
     if (ret) {
@@ -1285,6 +1570,8 @@ static void multifd_recv_terminate_threads(Error *err)
         return;
     }
 
+    multifd_device_state_recv_kick();
+
     if (err) {
         MigrationState *s = migrate_get_current();
         migrate_set_error(s, err);
@@ -1357,8 +1644,17 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->iov = NULL;
     g_free(p->normal);
     p->normal = NULL;
+    g_free(p->raw);
+    p->raw = NULL;
+    g_free(p->xbzrle);
+    p->xbzrle = NULL;
+    g_free(p->xbzrle_buf);
+    p->xbzrle_buf = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_free(p->data->bitmap);
+    g_free(p->data);
+    p->data = NULL;
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
@@ -1367,8 +1663,10 @@ static void multifd_recv_cleanup_state(void)
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
+    g_free(multifd_recv_state->data->bitmap);
     g_free(multifd_recv_state->data);
     multifd_recv_state->data = NULL;
+    multifd_device_state_recv_cleanup();
     g_free(multifd_recv_state);
     multifd_recv_state = NULL;
 }
@@ -1470,6 +1768,8 @@ static void *multifd_recv_thread(void *opaque)
         uint32_t flags = 0;
         bool has_data = false;
         p->normal_num = 0;
+        p->raw_num = 0;
+        p->xbzrle_num = 0;
 
         if (use_packets) {
             if (multifd_recv_should_exit()) {
@@ -1492,8 +1792,17 @@ static void *multifd_recv_thread(void *opaque)
             flags = p->flags;
             /* recv methods don't know how to handle the SYNC flag */
             p->flags &= ~MULTIFD_FLAG_SYNC;
-            has_data = p->normal_num || p->zero_num;
+            has_data = p->normal_num || p->raw_num || p->xbzrle_num ||
+                       p->zero_num;
             qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_DEVICE_STATE) {
+                ret = multifd_recv_device_state(p, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+                continue;
+            }
         } else {
             /*
              * No packets, so we need to wait for the vmstate code to
@@ -1527,6 +1836,20 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (p->raw_num) {
+            ret = multifd_recv_raw_page_process(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
+        if (p->xbzrle_num) {
+            ret = multifd_recv_xbzrle_page_process(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
         if (use_packets) {
             if (flags & MULTIFD_FLAG_SYNC) {
                 qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1583,6 +1906,9 @@ int multifd_recv_setup(Error **errp)
     qatomic_set(&multifd_recv_state->exiting, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
+    if (use_packets) {
+        multifd_device_state_recv_setup();
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1604,6 +1930,8 @@ int multifd_recv_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->raw = g_new0(ram_addr_t, page_count);
+        p->xbzrle = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
         p->page_count = page_count;
         p->page_size = qemu_target_page_size();
@@ -1682,14 +2010,19 @@ void multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
 
 bool multifd_send_prepare_common(MultiFDSendParams *p)
 {
+    /*
+     * The header needs to be sent even if there are no normal pages,
+     * it carries the zero and raw pages of the packet.
+     */
+    multifd_send_prepare_header(p);
     multifd_send_zero_page_detect(p);
+    multifd_send_xbzrle_page_detect(p);
+    multifd_send_raw_page_detect(p);
 
     if (!p->pages->normal_num) {
         p->next_packet_size = 0;
         return false;
     }
 
-    multifd_send_prepare_header(p);
-
     return true;
 }
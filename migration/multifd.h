@@ -28,6 +28,9 @@ void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 int multifd_send_sync_main(void);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+bool multifd_device_state_active(void);
+bool multifd_send_device_state(uint32_t id, uint8_t *data, size_t size);
+uint8_t *multifd_device_state_get(uint32_t id, size_t *size);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
@@ -40,6 +43,19 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+
+/* Some normal pages of the packet are sent without compression */
+#define MULTIFD_FLAG_RAW (1 << 4)
+
+/* Some pages of the packet are XBZRLE encoded */
+#define MULTIFD_FLAG_XBZRLE (1 << 5)
+
+/* The packet carries device state instead of pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 6)
+
+/* Maximum size of a batch of device state */
+#define MULTIFD_DEVICE_STATE_MAX_SIZE (1U << 30)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -57,12 +73,21 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
-    uint64_t unused64[3];    /* Reserved for future use */
+    /* normal pages sent without compression, only with MULTIFD_FLAG_RAW */
+    uint32_t raw_pages;
+    /* XBZRLE pages and size of their data, only with MULTIFD_FLAG_XBZRLE */
+    uint32_t xbzrle_pages;
+    uint32_t xbzrle_size;
+    /* id and size of the device state, only with MULTIFD_FLAG_DEVICE_STATE */
+    uint32_t device_state_id;
+    uint32_t device_state_size;
+    uint64_t unused64[1];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
+     *  - raw pages (following raw_pages entries)
+     *  - XBZRLE pages (following xbzrle_pages entries)
      *  - zero pages (following zero_pages entries)
      */
     uint64_t offset[];
@@ -73,6 +98,10 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of normal pages sent without compression */
+    uint32_t raw_num;
+    /* number of XBZRLE encoded pages */
+    uint32_t xbzrle_num;
     /* number of allocated pages */
     uint32_t allocated;
     /* offset of each page */
@@ -85,8 +114,23 @@ struct MultiFDRecvData {
     size_t size;
     /* for preadv */
     off_t file_offset;
+    /*
+     * mapped-ram: pages of the range starting at @opaque and
+     * @file_offset that are present in the file, one bit per page.
+     * Pages not present were zero on the source and are not read.
+     */
+    unsigned long *bitmap;
+    unsigned long num_pages;
 };
 
+typedef struct {
+    /* id of the device state in the migration stream */
+    uint32_t id;
+    /* device state to send, NULL if the job is about pages */
+    uint8_t *data;
+    size_t size;
+} MultiFDDeviceState;
+
 typedef struct {
     /* Fields are only written at creating/deletion time */
     /* No lock required for them, they are read only */
@@ -135,6 +179,8 @@ typedef struct {
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /* device state to send, owned the same way as 'pages' */
+    MultiFDDeviceState device_state;
 
     /* thread local variables. No locking required */
 
@@ -148,6 +194,20 @@ typedef struct {
     uint64_t total_normal_pages;
     /* zero pages sent through this channel */
     uint64_t total_zero_pages;
+    /* pages sent without compression through this channel */
+    uint64_t total_raw_pages;
+    /* zero pages found by the last zero page detection, one bit per page */
+    unsigned long *zero_bmap;
+    /* XBZRLE size table followed by the data of the pages */
+    uint8_t *xbzrle_buf;
+    /* size of the XBZRLE table and data in the packet */
+    uint32_t xbzrle_size;
+    /* size of the XBZRLE data in the packet */
+    uint32_t xbzrle_data_size;
+    /* offsets of the XBZRLE pages while they are being encoded */
+    ram_addr_t *xbzrle_offset;
+    /* copy of the page being encoded */
+    uint8_t *xbzrle_page;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
@@ -214,6 +274,18 @@ typedef struct {
     ram_addr_t *normal;
     /* num of non zero pages */
     uint32_t normal_num;
+    /* Pages that are not zero and were sent without compression */
+    ram_addr_t *raw;
+    /* num of raw pages */
+    uint32_t raw_num;
+    /* Pages that are XBZRLE encoded */
+    ram_addr_t *xbzrle;
+    /* num of XBZRLE pages */
+    uint32_t xbzrle_num;
+    /* size of the XBZRLE table and data */
+    uint32_t xbzrle_size;
+    /* buffer for the XBZRLE table and data */
+    uint8_t *xbzrle_buf;
     /* Pages that are zero */
     ram_addr_t *zero;
     /* num of zero pages */
@@ -241,8 +313,24 @@ void multifd_register_ops(int method, MultiFDMethods *ops);
 void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
+void multifd_send_raw_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+int multifd_xbzrle_setup(int channels, Error **errp);
+void multifd_xbzrle_cleanup(void);
+void multifd_xbzrle_start(void);
+int multifd_xbzrle_cache_resize(uint64_t new_size, Error **errp);
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
+void multifd_send_xbzrle_page_detect(MultiFDSendParams *p);
+void multifd_send_prepare_xbzrle_iovs(MultiFDSendParams *p);
+int multifd_recv_xbzrle_page_process(MultiFDRecvParams *p, Error **errp);
+
+int multifd_send_device_state_packet(MultiFDSendParams *p, Error **errp);
+void multifd_device_state_recv_setup(void);
+void multifd_device_state_recv_cleanup(void);
+void multifd_device_state_recv_kick(void);
+int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp);
+
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
     p->iov[0].iov_len = p->packet_len;
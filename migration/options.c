@@ -57,6 +57,11 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+/* 1: best compress ratio, ... 100: best speed */
+#define DEFAULT_MIGRATE_MULTIFD_LZ4_LEVEL 1
+
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 1
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 0
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -126,6 +131,9 @@ Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("multifd-lz4-level", MigrationState,
+                      parameters.multifd_lz4_level,
+                      DEFAULT_MIGRATE_MULTIFD_LZ4_LEVEL),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -162,6 +170,12 @@ Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT32("postcopy-prefetch-pages", MigrationState,
+                       parameters.postcopy_prefetch_pages,
+                       DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -186,6 +200,12 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-multifd-adaptive-compression",
+                        MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_COMPRESSION),
+    DEFINE_PROP_MIG_CAP("x-postpone-hot-pages",
+                        MIGRATION_CAPABILITY_POSTPONE_HOT_PAGES),
+    DEFINE_PROP_MIG_CAP("x-multifd-device-state",
+                        MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -259,6 +279,20 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_adaptive_compression(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_COMPRESSION];
+}
+
+bool migrate_multifd_device_state(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -280,6 +314,13 @@ bool migrate_postcopy_preempt(void)
     return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
 }
 
+bool migrate_postpone_hot_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_POSTPONE_HOT_PAGES];
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -571,11 +612,18 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
-    if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
-        if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
-            error_setg(errp, "Multifd is not compatible with xbzrle");
-            return false;
-        }
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_ADAPTIVE_COMPRESSION] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Capability 'multifd-adaptive-compression' requires "
+                   "capability 'multifd'");
+        return false;
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE] &&
+        !new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Capability 'multifd-device-state' requires "
+                   "capability 'multifd'");
+        return false;
     }
 
     if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
@@ -590,6 +638,12 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
                        "Mapped-ram migration is incompatible with postcopy");
             return false;
         }
+
+        if (new_caps[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE]) {
+            error_setg(errp, "Mapped-ram migration is incompatible with "
+                       "multifd-device-state");
+            return false;
+        }
     }
 
     return true;
@@ -775,6 +829,13 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_multifd_lz4_level(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.multifd_lz4_level;
+}
+
 uint8_t migrate_throttle_trigger_threshold(void)
 {
     MigrationState *s = migrate_get_current();
@@ -824,6 +885,20 @@ ZeroPageDetection migrate_zero_page_detection(void)
     return s->parameters.zero_page_detection;
 }
 
+uint8_t migrate_dirty_sync_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
+uint32_t migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
 /* parameters helpers */
 
 AnnounceParameters *migrate_announce_params(void)
@@ -875,6 +950,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_multifd_lz4_level = true;
+    params->multifd_lz4_level = s->parameters.multifd_lz4_level;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -905,6 +982,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->mode = s->parameters.mode;
     params->has_zero_page_detection = true;
     params->zero_page_detection = s->parameters.zero_page_detection;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
+    params->has_postcopy_prefetch_pages = true;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
 
     return params;
 }
@@ -926,6 +1007,7 @@ void migrate_params_init(MigrationParameters *params)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_multifd_lz4_level = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -937,6 +1019,8 @@ void migrate_params_init(MigrationParameters *params)
     params->has_vcpu_dirty_limit = true;
     params->has_mode = true;
     params->has_zero_page_detection = true;
+    params->has_dirty_sync_threads = true;
+    params->has_postcopy_prefetch_pages = true;
 }
 
 /*
@@ -1023,6 +1107,13 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_lz4_level &&
+        (params->multifd_lz4_level < 1 || params->multifd_lz4_level > 100)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_lz4_level",
+                   "a value between 1 and 100");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1110,6 +1201,20 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads < 1 || params->dirty_sync_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "dirty_sync_threads",
+                   "a value between 1 and 64");
+        return false;
+    }
+
+    if (params->has_postcopy_prefetch_pages &&
+        params->postcopy_prefetch_pages > 1024) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages", "a value between 0 and 1024");
+        return false;
+    }
+
     return true;
 }
 
@@ -1174,6 +1279,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_zstd_level) {
         dest->multifd_zstd_level = params->multifd_zstd_level;
     }
+    if (params->has_multifd_lz4_level) {
+        dest->multifd_lz4_level = params->multifd_lz4_level;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1216,6 +1324,14 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_zero_page_detection) {
         dest->zero_page_detection = params->zero_page_detection;
     }
+
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
+
+    if (params->has_postcopy_prefetch_pages) {
+        dest->postcopy_prefetch_pages = params->postcopy_prefetch_pages;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1290,6 +1406,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_zstd_level) {
         s->parameters.multifd_zstd_level = params->multifd_zstd_level;
     }
+    if (params->has_multifd_lz4_level) {
+        s->parameters.multifd_lz4_level = params->multifd_lz4_level;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1341,6 +1460,14 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_zero_page_detection) {
         s->parameters.zero_page_detection = params->zero_page_detection;
     }
+
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
+
+    if (params->has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages = params->postcopy_prefetch_pages;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -105,13 +105,30 @@
 #define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
 
 /*
- * When doing mapped-ram migration, this is the amount we read from
- * the pages region in the migration file at a time.
+ * When doing mapped-ram migration without multifd, this is the amount
+ * we read from the pages region in the migration file at a time.
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
+/*
+ * When doing mapped-ram migration with multifd, this is the maximum
+ * number of pages handed to a channel at a time.  Every channel reads
+ * the pages of its range that are present in the file on its own.
+ */
+#define MAPPED_RAM_LOAD_RANGE_PAGES 0x4000
+
 XBZRLECacheStats xbzrle_counters;
 
+/*
+ * Hot page predictor: a region of the dirty bitmap is considered hot
+ * once this many consecutive bitmap syncs found it dirty again after
+ * some of its pages were sent.
+ */
+#define HOT_PAGE_SCORE_THRESHOLD 2
+#define HOT_PAGE_SCORE_MAX 16
+
+HotPageStats hot_page_counters;
+
 /* used by the search for pages to send */
 struct PageSearchStatus {
     /* The migration channel used for a specific host page */
@@ -204,6 +221,7 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
+    ret = multifd_xbzrle_cache_resize(new_size, errp);
 out:
     XBZRLE_cache_unlock();
     return ret;
@@ -351,6 +369,37 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/*
+ * Size of the chunks of a RAMBlock that are synchronized in parallel.
+ * It must be a multiple of BITS_PER_LONG pages so that two chunks never
+ * share a word of the migration bitmap.
+ */
+#define DIRTY_SYNC_CHUNK_SIZE (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+    /* new dirty pages found in the chunk */
+    uint64_t num_dirty;
+} DirtySyncJob;
+
+/* Helper threads used to synchronize the dirty bitmap in parallel */
+typedef struct {
+    QemuThread *threads;
+    int num_threads;
+    /* posted once per helper thread to start a synchronization */
+    QemuSemaphore sem;
+    /* posted by each helper thread once there is no job left */
+    QemuSemaphore done_sem;
+    DirtySyncJob *jobs;
+    unsigned int num_jobs;
+    unsigned int jobs_allocated;
+    /* index of the next job to pick, accessed atomically */
+    unsigned int next_job;
+    bool quit;
+} DirtySyncPool;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -387,6 +436,10 @@ struct RAMState {
     bool xbzrle_started;
     /* Are we on the last stage of migration */
     bool last_stage;
+    /* Are hot regions skipped when searching for dirty pages */
+    bool hot_page_postpone;
+    /* Helper threads for the dirty bitmap sync, NULL if serial */
+    DirtySyncPool *dirty_sync_pool;
 
     /* total handled target pages at the beginning of period */
     uint64_t target_page_count_prev;
@@ -403,6 +456,19 @@ struct RAMState {
     QemuMutex bitmap_mutex;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
+    /*
+     * Postcopy fault pattern detection, only used with postcopy preempt.
+     * Protected by the bitmap_mutex.
+     */
+    RAMBlock *fault_rb;
+    /* Host page of the last fault */
+    int64_t fault_page;
+    /* Distance in host pages between the last two faults */
+    int64_t fault_stride;
+    /* Number of consecutive faults that followed fault_stride */
+    unsigned int fault_streak;
+    /* Number of pages prefetched after the last fault */
+    uint32_t fault_prefetched;
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
@@ -698,6 +764,11 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+static inline bool ramblock_page_is_hot(RAMBlock *rb, unsigned long page)
+{
+    return rb->hot_score[page / BITS_PER_LONG] >= HOT_PAGE_SCORE_THRESHOLD;
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -731,6 +802,19 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
+
+    /*
+     * Skip the regions predicted to be dirtied again, they will be sent
+     * in the final stage.  Never skip part of a host page being sent.
+     */
+    if (ram_state->hot_page_postpone && rb->hot_score &&
+        !pss->host_page_sending && !migration_in_postcopy()) {
+        while (pss->page < size && ramblock_page_is_hot(rb, pss->page)) {
+            pss->page = find_next_bit(bitmap, size,
+                                      QEMU_ALIGN_UP(pss->page + 1,
+                                                    BITS_PER_LONG));
+        }
+    }
 }
 
 static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
@@ -832,6 +916,9 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     ret = test_and_clear_bit(page, rb->bmap);
     if (ret) {
         rs->migration_dirty_pages--;
+        if (rb->hot_sent_bmap) {
+            set_bit(page, rb->hot_sent_bmap);
+        }
     }
 
     return ret;
@@ -912,6 +999,49 @@ bool ramblock_page_is_discarded(RAMBlock *rb, ram_addr_t start)
     return false;
 }
 
+/*
+ * ramblock_hot_page_update: update the hot page predictor after a sync
+ *
+ * Every region in which pages sent since the previous sync got dirty
+ * again sees its score increased, the other regions with sent pages are
+ * reset.  Returns the number of dirty pages in hot regions.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ *
+ * @rb: RAMBlock whose dirty bitmap was just synchronized
+ */
+static uint64_t ramblock_hot_page_update(RAMBlock *rb)
+{
+    unsigned long regions = BITS_TO_LONGS(rb->used_length >> TARGET_PAGE_BITS);
+    uint64_t hot_pages = 0;
+    unsigned long i;
+
+    for (i = 0; i < regions; i++) {
+        if (!rb->hot_sent_bmap[i]) {
+            continue;
+        }
+
+        /* Pages that are dirty but were never sent do not count */
+        hot_page_counters.checks++;
+        if (rb->bmap[i] & rb->hot_sent_bmap[i]) {
+            hot_page_counters.hits++;
+            rb->hot_score[i] = MIN(rb->hot_score[i] + 1, HOT_PAGE_SCORE_MAX);
+        } else {
+            rb->hot_score[i] = 0;
+        }
+    }
+    bitmap_zero(rb->hot_sent_bmap, rb->used_length >> TARGET_PAGE_BITS);
+
+    for (i = 0; i < regions; i++) {
+        if (rb->hot_score[i] >= HOT_PAGE_SCORE_THRESHOLD) {
+            hot_page_counters.hot_regions++;
+            hot_pages += ctpopl(rb->bmap[i]);
+        }
+    }
+
+    return hot_pages;
+}
+
 /* Called with RCU critical section */
 static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 {
@@ -922,6 +1052,131 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+static void dirty_sync_run_jobs(DirtySyncPool *pool)
+{
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&pool->next_job)) < pool->num_jobs) {
+        DirtySyncJob *job = &pool->jobs[i];
+
+        job->num_dirty = cpu_physical_memory_sync_dirty_bitmap(job->block,
+                                                               job->start,
+                                                               job->length);
+    }
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncPool *pool = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&pool->sem);
+        if (qatomic_read(&pool->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            dirty_sync_run_jobs(pool);
+        }
+        qemu_sem_post(&pool->done_sem);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void dirty_sync_pool_add_job(DirtySyncPool *pool, RAMBlock *rb,
+                                    ram_addr_t start, ram_addr_t length)
+{
+    DirtySyncJob *job;
+
+    if (pool->num_jobs == pool->jobs_allocated) {
+        pool->jobs_allocated = MAX(pool->jobs_allocated * 2, 16);
+        pool->jobs = g_renew(DirtySyncJob, pool->jobs, pool->jobs_allocated);
+    }
+    job = &pool->jobs[pool->num_jobs++];
+    job->block = rb;
+    job->start = start;
+    job->length = length;
+    job->num_dirty = 0;
+}
+
+static DirtySyncPool *dirty_sync_pool_create(int num_threads)
+{
+    DirtySyncPool *pool = g_new0(DirtySyncPool, 1);
+    int i;
+
+    qemu_sem_init(&pool->sem, 0);
+    qemu_sem_init(&pool->done_sem, 0);
+    pool->num_threads = num_threads;
+    pool->threads = g_new0(QemuThread, num_threads);
+    for (i = 0; i < num_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "mig/src/dirtysync",
+                           dirty_sync_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+
+    return pool;
+}
+
+static void dirty_sync_pool_destroy(DirtySyncPool *pool)
+{
+    int i;
+
+    qatomic_set(&pool->quit, true);
+    for (i = 0; i < pool->num_threads; i++) {
+        qemu_sem_post(&pool->sem);
+    }
+    for (i = 0; i < pool->num_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    qemu_sem_destroy(&pool->sem);
+    qemu_sem_destroy(&pool->done_sem);
+    g_free(pool->threads);
+    g_free(pool->jobs);
+    g_free(pool);
+}
+
+/*
+ * Synchronize the dirty bitmap of all RAMBlocks, splitting them in
+ * chunks that are processed by the helper threads and the calling
+ * thread.  Called with RCU critical section and bitmap_mutex held.
+ */
+static void ramblock_sync_dirty_bitmap_parallel(RAMState *rs)
+{
+    DirtySyncPool *pool = rs->dirty_sync_pool;
+    uint64_t new_dirty_pages = 0;
+    RAMBlock *block;
+    unsigned int i;
+
+    pool->num_jobs = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += DIRTY_SYNC_CHUNK_SIZE) {
+            dirty_sync_pool_add_job(pool, block, start,
+                                    MIN(DIRTY_SYNC_CHUNK_SIZE,
+                                        block->used_length - start));
+        }
+    }
+    qatomic_set(&pool->next_job, 0);
+
+    for (i = 0; i < pool->num_threads; i++) {
+        qemu_sem_post(&pool->sem);
+    }
+    dirty_sync_run_jobs(pool);
+    for (i = 0; i < pool->num_threads; i++) {
+        qemu_sem_wait(&pool->done_sem);
+    }
+
+    for (i = 0; i < pool->num_jobs; i++) {
+        new_dirty_pages += pool->jobs[i].num_dirty;
+    }
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1057,12 +1312,41 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
+            uint64_t hot_pages = 0;
+
+            hot_page_counters.hot_regions = 0;
+            if (rs->dirty_sync_pool) {
+                ramblock_sync_dirty_bitmap_parallel(rs);
+            }
             RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
+                if (!rs->dirty_sync_pool) {
+                    ramblock_sync_dirty_bitmap(rs, block);
+                }
+                if (block->hot_score) {
+                    hot_pages += ramblock_hot_page_update(block);
+                }
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
+
+            /*
+             * Only postpone the hot pages if they can all be sent within
+             * the downtime limit, otherwise migration could never
+             * converge.
+             */
+            rs->hot_page_postpone = migrate_postpone_hot_pages() &&
+                !last_stage && !migration_in_postcopy() &&
+                hot_pages * TARGET_PAGE_SIZE <
+                migrate_get_current()->threshold_size;
+            hot_page_counters.postponed_pages =
+                rs->hot_page_postpone ? hot_pages : 0;
+            if (hot_page_counters.checks) {
+                hot_page_counters.hit_rate = (double)hot_page_counters.hits /
+                                             hot_page_counters.checks;
+            }
         }
     }
+    trace_migration_bitmap_sync_hot_pages(hot_page_counters.hot_regions,
+                                          hot_page_counters.postponed_pages);
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
@@ -1159,7 +1443,9 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
      * Must let xbzrle know, otherwise a previous (now 0'd) cached
      * page would be stale.
      */
-    if (rs->xbzrle_started) {
+    if (migrate_multifd()) {
+        multifd_xbzrle_cache_zero_page(pss->block->offset + offset);
+    } else if (rs->xbzrle_started) {
         XBZRLE_cache_lock();
         xbzrle_cache_zero_page(pss->block->offset + offset);
         XBZRLE_cache_unlock();
@@ -1344,6 +1630,7 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
             /* After the first round, enable XBZRLE. */
             if (migrate_xbzrle()) {
                 rs->xbzrle_started = true;
+                multifd_xbzrle_start();
             }
         }
         /* Didn't find anything this time, but try again on the new block */
@@ -1869,6 +2156,83 @@ static void migration_page_queue_free(RAMState *rs)
     }
 }
 
+/**
+ * ram_postcopy_prefetch: push the pages that are likely to fault next
+ *
+ * Called after a page requested by the destination has been sent on the
+ * preempt channel.  When the last faults hit pages at a constant
+ * distance from each other, the next pages along that stride are sent
+ * right away so that the guest doesn't need a round trip to get them.
+ * The window starts at one page and doubles with every fault that
+ * follows the pattern, up to the postcopy-prefetch-pages parameter.
+ *
+ * Faults on pages that were already prefetched never reach the source,
+ * so a fault up to fault_prefetched + 1 strides away still follows the
+ * pattern.
+ *
+ * Must be called with the bitmap_mutex held.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @rs: current RAM state
+ * @pss: PSS of the postcopy channel
+ * @rb: RAMBlock of the fault
+ * @start: offset of the faulting host page in @rb
+ * @errp: pointer to an error
+ */
+static int ram_postcopy_prefetch(RAMState *rs, PageSearchStatus *pss,
+                                 RAMBlock *rb, ram_addr_t start,
+                                 Error **errp)
+{
+    uint32_t window = migrate_postcopy_prefetch_pages();
+    size_t page_size = qemu_ram_pagesize(rb);
+    int64_t page = start / page_size;
+    int64_t delta = page - rs->fault_page;
+    int64_t stride = rs->fault_stride;
+    uint32_t count, i;
+
+    if (!window) {
+        return 0;
+    }
+
+    if (rb != rs->fault_rb || !stride || delta % stride ||
+        delta / stride <= 0 || delta / stride > rs->fault_prefetched + 1) {
+        /* Not following the pattern, start over from this fault */
+        rs->fault_stride = rb == rs->fault_rb ? delta : 0;
+        rs->fault_rb = rb;
+        rs->fault_page = page;
+        rs->fault_streak = 0;
+        rs->fault_prefetched = 0;
+        return 0;
+    }
+
+    rs->fault_page = page;
+    rs->fault_streak = MIN(rs->fault_streak + 1, 31);
+    count = MIN(window, 1U << (rs->fault_streak - 1));
+
+    for (i = 1; i <= count; i++) {
+        int64_t next = page + i * stride;
+
+        if (next < 0 || !offset_in_ramblock(rb, next * page_size)) {
+            break;
+        }
+
+        pss_init(pss, rb, (next * page_size) >> TARGET_PAGE_BITS);
+        /* Pages that were already sent are clean and skipped here */
+        if (ram_save_host_page_urgent(pss)) {
+            error_setg(errp, "ram_save_host_page_urgent() failed: "
+                       "ramblock=%s, start_addr=0x%" PRIx64,
+                       rb->idstr, (uint64_t)(next * page_size));
+            return -1;
+        }
+    }
+    rs->fault_prefetched = i - 1;
+    trace_ram_postcopy_prefetch(rb->idstr, start, stride,
+                                rs->fault_prefetched);
+
+    return 0;
+}
+
 /**
  * ram_save_queue_pages: queue the page for transmission
  *
@@ -1966,6 +2330,10 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
              */
             len -= page_size;
         };
+
+        if (!ret) {
+            ret = ram_postcopy_prefetch(rs, pss, ramblock, start, errp);
+        }
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         return ret;
@@ -2327,6 +2695,9 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        if ((*rsp)->dirty_sync_pool) {
+            dirty_sync_pool_destroy((*rsp)->dirty_sync_pool);
+        }
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2362,6 +2733,10 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->hot_sent_bmap);
+        block->hot_sent_bmap = NULL;
+        g_free(block->hot_score);
+        block->hot_score = NULL;
     }
 }
 
@@ -2641,7 +3016,8 @@ int ram_discard_range(const char *rbname, uint64_t start, size_t length)
  */
 static bool xbzrle_init(Error **errp)
 {
-    if (!migrate_xbzrle()) {
+    /* With multifd, the cache is split between the channels */
+    if (!migrate_xbzrle() || migrate_multifd()) {
         return true;
     }
 
@@ -2721,6 +3097,8 @@ static void ram_list_init_bitmaps(void)
     unsigned long pages;
     uint8_t shift;
 
+    memset(&hot_page_counters, 0, sizeof(hot_page_counters));
+
     /* Skip setting bitmap if there is no RAM */
     if (ram_bytes_total()) {
         shift = ms->clear_bitmap_shift;
@@ -2752,6 +3130,10 @@ static void ram_list_init_bitmaps(void)
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_postpone_hot_pages()) {
+                block->hot_sent_bmap = bitmap_new(pages);
+                block->hot_score = g_new0(uint8_t, BITS_TO_LONGS(pages));
+            }
         }
     }
 }
@@ -2813,6 +3195,12 @@ static int ram_init_all(RAMState **rsp, Error **errp)
         return -1;
     }
 
+    /* The migration thread takes part in the sync too */
+    if (migrate_dirty_sync_threads() > 1) {
+        (*rsp)->dirty_sync_pool =
+            dirty_sync_pool_create(migrate_dirty_sync_threads() - 1);
+    }
+
     if (!ram_init_bitmaps(*rsp, errp)) {
         return -1;
     }
@@ -3242,15 +3630,21 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState **temp = opaque;
     RAMState *rs = *temp;
+    int64_t start_us;
     int ret = 0;
 
     rs->last_stage = !migration_in_colo_state();
 
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
+            start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
             migration_bitmap_sync_precopy(rs, true);
+            migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_BITMAP_SYNC,
+                                         start_us);
         }
 
+        start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
         ret = rdma_registration_start(f, RAM_CONTROL_FINISH);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -3287,6 +3681,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     if (ret < 0) {
         return ret;
     }
+    migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_RAM_FLUSH, start_us);
 
     if (migrate_mapped_ram()) {
         ram_save_file_bmap(f);
@@ -3316,6 +3711,17 @@ static void ram_state_pending_estimate(void *opaque, uint64_t *must_precopy,
 
     uint64_t remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
+    /*
+     * Postponed hot pages won't be sent before the final stage, leave them
+     * out of the estimate so that an exact count (and thus a new bitmap
+     * sync) is done once everything else was sent.
+     */
+    if (rs->hot_page_postpone) {
+        remaining_size -= MIN(remaining_size,
+                              hot_page_counters.postponed_pages *
+                              TARGET_PAGE_SIZE);
+    }
+
     if (migrate_postcopy_ram()) {
         /* We can do postcopy, and all the data is postcopiable */
         *can_postcopy += remaining_size;
@@ -3894,20 +4300,54 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
-static size_t ram_load_multifd_pages(void *host_addr, size_t size,
-                                     uint64_t offset)
+/*
+ * Split the bitmap of @block in ranges that are loaded in parallel by
+ * the multifd channels.  Ranges without any page present in the file
+ * are skipped altogether.
+ */
+static bool ram_load_multifd_ramblock(RAMBlock *block, long num_pages,
+                                      unsigned long *bitmap, Error **errp)
 {
-    MultiFDRecvData *data = multifd_get_recv_data();
+    unsigned long range, start;
+
+    if (num_pages > block->used_length >> TARGET_PAGE_BITS) {
+        error_setg(errp, "(%s) %ld pages outside of ramblock range",
+                   block->idstr, num_pages);
+        return false;
+    }
 
-    data->opaque = host_addr;
-    data->file_offset = offset;
-    data->size = size;
+    /* Give every channel a share of the block, even for small ones */
+    range = DIV_ROUND_UP(num_pages, migrate_multifd_channels());
+    range = MIN(ROUND_UP(range, BITS_PER_LONG), MAPPED_RAM_LOAD_RANGE_PAGES);
 
-    if (!multifd_recv()) {
-        return 0;
+    for (start = 0; start < num_pages; start += range) {
+        unsigned long pages = MIN(range, num_pages - start);
+        long populated = bitmap_count_one_with_offset(bitmap, start, pages);
+        MultiFDRecvData *data;
+
+        if (!populated) {
+            continue;
+        }
+
+        data = multifd_get_recv_data();
+        if (!data->bitmap) {
+            data->bitmap = bitmap_new(MAPPED_RAM_LOAD_RANGE_PAGES);
+        }
+        bitmap_copy_with_src_offset(data->bitmap, bitmap, start, pages);
+        data->num_pages = pages;
+        data->opaque = block->host + ((ram_addr_t)start << TARGET_PAGE_BITS);
+        data->file_offset = block->pages_offset +
+                            ((ram_addr_t)start << TARGET_PAGE_BITS);
+        data->size = (size_t)populated << TARGET_PAGE_BITS;
+
+        if (!multifd_recv()) {
+            error_setg(errp, "(%s) failed to queue pages to multifd channels",
+                       block->idstr);
+            return false;
+        }
     }
 
-    return size;
+    return true;
 }
 
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
@@ -3920,6 +4360,10 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
     void *host;
     size_t read, unread, size;
 
+    if (migrate_multifd()) {
+        return ram_load_multifd_ramblock(block, num_pages, bitmap, errp);
+    }
+
     for (set_bit_idx = find_first_bit(bitmap, num_pages);
          set_bit_idx < num_pages;
          set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
@@ -3938,15 +4382,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
             }
 
             size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
-
-            if (migrate_multifd()) {
-                read = ram_load_multifd_pages(host, size,
-                                              block->pages_offset + offset);
-            } else {
-                read = qemu_get_buffer_at(f, host, size,
-                                          block->pages_offset + offset);
-            }
-
+            read = qemu_get_buffer_at(f, host, size,
+                                      block->pages_offset + offset);
             if (!read) {
                 goto err;
             }
@@ -34,6 +34,7 @@
 #include "io/channel.h"
 
 extern XBZRLECacheStats xbzrle_counters;
+extern HotPageStats hot_page_counters;
 
 /* Should be holding either ram_list.mutex, or the RCU lock. */
 #define RAMBLOCK_FOREACH_NOT_IGNORED(block)            \
@@ -68,6 +68,7 @@
 #include "yank_functions.h"
 #include "sysemu/qtest.h"
 #include "options.h"
+#include "multifd.h"
 
 const unsigned int postcopy_ram_discard_version;
 
@@ -90,6 +91,8 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_MULTIFD_DEVICE_STATE, /* Load device state sent on multifd */
+    MIG_CMD_MULTIFD_DEVICE_STATE_SYNC, /* All device state sent on multifd */
     MIG_CMD_MAX
 };
 
@@ -109,6 +112,11 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_MULTIFD_DEVICE_STATE] = {
+                                   .len =  4, .name = "MULTIFD_DEVICE_STATE" },
+    [MIG_CMD_MULTIFD_DEVICE_STATE_SYNC] = {
+                                   .len =  0,
+                                   .name = "MULTIFD_DEVICE_STATE_SYNC" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -216,6 +224,9 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Time spent saving/loading the section in the final stage (us) */
+    uint64_t downtime_save_us;
+    uint64_t downtime_load_us;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -1309,6 +1320,43 @@ int qemu_savevm_state_prepare(Error **errp)
     return 0;
 }
 
+static void savevm_downtime_reset(void)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->downtime_save_us = 0;
+        se->downtime_load_us = 0;
+    }
+}
+
+/*
+ * Returns the time spent on each section in the final stage of the last
+ * migration, for query-migrate-downtime-breakdown.
+ */
+MigrationDowntimeSectionList *qemu_savevm_downtime_sections(void)
+{
+    MigrationDowntimeSectionList *head = NULL;
+    MigrationDowntimeSectionList **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        MigrationDowntimeSection *section;
+
+        if (!se->downtime_save_us && !se->downtime_load_us) {
+            continue;
+        }
+        section = g_new0(MigrationDowntimeSection, 1);
+        section->idstr = g_strdup(se->idstr);
+        section->instance_id = se->instance_id;
+        section->save_time = se->downtime_save_us;
+        section->load_time = se->downtime_load_us;
+        QAPI_LIST_APPEND(tail, section);
+    }
+
+    return head;
+}
+
 int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
 {
     ERRP_GUARD();
@@ -1316,6 +1364,8 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
     SaveStateEntry *se;
     int ret = 0;
 
+    savevm_downtime_reset();
+
     json_writer_int64(ms->vmdesc, "page_size", qemu_target_page_size());
     json_writer_start_array(ms->vmdesc, "devices");
 
@@ -1521,6 +1571,7 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             return -1;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->downtime_save_us += end_ts_each - start_ts_each;
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
@@ -1530,6 +1581,95 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+/*
+ * With multifd-device-state, the non-iterable devices are saved into
+ * batches of about MULTIFD_DEVICE_STATE_BATCH_SIZE bytes that are sent on
+ * the multifd channels.  In the main stream, each batch is replaced by a
+ * MIG_CMD_MULTIFD_DEVICE_STATE command with its id, where the destination
+ * loads it like a packaged stream.
+ */
+#define MULTIFD_DEVICE_STATE_BATCH_SIZE (1 * MiB)
+
+typedef struct {
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    /* id of the next batch */
+    uint32_t id;
+} DeviceStateBatch;
+
+static void device_state_batch_open(DeviceStateBatch *batch)
+{
+    batch->bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(batch->bioc),
+                         "migration-device-state-buffer");
+    batch->f = qemu_file_new_output(QIO_CHANNEL(batch->bioc));
+}
+
+static void device_state_batch_close(DeviceStateBatch *batch)
+{
+    if (batch->f) {
+        qemu_fclose(batch->f);
+        batch->f = NULL;
+    }
+    g_clear_pointer(&batch->bioc, object_unref);
+}
+
+/*
+ * Hand the current batch over to multifd and replace it with a
+ * MIG_CMD_MULTIFD_DEVICE_STATE command in @f.  An empty batch is just
+ * dropped.
+ *
+ * Returns 0 on success, -ve on error
+ */
+static int device_state_batch_send(QEMUFile *f, DeviceStateBatch *batch,
+                                   Error **errp)
+{
+    uint8_t *data;
+    size_t size;
+    uint32_t tmp;
+    int ret;
+
+    ret = qemu_fflush(batch->f);
+    if (ret < 0 || !batch->bioc->usage) {
+        device_state_batch_close(batch);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to save device state");
+        }
+        return ret;
+    }
+
+    qemu_put_byte(batch->f, QEMU_VM_EOF);
+    ret = qemu_fclose(batch->f);
+    batch->f = NULL;
+    /* Steal the buffer, multifd frees it once sent */
+    data = g_steal_pointer(&batch->bioc->data);
+    size = batch->bioc->usage;
+    device_state_batch_close(batch);
+    if (ret < 0) {
+        g_free(data);
+        error_setg_errno(errp, -ret, "Failed to save device state");
+        return ret;
+    }
+
+    if (size > MULTIFD_DEVICE_STATE_MAX_SIZE) {
+        g_free(data);
+        error_setg(errp, "Device state too large for multifd: %zu", size);
+        return -EFBIG;
+    }
+
+    trace_qemu_savevm_send_multifd_device_state(batch->id, size);
+    if (!multifd_send_device_state(batch->id, data, size)) {
+        error_setg(errp, "Failed to send device state on multifd");
+        return -EIO;
+    }
+
+    tmp = cpu_to_be32(batch->id++);
+    qemu_savevm_command_send(f, MIG_CMD_MULTIFD_DEVICE_STATE, 4,
+                             (uint8_t *)&tmp);
+
+    return 0;
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
@@ -1540,8 +1680,16 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     int vmdesc_len;
     SaveStateEntry *se;
     Error *local_err = NULL;
+    DeviceStateBatch batch = {};
+    QEMUFile *devf = f;
+    int64_t start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int ret;
 
+    if (!in_postcopy && multifd_device_state_active()) {
+        device_state_batch_open(&batch);
+        devf = batch.f;
+    }
+
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->vmsd && se->vmsd->early_setup) {
             /* Already saved during qemu_savevm_state_setup(). */
@@ -1550,19 +1698,55 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
-        ret = vmstate_save(f, se, vmdesc, &local_err);
+        ret = vmstate_save(devf, se, vmdesc, &local_err);
         if (ret) {
-            migrate_set_error(ms, local_err);
-            error_report_err(local_err);
-            qemu_file_set_error(f, ret);
-            return ret;
+            goto err;
+        }
+
+        if (batch.f) {
+            ret = qemu_fflush(batch.f);
+            if (ret < 0) {
+                error_setg_errno(&local_err, -ret,
+                                 "Failed to save device state");
+                goto err;
+            }
+            if (batch.bioc->usage >= MULTIFD_DEVICE_STATE_BATCH_SIZE) {
+                ret = device_state_batch_send(f, &batch, &local_err);
+                if (ret) {
+                    goto err;
+                }
+                device_state_batch_open(&batch);
+                devf = batch.f;
+            }
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->downtime_save_us += end_ts_each - start_ts_each;
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
 
+    if (batch.f) {
+        ret = device_state_batch_send(f, &batch, &local_err);
+        if (ret) {
+            goto err;
+        }
+        /*
+         * Make sure the device state left before the channels go away.
+         * The destination does the matching multifd_recv_sync_main()
+         * when it sees MIG_CMD_MULTIFD_DEVICE_STATE_SYNC.
+         */
+        if (multifd_send_sync_main() < 0) {
+            error_setg(&local_err, "Failed to flush multifd device state");
+            ret = -EIO;
+            goto err;
+        }
+        qemu_savevm_command_send(f, MIG_CMD_MULTIFD_DEVICE_STATE_SYNC, 0,
+                                 NULL);
+    }
+    migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_VMSTATE_SAVE,
+                                 start_us);
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_activate_all() on the other end won't fail. */
@@ -1598,11 +1782,19 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     trace_vmstate_downtime_checkpoint("src-non-iterable-saved");
 
     return 0;
+
+err:
+    device_state_batch_close(&batch);
+    migrate_set_error(ms, local_err);
+    error_report_err(local_err);
+    qemu_file_set_error(f, ret);
+    return ret;
 }
 
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
+    int64_t start_us;
     int ret;
     Error *local_err = NULL;
     bool in_postcopy = migration_in_postcopy();
@@ -1633,7 +1825,11 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     }
 
 flush:
-    return qemu_fflush(f);
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    ret = qemu_fflush(f);
+    migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_CHANNEL_FLUSH,
+                                 start_us);
+    return ret;
 }
 
 /* Give an estimate of the amount left to be transferred,
@@ -2373,6 +2569,55 @@ static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis)
     return ret;
 }
 
+/*
+ * Load a batch of device state that the source sent on the multifd
+ * channels, waiting for it to arrive if needed.  Payload format:
+ *
+ * id (4 bytes)
+ */
+static int loadvm_handle_cmd_multifd_device_state(MigrationIncomingState *mis,
+                                                  uint32_t id)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *devf;
+    uint8_t *data;
+    size_t size;
+    int ret;
+
+    data = multifd_device_state_get(id, &size);
+    if (!data) {
+        error_report("CMD_MULTIFD_DEVICE_STATE: device state %u not received",
+                     id);
+        return -EINVAL;
+    }
+    trace_loadvm_handle_cmd_multifd_device_state(id, size);
+
+    bioc = qio_channel_buffer_new(0);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-device-state-buffer");
+    bioc->data = data;
+    bioc->capacity = size;
+    bioc->usage = size;
+
+    devf = qemu_file_new_input(QIO_CHANNEL(bioc));
+    ret = qemu_loadvm_state_main(devf, mis);
+    qemu_fclose(devf);
+    object_unref(OBJECT(bioc));
+
+    return ret;
+}
+
+/*
+ * The source sent a SYNC packet on every multifd channel after the last
+ * batch of device state.  All batches have been loaded by now, so this
+ * only consumes the SYNC packets and releases the channels.
+ */
+static int loadvm_handle_cmd_multifd_device_state_sync(void)
+{
+    trace_loadvm_handle_cmd_multifd_device_state_sync();
+    multifd_recv_sync_main();
+    return 0;
+}
+
 /*
  * Handle request that source requests for recved_bitmap on
  * destination. Payload format:
@@ -2525,6 +2770,13 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_RECV_BITMAP:
         return loadvm_handle_recv_bitmap(mis, len);
 
+    case MIG_CMD_MULTIFD_DEVICE_STATE:
+        tmp32 = qemu_get_be32(f);
+        return loadvm_handle_cmd_multifd_device_state(mis, tmp32);
+
+    case MIG_CMD_MULTIFD_DEVICE_STATE_SYNC:
+        return loadvm_handle_cmd_multifd_device_state_sync();
+
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
     }
@@ -2643,6 +2895,9 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
 
     if (trace_downtime) {
         end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->downtime_load_us += end_ts - start_ts;
+        migration_downtime_phase_add(MIGRATION_DOWNTIME_PHASE_DESTINATION_LOAD,
+                                     start_ts);
         trace_vmstate_downtime_load("non-iterable", se->idstr,
                                     se->instance_id, end_ts - start_ts);
     }
@@ -2951,6 +3206,7 @@ out:
 int qemu_loadvm_state(QEMUFile *f)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    MigrationState *ms = migrate_get_current();
     Error *local_err = NULL;
     int ret;
 
@@ -2964,6 +3220,9 @@ int qemu_loadvm_state(QEMUFile *f)
         return ret;
     }
 
+    savevm_downtime_reset();
+    ms->downtime_phases[MIGRATION_DOWNTIME_PHASE_DESTINATION_LOAD] = 0;
+
     if (qemu_loadvm_state_setup(f, &local_err) != 0) {
         error_report_err(local_err);
         return -EINVAL;
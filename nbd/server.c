@@ -101,6 +101,9 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* Next of common.iothread_ctxs to assign to a client, main loop only */
+    unsigned next_iothread;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -133,6 +136,9 @@ struct NBDClient {
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
 
+    /* Where requests run, see nbd_client_aio_context() */
+    AioContext *ctx;
+
     Coroutine *recv_coroutine; /* protected by lock */
 
     CoMutex send_lock;
@@ -157,6 +163,38 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/*
+ * Add @client to the clients of @exp.  If the export has several iothreads,
+ * they are assigned to new clients in turn; each client then runs all its
+ * requests in its own iothread.
+ */
+static void nbd_export_add_client(NBDExport *exp, NBDClient *client)
+{
+    BlockExport *common = &exp->common;
+
+    assert(qemu_in_main_thread());
+
+    client->exp = exp;
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    blk_exp_ref(common);
+
+    if (common->num_iothread_ctxs) {
+        client->ctx = common->iothread_ctxs[exp->next_iothread++ %
+                                            common->num_iothread_ctxs];
+        trace_nbd_export_add_client(exp->name, client->ctx);
+    }
+}
+
+/*
+ * Returns the AioContext where the requests of @client run: its own
+ * iothread if the export has several, otherwise the AioContext of the
+ * export, which may change while the export is drained.
+ */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: nbd_export_aio_context(client->exp);
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -481,6 +519,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
     ERRP_GUARD();
     g_autofree char *name = NULL;
     char buf[NBD_REPLY_EXPORT_NAME_SIZE] = "";
+    NBDExport *exp;
     size_t len;
     int ret;
     uint16_t myflags;
@@ -510,22 +549,22 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
 
     trace_nbd_negotiate_handle_export_name_request(name);
 
-    client->exp = nbd_export_find(name);
-    if (!client->exp) {
+    exp = nbd_export_find(name);
+    if (!exp) {
         error_setg(errp, "export not found");
         return -EINVAL;
     }
-    nbd_check_meta_export(client, client->exp);
+    nbd_check_meta_export(client, exp);
 
-    myflags = client->exp->nbdflags;
+    myflags = exp->nbdflags;
     if (client->mode >= NBD_MODE_STRUCTURED) {
         myflags |= NBD_FLAG_SEND_DF;
     }
     if (client->mode >= NBD_MODE_EXTENDED && client->contexts.count) {
         myflags |= NBD_FLAG_BLOCK_STAT_PAYLOAD;
     }
-    trace_nbd_negotiate_new_style_size_flags(client->exp->size, myflags);
-    stq_be_p(buf, client->exp->size);
+    trace_nbd_negotiate_new_style_size_flags(exp->size, myflags);
+    stq_be_p(buf, exp->size);
     stw_be_p(buf + 8, myflags);
     len = no_zeroes ? 10 : sizeof(buf);
     ret = nbd_write(client->ioc, buf, len, errp);
@@ -534,8 +573,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    blk_exp_ref(&client->exp->common);
+    nbd_export_add_client(exp, client);
 
     return 0;
 }
@@ -748,10 +786,8 @@ nbd_negotiate_handle_info(NBDClient *client, Error **errp)
     }
 
     if (client->opt == NBD_OPT_GO) {
-        client->exp = exp;
         client->check_align = check_align;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        blk_exp_ref(&client->exp->common);
+        nbd_export_add_client(exp, client);
         rc = 1;
     }
     return rc;
@@ -1743,7 +1779,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -2016,6 +2052,7 @@ static void nbd_export_delete(BlockExport *blk_exp)
 const BlockExportDriver blk_exp_nbd = {
     .type               = BLOCK_EXPORT_TYPE_NBD,
     .instance_size      = sizeof(NBDExport),
+    .supports_multithread = true,
     .create             = nbd_export_create,
     .delete             = nbd_export_delete,
     .request_shutdown   = nbd_export_request_shutdown,
@@ -2038,6 +2075,40 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Send the reply header in @iov followed by @size bytes of the export at
+ * @offset, which the block layer moves from the page cache to the socket
+ * without copying them through a buffer.  Returns -ENOTSUP, with nothing
+ * sent, if this is not possible for the client or the export.
+ */
+static int coroutine_fn nbd_co_sendfile(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, uint64_t offset,
+                                        uint64_t size, Error **errp)
+{
+    int ret;
+
+    /* TLS needs the data in a buffer to encrypt it */
+    if (client->ioc != QIO_CHANNEL(client->sioc)) {
+        return -ENOTSUP;
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = blk_co_sendfile(client->exp->common.blk, offset, size,
+                          client->ioc, iov, niov);
+    if (ret < 0 && ret != -ENOTSUP) {
+        error_setg_errno(errp, -ret, "sending data from file failed");
+        ret = -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2072,6 +2143,26 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/*
+ * Like nbd_co_send_simple_reply() for a successful read, with the data sent
+ * by nbd_co_sendfile().  Returns -ENOTSUP if nothing was sent.
+ */
+static int coroutine_fn nbd_co_sendfile_simple_reply(NBDClient *client,
+                                                     NBDRequest *request,
+                                                     Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    assert(client->mode < NBD_MODE_STRUCTURED);
+    set_be_simple_reply(&reply, 0, request->cookie);
+    trace_nbd_co_sendfile(request->cookie, request->from, request->len);
+
+    return nbd_co_sendfile(client, iov, 1, request->from, request->len, errp);
+}
+
 /*
  * Prepare the header of a reply chunk for network transmission.
  *
@@ -2153,6 +2244,35 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 3, errp);
 }
 
+/*
+ * Like nbd_co_send_chunk_read(), with the data sent by nbd_co_sendfile().
+ * Returns -ENOTSUP if nothing was sent.
+ */
+static int coroutine_fn nbd_co_sendfile_chunk_read(NBDClient *client,
+                                                   NBDRequest *request,
+                                                   uint64_t offset,
+                                                   uint64_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    NBDReply hdr;
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &hdr},
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = NULL, .iov_len = size}
+    };
+
+    assert(size && size <= NBD_MAX_BUFFER_SIZE);
+    trace_nbd_co_sendfile(request->cookie, offset, size);
+    set_be_chunk(client, iov, 3, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, request);
+    stq_be_p(&chunk.offset, offset);
+
+    /* The last element only accounts for the data in the chunk length */
+    return nbd_co_sendfile(client, iov, 2, offset, size, errp);
+}
+
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
                                                 NBDRequest *request,
                                                 uint32_t error,
@@ -2230,14 +2350,21 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 2, errp);
         } else {
-            ret = blk_co_pread(exp->common.blk, offset + progress, pnum,
-                               data + progress, 0);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_sendfile_chunk_read(client, request,
+                                             offset + progress, pnum, final,
+                                             errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_co_pread(exp->common.blk, offset + progress, pnum,
+                                   data + progress, 0);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_chunk_read(client, request,
+                                             offset + progress,
+                                             data + progress, pnum, final,
+                                             errp);
             }
-            ret = nbd_co_send_chunk_read(client, request, offset + progress,
-                                         data + progress, pnum, final, errp);
         }
 
         if (ret < 0) {
@@ -2856,6 +2983,18 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len) {
+        if (client->mode >= NBD_MODE_STRUCTURED) {
+            ret = nbd_co_sendfile_chunk_read(client, request, request->from,
+                                             request->len, true, errp);
+        } else {
+            ret = nbd_co_sendfile_simple_reply(client, request, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_co_pread(exp->common.blk, request->from, request->len, data, 0);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request, ret,
@@ -3180,7 +3319,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client),
+                        client->recv_coroutine);
     }
 }
 
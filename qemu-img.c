@@ -24,6 +24,10 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "qemu/help-texts.h"
 #include "qemu/qemu-progress.h"
@@ -54,6 +58,7 @@
 #include "trace/control.h"
 #include "qemu/throttle.h"
 #include "block/throttle-groups.h"
+#include "sysemu/iothread.h"
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_FULL_VERSION \
                           "\n" QEMU_COPYRIGHT "\n"
@@ -86,6 +91,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_IOTHREADS = 278,
 };
 
 typedef enum OutputFormat {
@@ -207,6 +213,8 @@ void help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--iothreads' specifies how many threads run the coroutines (defaults\n"
+           "       to the main thread only)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1687,6 +1695,7 @@ typedef struct ImgConvertState {
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
     bool copy_range;
+    bool copy_range_ok; /* copy offloading succeeded at least once */
     bool salvage;
     bool quiet;
     int min_sparse;
@@ -1695,9 +1704,12 @@ typedef struct ImgConvertState {
     size_t buf_sectors;
     long num_coroutines;
     int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    IOThread **iothreads;
+    long num_iothreads;
+    /* protects the copy position and the progress */
     CoMutex lock;
+    /* coroutines waiting for their turn to write if wr_in_order */
+    CoQueue wr_queue;
     int ret;
 } ImgConvertState;
 
@@ -1969,32 +1981,44 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Copy offloading may work for some chunks only, e.g. not for compressed
+ * clusters, so a failure only disables it if it never worked.
+ */
+static void convert_copy_range_failed(ImgConvertState *s)
+{
+    if (!qatomic_read(&s->copy_range_ok)) {
+        qatomic_set(&s->copy_range, false);
+    }
+}
+
+/*
+ * The copy coroutines may run in several iothreads, so everything they
+ * share is either accessed under s->lock or atomically.
+ */
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int ret, i;
-    int index = -1;
-
-    for (i = 0; i < s->num_coroutines; i++) {
-        if (s->co[i] == qemu_coroutine_self()) {
-            index = i;
-            break;
-        }
-    }
-    assert(index >= 0);
+    uint8_t *compressed_buf = NULL;
+    size_t compressed_size = s->cluster_sectors * BDRV_SECTOR_SIZE;
+    int ret;
 
-    s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->compressed) {
+        compressed_buf = g_malloc(compressed_size);
+    }
 
     while (1) {
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        ssize_t compressed_len = -ENOTSUP;
 
         qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+        if (qatomic_read(&s->ret) != -EINPROGRESS ||
+            s->sector_num >= s->total_sectors) {
             qemu_co_mutex_unlock(&s->lock);
             break;
         }
@@ -2002,8 +2026,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
             n = convert_iteration_sectors(s, s->sector_num);
         }
         if (n < 0) {
+            qatomic_set(&s->ret, n);
             qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
             break;
         }
         /* save current sector and allocation status to local variables */
@@ -2015,81 +2039,184 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
         }
+        qemu_co_mutex_unlock(&s->lock);
 
+        copy_range = qatomic_read(&s->copy_range) && status == BLK_DATA;
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                qatomic_set(&s->ret, ret);
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
+        if (s->compressed && status == BLK_DATA &&
+            qatomic_read(&s->ret) == -EINPROGRESS &&
+            (!s->min_sparse || !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))) {
+            /*
+             * Compress while other coroutines still wait for their turn, so
+             * that only the write that allocates the cluster is ordered.
+             */
+            compressed_len = blk_co_compress(s->target,
+                                             sector_num << BDRV_SECTOR_BITS,
+                                             n << BDRV_SECTOR_BITS, buf,
+                                             compressed_buf, compressed_size);
+        }
+
         if (s->wr_in_order) {
             /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
-                qemu_coroutine_yield();
+            qemu_co_mutex_lock(&s->lock);
+            while (s->wr_offs != sector_num &&
+                   qatomic_read(&s->ret) == -EINPROGRESS) {
+                qemu_co_queue_wait(&s->wr_queue, &s->lock);
             }
-            s->wait_sector_num[index] = -1;
+            qemu_co_mutex_unlock(&s->lock);
         }
 
-        if (s->ret == -EINPROGRESS) {
+        if (qatomic_read(&s->ret) == -EINPROGRESS) {
             if (copy_range) {
                 WITH_GRAPH_RDLOCK_GUARD() {
                     ret = convert_co_copy_range(s, sector_num, n);
                 }
                 if (ret) {
-                    s->copy_range = false;
+                    /* Copy this chunk the normal way */
+                    convert_copy_range_failed(s);
+                    copy_range = false;
                     goto retry;
                 }
-            } else {
+                qatomic_set(&s->copy_range_ok, true);
+            } else if (compressed_len >= 0) {
+                ret = blk_co_pwrite_compressed_data(
+                    s->target, sector_num << BDRV_SECTOR_BITS,
+                    n << BDRV_SECTOR_BITS, compressed_buf, compressed_len);
+            } else if (compressed_len == -ENOSPC) {
+                /* Incompressible, write it as a normal cluster */
+                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                                    n << BDRV_SECTOR_BITS, buf, 0);
+            } else if (compressed_len == -ENOTSUP) {
                 ret = convert_co_write(s, sector_num, n, buf, status);
+            } else {
+                ret = compressed_len;
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                qatomic_set(&s->ret, ret);
             }
         }
 
         if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
-             * for this write to complete */
+            /* wake up the coroutine that waits for this write to complete */
+            qemu_co_mutex_lock(&s->lock);
             s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            qemu_co_queue_restart_all(&s->wr_queue);
+            qemu_co_mutex_unlock(&s->lock);
         }
     }
 
     qemu_vfree(buf);
-    s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
-        s->ret = 0;
+    g_free(compressed_buf);
+    if (qatomic_fetch_dec(&s->running_coroutines) == 1) {
+        /* the convert job finished successfully unless an error was set */
+        qatomic_cmpxchg(&s->ret, -EINPROGRESS, 0);
+        aio_wait_kick();
+    }
+}
+
+/* Returns the file node below @bs, or NULL if it is not a plain file */
+static BlockDriverState * GRAPH_RDLOCK convert_file_bs(BlockDriverState *bs)
+{
+    while (bs && !bs->drv->protocol_name) {
+        bs = bdrv_primary_bs(bs);
+    }
+    if (!bs || strcmp(bs->drv->format_name, "file")) {
+        return NULL;
+    }
+    return bs;
+}
+
+/*
+ * Whether the filesystem can share the extents of the file @src with a file
+ * in the directory of @target.  Try to clone the first block of @src into an
+ * unnamed temporary file there, which goes away when it is closed.
+ */
+static bool convert_probe_clone(const char *src, const char *target)
+{
+#if defined(FICLONERANGE) && defined(O_TMPFILE)
+    g_autofree char *dir = g_path_get_dirname(target);
+    struct file_clone_range range;
+    struct stat st;
+    int src_fd, tmp_fd;
+    bool ret = false;
+
+    src_fd = qemu_open_old(src, O_RDONLY);
+    if (src_fd < 0) {
+        return false;
+    }
+
+    tmp_fd = qemu_open_old(dir, O_TMPFILE | O_WRONLY);
+    if (tmp_fd >= 0) {
+        if (fstat(src_fd, &st) == 0 && st.st_size >= st.st_blksize) {
+            range = (struct file_clone_range) {
+                .src_fd         = src_fd,
+                .src_offset     = 0,
+                .src_length     = st.st_blksize,
+                .dest_offset    = 0,
+            };
+            ret = ioctl(tmp_fd, FICLONERANGE, &range) == 0;
+        }
+        qemu_close(tmp_fd);
+    }
+
+    qemu_close(src_fd);
+    return ret;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Copy offloading pays off by default only if the filesystem of the source
+ * and the target shares extents between them.  copy_file_range() alone
+ * would still write all data parts to the target, and offloading skips the
+ * zero detection that keeps such data sparse, so it is left to -C then.
+ */
+static bool convert_can_offload(ImgConvertState *s)
+{
+    BlockDriverState *bs;
+    const char *target;
+    struct stat st_target, st;
+    int i;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs = convert_file_bs(blk_bs(s->target));
+    if (!bs || stat(bs->filename, &st_target) < 0) {
+        return false;
+    }
+    target = bs->filename;
+
+    for (i = 0; i < s->src_num; i++) {
+        bs = convert_file_bs(blk_bs(s->src[i]));
+        if (!bs || stat(bs->filename, &st) < 0 ||
+            st.st_dev != st_target.st_dev ||
+            !convert_probe_clone(bs->filename, target)) {
+            return false;
+        }
     }
+
+    return true;
 }
 
 static int convert_do_copy(ImgConvertState *s)
@@ -2134,16 +2261,20 @@ static int convert_do_copy(ImgConvertState *s)
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->wr_queue);
+    s->running_coroutines = s->num_coroutines;
     for (i = 0; i < s->num_coroutines; i++) {
-        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
-    }
+        Coroutine *co = qemu_coroutine_create(convert_co_do_copy, s);
+        AioContext *ctx = qemu_get_aio_context();
 
-    while (s->running_coroutines) {
-        main_loop_wait(false);
+        if (s->num_iothreads) {
+            ctx = iothread_get_aio_context(s->iothreads[i % s->num_iothreads]);
+        }
+        aio_co_enter(ctx, co);
     }
 
+    AIO_WAIT_WHILE_UNLOCKED(NULL, qatomic_read(&s->running_coroutines));
+
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, 0, NULL);
@@ -2233,7 +2364,7 @@ static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
 
 static int img_convert(int argc, char **argv)
 {
-    int c, bs_i, flags, src_flags = BDRV_O_NO_SHARE;
+    int c, bs_i, i, flags, src_flags = BDRV_O_NO_SHARE;
     const char *fmt = NULL, *out_fmt = NULL, *cache = "unsafe",
                *src_cache = BDRV_DEFAULT_CACHE, *out_baseimg = NULL,
                *out_filename, *out_baseimg_param, *snapshot_name = NULL,
@@ -2275,6 +2406,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"iothreads", required_argument, 0, OPTION_IOTHREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2541,14 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_IOTHREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_iothreads) ||
+                s.num_iothreads < 1 || s.num_iothreads > MAX_COROUTINES) {
+                error_report("Invalid number of iothreads. Allowed number of"
+                             " iothreads is between 1 and %d", MAX_COROUTINES);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2416,6 +2556,16 @@ static int img_convert(int argc, char **argv)
         out_fmt = "raw";
     }
 
+    if (s.num_iothreads > s.num_coroutines) {
+        error_report("Cannot use more iothreads than coroutines (-m)");
+        goto fail_getopt;
+    }
+
+    if (s.num_iothreads && rate_limit) {
+        error_report("Cannot use a rate limit with --iothreads");
+        goto fail_getopt;
+    }
+
     if (skip_broken && !bitmaps) {
         error_report("Use of --skip-broken-bitmaps requires --bitmaps");
         goto fail_getopt;
@@ -2781,6 +2931,41 @@ static int img_convert(int argc, char **argv)
 
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
+    } else if (!s.copy_range && !s.compressed && !s.salvage &&
+               (!explict_min_sparse || !s.min_sparse) &&
+               convert_can_offload(&s)) {
+        /*
+         * Like with -C, the data is not read at all, so holes and zeroes
+         * only come from the block status of the source.  An explicit -S
+         * asks for zero detection in the data, which needs the read.
+         */
+        s.copy_range = true;
+    }
+
+    if (s.num_iothreads) {
+        /*
+         * The layout of a raw or LUKS target does not depend on the order of
+         * the writes, so let all iothreads write (and encrypt) at the same
+         * time.  Other formats allocate clusters in the order of the writes;
+         * for them, compression still runs in parallel before the ordered
+         * write (see convert_co_do_copy()).
+         */
+        if (!strcmp(out_bs->drv->format_name, "raw") ||
+            !strcmp(out_bs->drv->format_name, "luks")) {
+            s.wr_in_order = false;
+        }
+
+        s.iothreads = g_new0(IOThread *, s.num_iothreads);
+        for (i = 0; i < s.num_iothreads; i++) {
+            g_autofree char *id = g_strdup_printf("img-convert-%d", i);
+
+            s.iothreads[i] = iothread_create(id, &local_err);
+            if (!s.iothreads[i]) {
+                error_report_err(local_err);
+                ret = -1;
+                goto out;
+            }
+        }
     }
 
     ret = convert_do_copy(&s);
@@ -2807,6 +2992,12 @@ out:
     }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
+    for (i = 0; s.iothreads && i < s.num_iothreads; i++) {
+        if (s.iothreads[i]) {
+            iothread_destroy(s.iothreads[i]);
+        }
+    }
+    g_free(s.iothreads);
 fail_getopt:
     qemu_opts_del(sn_opts);
     g_free(options);
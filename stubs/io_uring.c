@@ -21,7 +21,7 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
     abort();
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(const LuringParams *params, Error **errp)
 {
     abort();
 }
@@ -30,3 +30,13 @@ void luring_cleanup(LuringState *s)
 {
     abort();
 }
+
+bool luring_params_equal(const LuringParams *a, const LuringParams *b)
+{
+    abort();
+}
+
+const LuringParams *luring_get_params(LuringState *s)
+{
+    abort();
+}
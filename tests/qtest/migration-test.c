@@ -1323,6 +1323,24 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *
+test_migrate_postcopy_prefetch_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_int(from, "postcopy-prefetch-pages", 64);
+
+    return NULL;
+}
+
+static void test_postcopy_preempt_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .start_hook = test_migrate_postcopy_prefetch_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -1953,6 +1971,56 @@ static void test_precopy_unix_xbzrle(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_postpone_hot_pages_start(QTestState *from,
+                                      QTestState *to)
+{
+    migrate_set_capability(from, "postpone-hot-pages", true);
+    migrate_set_capability(to, "postpone-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_precopy_unix_postpone_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_migrate_postpone_hot_pages_start,
+        .iterations = 2,
+        /*
+         * The guest needs to keep dirtying pages for the predictor to
+         * find some hot regions.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void *
+test_migrate_dirty_sync_threads_start(QTestState *from,
+                                      QTestState *to)
+{
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
+
+    return NULL;
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_migrate_dirty_sync_threads_start,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_file(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
@@ -2131,6 +2199,49 @@ static void test_precopy_tcp_plain(void)
     test_precopy_common(&args);
 }
 
+static void check_downtime_breakdown(QTestState *who, bool source)
+{
+    QDict *rsp;
+    QList *phases, *sections;
+    const QListEntry *entry;
+
+    rsp = qtest_qmp_assert_success_ref(
+        who, "{ 'execute': 'query-migrate-downtime-breakdown' }");
+    phases = qdict_get_qlist(rsp, "phases");
+    g_assert_cmpint(qlist_size(phases), ==, 6);
+    sections = qdict_get_qlist(rsp, "sections");
+    g_assert(!qlist_empty(sections));
+
+    QLIST_FOREACH_ENTRY(sections, entry) {
+        QDict *section = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (source) {
+            g_assert_cmpint(qdict_get_int(section, "load-time"), ==, 0);
+        } else {
+            g_assert_cmpint(qdict_get_int(section, "save-time"), ==, 0);
+        }
+    }
+    qobject_unref(rsp);
+}
+
+static void test_migrate_downtime_breakdown_finish(QTestState *from,
+                                                   QTestState *to,
+                                                   void *opaque)
+{
+    check_downtime_breakdown(from, true);
+    check_downtime_breakdown(to, false);
+}
+
+static void test_precopy_tcp_downtime_breakdown(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .finish_hook = test_migrate_downtime_breakdown_finish,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void *test_migrate_switchover_ack_start(QTestState *from, QTestState *to)
 {
 
@@ -2635,6 +2746,25 @@ test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    test_migrate_xbzrle_start(from, to);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_device_state_start(QTestState *from,
+                                                    QTestState *to)
+{
+    migrate_set_capability(from, "multifd-device-state", true);
+    migrate_set_capability(to, "multifd-device-state", true);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -2649,6 +2779,54 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+/*
+ * Fill the first 16 MB of the guest's test memory with random data, so
+ * that adaptive compression has incompressible pages to send raw.  The
+ * first byte of each page is left alone, the guest keeps incrementing it.
+ */
+#define RANDOM_MEM_SIZE (16 * 1024 * 1024)
+
+static void fill_guest_ram_random(QTestState *who)
+{
+    g_autofree uint8_t *buf = g_malloc(TEST_MEM_PAGE_SIZE - 1);
+    unsigned address;
+    int i;
+
+    for (address = start_address;
+         address < start_address + RANDOM_MEM_SIZE && address < end_address;
+         address += TEST_MEM_PAGE_SIZE)
+    {
+        for (i = 0; i < TEST_MEM_PAGE_SIZE - 1; i++) {
+            buf[i] = g_test_rand_int_range(0, 256);
+        }
+        qtest_bufwrite(who, address + 1, buf, TEST_MEM_PAGE_SIZE - 1);
+    }
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_zlib_adaptive_start(QTestState *from,
+                                                     QTestState *to)
+{
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    migrate_set_capability(from, "multifd-adaptive-compression", true);
+    migrate_set_capability(to, "multifd-adaptive-compression", true);
+
+    fill_guest_ram_random(from);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
+}
+
+static void
+test_migrate_precopy_tcp_multifd_adaptive_finish(QTestState *from,
+                                                 QTestState *to,
+                                                 void *opaque)
+{
+    /* The random pages must not have been compressed */
+    g_assert_cmpint(read_ram_property_int(from, "multifd-raw-pages"), >=,
+                    RANDOM_MEM_SIZE / TEST_MEM_PAGE_SIZE / 2);
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -2661,6 +2839,18 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-lz4-level", 2);
+    migrate_set_parameter_int(to, "multifd-lz4-level", 2);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
 static void test_multifd_tcp_uri_none(void)
 {
     MigrateCommon args = {
@@ -2706,6 +2896,31 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        .iterations = 2,
+        /*
+         * XBZRLE needs pages to be modified when doing the 2nd+ round
+         * iteration to have real data pushed to the stream.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_device_state(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_device_state_start,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -2730,6 +2945,17 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_zlib_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zlib_adaptive_start,
+        .finish_hook = test_migrate_precopy_tcp_multifd_adaptive_finish,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -2741,6 +2967,22 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+        /*
+         * lz4 compresses each page on its own, make sure a guest page
+         * changing under the compressor is handled too.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_GNUTLS
 static void *
 test_migrate_multifd_tcp_tls_psk_start_match(QTestState *from,
@@ -3486,6 +3728,8 @@ int main(int argc, char **argv)
                            test_postcopy_preempt);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
+        migration_test_add("/migration/postcopy/preempt/prefetch",
+                           test_postcopy_preempt_prefetch);
 #ifndef _WIN32
         migration_test_add("/migration/postcopy/recovery/double-failures",
                            test_postcopy_recovery_double_fail);
@@ -3500,6 +3744,10 @@ int main(int argc, char **argv)
                        test_precopy_unix_plain);
     migration_test_add("/migration/precopy/unix/xbzrle",
                        test_precopy_unix_xbzrle);
+    migration_test_add("/migration/precopy/unix/postpone-hot-pages",
+                       test_precopy_unix_postpone_hot_pages);
+    migration_test_add("/migration/precopy/unix/dirty-sync-threads",
+                       test_precopy_unix_dirty_sync_threads);
     migration_test_add("/migration/precopy/file",
                        test_precopy_file);
     migration_test_add("/migration/precopy/file/offset",
@@ -3553,6 +3801,8 @@ int main(int argc, char **argv)
 #endif /* CONFIG_GNUTLS */
 
     migration_test_add("/migration/precopy/tcp/plain", test_precopy_tcp_plain);
+    migration_test_add("/migration/precopy/tcp/plain/downtime-breakdown",
+                       test_precopy_tcp_downtime_breakdown);
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
@@ -3618,14 +3868,24 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
+    migration_test_add("/migration/multifd/tcp/plain/device-state",
+                       test_multifd_tcp_device_state);
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
                        test_multifd_tcp_zlib);
+    migration_test_add("/migration/multifd/tcp/plain/zlib/adaptive",
+                       test_multifd_tcp_zlib_adaptive);
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    migration_test_add("/migration/multifd/tcp/plain/lz4",
+                       test_multifd_tcp_lz4);
+#endif
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/multifd/tcp/tls/psk/match",
                        test_multifd_tcp_tls_psk_match);
@@ -20,6 +20,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 
 static char buffer[8 * 1024 * 1024];
 
@@ -69,10 +70,55 @@ static void test_2(void)
     }
 }
 
+static void test_batch_1(void)
+{
+    const size_t page = 4096;
+    const void *bufs[100];
+    DECLARE_BITMAP(zero, 100);
+    size_t i, n;
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        bufs[i] = buffer + i * page;
+    }
+
+    /* All buffers are zero.  */
+    n = buffer_is_zero_batch(bufs, ARRAY_SIZE(bufs), page, zero);
+    g_assert_cmpuint(n, ==, ARRAY_SIZE(bufs));
+    g_assert(bitmap_full(zero, ARRAY_SIZE(bufs)));
+
+    /* Mark every third buffer, at different offsets.  */
+    for (i = 0; i < ARRAY_SIZE(bufs); i += 3) {
+        buffer[i * page + (i * 37) % page] = 1;
+    }
+    n = buffer_is_zero_batch(bufs, ARRAY_SIZE(bufs), page, zero);
+    g_assert_cmpuint(n, ==, ARRAY_SIZE(bufs) - 34);
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        g_assert(test_bit(i, zero) == (i % 3 != 0));
+    }
+    for (i = 0; i < ARRAY_SIZE(bufs); i += 3) {
+        buffer[i * page + (i * 37) % page] = 0;
+    }
+
+    /* Small buffers take the out of line path.  */
+    buffer[page + 7] = 1;
+    n = buffer_is_zero_batch(bufs, 2, 64, zero);
+    g_assert_cmpuint(n, ==, 1);
+    g_assert(test_bit(0, zero) && !test_bit(1, zero));
+    buffer[page + 7] = 0;
+}
+
+static void test_batch(void)
+{
+    do {
+        test_batch_1();
+    } while (test_buffer_is_zero_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/cutils/bufferiszero", test_2);
+    g_test_add_func("/cutils/bufferiszero/batch", test_batch);
 
     return g_test_run();
 }
@@ -0,0 +1,109 @@
+/*
+ * qcow2 metadata cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/qcow2.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+
+/* Two shards of QCOW2_CACHE_SHARD_MIN_ENTRIES entries */
+#define SHARD_ENTRIES 16
+#define CACHE_ENTRIES (2 * SHARD_ENTRIES)
+
+static BlockBackend *open_qcow2(char **img_path)
+{
+    QDict *options = qdict_new();
+    int fd;
+
+    fd = g_file_open_tmp("qemu-tst-qcow2-cache-XXXXXX", img_path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    bdrv_img_create(*img_path, "qcow2", NULL, NULL, NULL, 64 * MiB,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    qdict_put_str(options, "driver", "qcow2");
+    return blk_new_open(*img_path, NULL, options, BDRV_O_RDWR, &error_abort);
+}
+
+/*
+ * Tables with an even cluster index all belong to the first shard.  Once
+ * all its entries are referenced, further tables must borrow entries of
+ * the second shard instead of aborting, and must still be found there.
+ */
+static void test_shard_borrow(void)
+{
+    g_autofree char *img_path = NULL;
+    void *tables[SHARD_ENTRIES + SHARD_ENTRIES / 2];
+    BlockBackend *blk = open_qcow2(&img_path);
+    BlockDriverState *bs = blk_bs(blk);
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset;
+    Qcow2Cache *c;
+    void *table;
+    int i, j, ret;
+
+    bdrv_graph_rdlock_main_loop();
+
+    c = qcow2_cache_create(bs, CACHE_ENTRIES, s->cluster_size);
+    g_assert(c);
+
+    for (i = 0; i < ARRAY_SIZE(tables); i++) {
+        offset = (uint64_t)(2 * i + 2) * s->cluster_size;
+        ret = qcow2_cache_get_empty(bs, c, offset, &tables[i]);
+        g_assert_cmpint(ret, ==, 0);
+        for (j = 0; j < i; j++) {
+            g_assert(tables[j] != tables[i]);
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(tables); i++) {
+        offset = (uint64_t)(2 * i + 2) * s->cluster_size;
+        g_assert(qcow2_cache_is_table_offset(c, offset) == tables[i]);
+
+        /* A second reference must use the same entry, not load it again */
+        ret = qcow2_cache_get(bs, c, offset, &table);
+        g_assert_cmpint(ret, ==, 0);
+        g_assert(table == tables[i]);
+        qcow2_cache_put(c, &table);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(tables); i++) {
+        qcow2_cache_put(c, &tables[i]);
+    }
+
+    /* The second shard can still cache a full shard of its own tables */
+    for (i = 0; i < SHARD_ENTRIES; i++) {
+        offset = (uint64_t)(2 * i + 1) * s->cluster_size;
+        ret = qcow2_cache_get_empty(bs, c, offset, &tables[i]);
+        g_assert_cmpint(ret, ==, 0);
+    }
+    for (i = 0; i < SHARD_ENTRIES; i++) {
+        qcow2_cache_put(c, &tables[i]);
+    }
+
+    qcow2_cache_destroy(c);
+
+    bdrv_graph_rdunlock_main_loop();
+
+    blk_unref(blk);
+    unlink(img_path);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/qcow2-cache/shard-borrow", test_shard_borrow);
+
+    return g_test_run();
+}
@@ -21,6 +21,7 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/defer-call.h"
 #include "trace.h"
 #include "aio-posix.h"
 
@@ -619,6 +620,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
     assert(in_aio_context_home_thread(ctx == iohandler_get_aio_context() ?
                                       qemu_get_aio_context() : ctx));
 
+    /*
+     * A nested aio_poll() may be waiting for requests that the handlers of
+     * the outer one queued for submission, so submit them now.
+     */
+    defer_call_flush();
+
     qemu_lockcnt_inc(&ctx->list_lock);
 
     if (ctx->poll_max_ns) {
@@ -720,7 +727,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
     }
 
     progress |= aio_bh_poll(ctx);
+
+    /*
+     * Batch up the requests of all handlers that are ready in this iteration,
+     * e.g. of every virtqueue that this AioContext serves, so that each
+     * Linux AIO or io_uring context submits them with a single system call.
+     */
+    defer_call_begin();
     progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
+    defer_call_end();
 
     aio_free_deleted_handlers(ctx);
 
@@ -384,6 +384,14 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+    while (ctx->linux_io_uring_extra) {
+        LuringState *s = ctx->linux_io_uring_extra->data;
+
+        ctx->linux_io_uring_extra = g_slist_delete_link(
+            ctx->linux_io_uring_extra, ctx->linux_io_uring_extra);
+        luring_detach_aio_context(s, ctx);
+        luring_cleanup(s);
+    }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
@@ -468,7 +476,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(NULL, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -482,6 +490,58 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
     assert(ctx->linux_io_uring);
     return ctx->linux_io_uring;
 }
+
+static LuringState *aio_find_linux_io_uring(AioContext *ctx,
+                                            const LuringParams *params)
+{
+    GSList *l;
+
+    for (l = ctx->linux_io_uring_extra; l; l = l->next) {
+        if (luring_params_equal(luring_get_params(l->data), params)) {
+            return l->data;
+        }
+    }
+    return NULL;
+}
+
+LuringState *aio_setup_linux_io_uring_params(AioContext *ctx,
+                                             const LuringParams *params,
+                                             Error **errp)
+{
+    LuringState *s;
+
+    if (luring_params_equal(params, NULL)) {
+        return aio_setup_linux_io_uring(ctx, errp);
+    }
+
+    s = aio_find_linux_io_uring(ctx, params);
+    if (s) {
+        return s;
+    }
+
+    s = luring_init(params, errp);
+    if (!s) {
+        return NULL;
+    }
+
+    luring_attach_aio_context(s, ctx);
+    ctx->linux_io_uring_extra = g_slist_prepend(ctx->linux_io_uring_extra, s);
+    return s;
+}
+
+LuringState *aio_get_linux_io_uring_params(AioContext *ctx,
+                                           const LuringParams *params)
+{
+    LuringState *s;
+
+    if (luring_params_equal(params, NULL)) {
+        return aio_get_linux_io_uring(ctx);
+    }
+
+    s = aio_find_linux_io_uring(ctx, params);
+    assert(s);
+    return s;
+}
 #endif
 
 void aio_notify(AioContext *ctx)
@@ -602,6 +662,7 @@ AioContext *aio_context_new(Error **errp)
 
 #ifdef CONFIG_LINUX_IO_URING
     ctx->linux_io_uring = NULL;
+    ctx->linux_io_uring_extra = NULL;
 #endif
 
     ctx->thread_pool = NULL;
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "qemu/bitmap.h"
 #include "host/cpuinfo.h"
 
 typedef bool (*biz_accel_fn)(const void *, size_t);
@@ -178,18 +179,64 @@ buffer_zero_avx2(const void *buf, size_t len)
 }
 #endif /* CONFIG_AVX2_OPT */
 
+#ifdef CONFIG_AVX512F_OPT
+#define AVX512_REASSOC_BARRIER(vec0, vec1) asm("" : "+v"(vec0), "+v"(vec1))
+
+static bool __attribute__((target("avx512f")))
+buffer_zero_avx512(const void *buf, size_t len)
+{
+    /* Unaligned loads at head/tail.  */
+    __m512i v = _mm512_loadu_si512(buf);
+    __m512i w = _mm512_loadu_si512(buf + len - 64);
+    /* Align head/tail to 64-byte boundaries.  */
+    const __m512i *p = QEMU_ALIGN_PTR_DOWN(buf + 64, 64);
+    const __m512i *e = QEMU_ALIGN_PTR_DOWN(buf + len - 1, 64);
+
+    /*
+     * Collect a partial block at tail end.
+     * With the head and tail removed, e - p >= 2, and e[-3] still
+     * lies within the buffer.
+     */
+    v |= e[-1]; w |= e[-2];
+    AVX512_REASSOC_BARRIER(v, w);
+    v |= e[-3]; v |= w;
+
+    /* Loop over complete 256-byte blocks.  */
+    for (; p < e - 3; p += 4) {
+        if (unlikely(_mm512_test_epi64_mask(v, v))) {
+            return false;
+        }
+        v = p[0]; w = p[1];
+        AVX512_REASSOC_BARRIER(v, w);
+        v |= p[2]; w |= p[3];
+        AVX512_REASSOC_BARRIER(v, w);
+        v |= w;
+    }
+
+    return !_mm512_test_epi64_mask(v, v);
+}
+#endif /* CONFIG_AVX512F_OPT */
+
 static biz_accel_fn const accel_table[] = {
     buffer_is_zero_int_ge256,
     buffer_zero_sse2,
 #ifdef CONFIG_AVX2_OPT
     buffer_zero_avx2,
 #endif
+#ifdef CONFIG_AVX512F_OPT
+    buffer_zero_avx512,
+#endif
 };
 
 static unsigned best_accel(void)
 {
     unsigned info = cpuinfo_init();
 
+#ifdef CONFIG_AVX512F_OPT
+    if (info & CPUINFO_AVX512F) {
+        return ARRAY_SIZE(accel_table) - 1;
+    }
+#endif
 #ifdef CONFIG_AVX2_OPT
     if (info & CPUINFO_AVX2) {
         return 2;
@@ -299,6 +346,47 @@ bool buffer_is_zero_ge256(const void *buf, size_t len)
     return buffer_is_zero_accel(buf, len);
 }
 
+size_t buffer_is_zero_batch(const void * const *bufs, size_t n, size_t len,
+                            unsigned long *zero)
+{
+    biz_accel_fn accel = buffer_is_zero_accel;
+    size_t i, count = 0;
+
+    bitmap_zero(zero, n);
+
+    if (unlikely(len < 256)) {
+        for (i = 0; i < n; i++) {
+            if (buffer_is_zero_ool(bufs[i], len)) {
+                set_bit(i, zero);
+                count++;
+            }
+        }
+        return count;
+    }
+
+    for (i = 0; i < n; i++) {
+        const char *buf = bufs[i];
+
+        /*
+         * Start pulling in the cachelines sampled for the next buffer
+         * while this one is being tested.
+         */
+        if (i + 1 < n) {
+            const char *next = bufs[i + 1];
+
+            __builtin_prefetch(next);
+            __builtin_prefetch(next + len / 2);
+            __builtin_prefetch(next + len - 1);
+        }
+
+        if (buffer_is_zero_sample3(buf, len) && accel(buf, len)) {
+            set_bit(i, zero);
+            count++;
+        }
+    }
+    return count;
+}
+
 bool test_buffer_is_zero_next_accel(void)
 {
     if (accel_index != 0) {
@@ -121,6 +121,31 @@ void defer_call_begin(void)
     thread_state->nesting_level++;
 }
 
+/* Invoke and forget the deferred functions of this thread */
+static void defer_call_run(DeferCallThreadState *thread_state)
+{
+    GArray *array = thread_state->deferred_call_array;
+    if (!array) {
+        return;
+    }
+
+    /*
+     * Functions may defer more calls while running if the section is not
+     * over yet, possibly even themselves.  Remove each entry before calling
+     * it, so that such calls are queued again instead of being mistaken for
+     * duplicates, and keep going until nothing is left.
+     *
+     * Removing elements keeps the allocated memory so that appending is cheap
+     * in the future.
+     */
+    while (array->len) {
+        DeferredCall fn = g_array_index(array, DeferredCall, 0);
+
+        g_array_remove_index(array, 0);
+        fn.fn(fn.opaque);
+    }
+}
+
 /**
  * defer_call_end: Run any pending defer_call() functions
  *
@@ -137,20 +162,27 @@ void defer_call_end(void)
         return;
     }
 
-    GArray *array = thread_state->deferred_call_array;
-    if (!array) {
-        return;
-    }
+    defer_call_run(thread_state);
+}
 
-    DeferredCall *fns = (DeferredCall *)array->data;
+/**
+ * defer_call_flush: Run pending defer_call() functions without ending the
+ * section
+ *
+ * Call this before waiting for something that a deferred function may be
+ * needed for, such as the completion of a request that has been queued but
+ * not submitted yet.  Calls deferred afterwards are batched up again until
+ * the outermost defer_call_end().
+ *
+ * Does nothing outside of a defer_call_begin()/defer_call_end() section.
+ */
+void defer_call_flush(void)
+{
+    DeferCallThreadState *thread_state = get_ptr_defer_call_thread_state();
 
-    for (guint i = 0; i < array->len; i++) {
-        fns[i].fn(fns[i].opaque);
+    if (thread_state->nesting_level == 0) {
+        return;
     }
 
-    /*
-     * This resets the array without freeing memory so that appending is cheap
-     * in the future.
-     */
-    g_array_set_size(array, 0);
+    defer_call_run(thread_state);
 }